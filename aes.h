@@ -1,5 +1,5 @@
 #ifndef AES_H
-#define EAS_H
+#define AES_H
 
 // Implemented from Wikipedia description and OpenAir HSS
 
@@ -42,143 +42,328 @@ static const uint8_t Xtime[256] = {
   251, 249, 255, 253, 243, 241, 247, 245, 235, 233, 239, 237, 227, 225, 231, 229
 };
 
+/*
+  32-bit T-tables: SubBytes, ShiftRows and MixColumns of a state column
+  become 4 table lookups, the state is 4 big-endian column words
+  Te0[x] = {2.S[x], S[x], S[x], 3.S[x]}, TeN = Te0 rotated by N bytes
+*/
+struct RijndaelTables {
+  uint32_t Te[4][256];
+
+  RijndaelTables() {
+    for (int x = 0; x < 256; x++) {
+      uint32_t s = S[x], s2 = Xtime[s], s3 = s2 ^ s;
+      uint32_t t = (s2 << 24) | (s << 16) | (s << 8) | s3;
+
+      for (int n = 0; n < 4; n++)
+        Te[n][x] = n == 0 ? t : (t >> (8 * n)) | (t << (32 - 8 * n));
+    }
+  }
+};
+static const RijndaelTables RijndaelT;
+
+static inline uint32_t RijndaelLoad(const uint8_t *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static inline void RijndaelStore(uint8_t *out, uint32_t w) {
+  out[0] = w >> 24;
+  out[1] = w >> 16;
+  out[2] = w >> 8;
+  out[3] = w;
+}
+
+static inline uint32_t RijndaelSubWord(uint32_t w) {
+  return ((uint32_t)S[w >> 24] << 24) | ((uint32_t)S[(w >> 16) & 0xff] << 16) |
+         ((uint32_t)S[(w >> 8) & 0xff] << 8) | S[w & 0xff];
+}
+
 /*-------------------------------------------------------------------
    Rijndael key schedule function. Takes 16-byte key and creates
-   all Rijndael's internal subkeys ready for encryption.
+   all Rijndael's internal subkeys ready for encryption: 4 words per
+   round key.
   -----------------------------------------------------------------*/
-static inline void RijndaelKeySchedule (const uint8_t key[16], uint8_t roundKeys[11][4][4]) {
+static inline void RijndaelKeySchedule (const uint8_t key[16], uint32_t roundKeys[44]) {
   //first round key equals key
-  for (int i = 0; i < 16; i++)
-    roundKeys[0][i & 0x03][i >> 2] = key[i];
+  for (int i = 0; i < 4; i++)
+    roundKeys[i] = RijndaelLoad(key + 4 * i);
 
   //now calculate round keys
   uint8_t roundConst = 1;
 
-  for (int i = 0; i < 10; i++) {
-    int next=i+1;
-    roundKeys[next][0][0] = S[roundKeys[i][1][3]]
-                            ^ roundKeys[i][0][0] ^ roundConst;
-    roundKeys[next][1][0] = S[roundKeys[i][2][3]]
-                            ^ roundKeys[i][1][0];
-    roundKeys[next][2][0] = S[roundKeys[i][3][3]]
-                            ^ roundKeys[i][2][0];
-    roundKeys[next][3][0] = S[roundKeys[i][0][3]]
-                            ^ roundKeys[i][3][0];
-
-    for (int j = 0; j < 4; j++) {
-      roundKeys[next][j][1] = roundKeys[i][j][1] ^ roundKeys[next][j][0];
-      roundKeys[next][j][2] = roundKeys[i][j][2] ^ roundKeys[next][j][1];
-      roundKeys[next][j][3] = roundKeys[i][j][3] ^ roundKeys[next][j][2];
-    }
-
+  for (int i = 4; i < 44; i += 4) {
+    uint32_t last = roundKeys[i - 1];
+    roundKeys[i] = roundKeys[i - 4] ^ RijndaelSubWord((last << 8) | (last >> 24))
+                   ^ ((uint32_t)roundConst << 24);
+    roundKeys[i + 1] = roundKeys[i - 3] ^ roundKeys[i];
+    roundKeys[i + 2] = roundKeys[i - 2] ^ roundKeys[i + 1];
+    roundKeys[i + 3] = roundKeys[i - 1] ^ roundKeys[i + 2];
     roundConst = Xtime[roundConst];
   }
+}
 
-  return;
+/*-------------------------------------------------------------------
+   Rijndael encryption function. Takes 16-byte input and creates
+   16-byte output (using round keys already derived from 16-byte
+   key).
+  -----------------------------------------------------------------*/
+static inline void RijndaelEncrypt ( const uint8_t input[16], uint8_t output[16], const uint32_t roundKeys[44]) {
+  const uint32_t (*Te)[256] = RijndaelT.Te;
+  uint32_t s0 = RijndaelLoad(input) ^ roundKeys[0];
+  uint32_t s1 = RijndaelLoad(input + 4) ^ roundKeys[1];
+  uint32_t s2 = RijndaelLoad(input + 8) ^ roundKeys[2];
+  uint32_t s3 = RijndaelLoad(input + 12) ^ roundKeys[3];
+
+  // do lots of full rounds
+  for (int r = 1; r <= 9; r++) {
+    const uint32_t *rk = roundKeys + 4 * r;
+    uint32_t t0 = Te[0][s0 >> 24] ^ Te[1][(s1 >> 16) & 0xff] ^ Te[2][(s2 >> 8) & 0xff] ^ Te[3][s3 & 0xff] ^ rk[0];
+    uint32_t t1 = Te[0][s1 >> 24] ^ Te[1][(s2 >> 16) & 0xff] ^ Te[2][(s3 >> 8) & 0xff] ^ Te[3][s0 & 0xff] ^ rk[1];
+    uint32_t t2 = Te[0][s2 >> 24] ^ Te[1][(s3 >> 16) & 0xff] ^ Te[2][(s0 >> 8) & 0xff] ^ Te[3][s1 & 0xff] ^ rk[2];
+    uint32_t t3 = Te[0][s3 >> 24] ^ Te[1][(s0 >> 16) & 0xff] ^ Te[2][(s1 >> 8) & 0xff] ^ Te[3][s2 & 0xff] ^ rk[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  // final round: no MixColumns
+  const uint32_t *rk = roundKeys + 40;
+  RijndaelStore(output, (((uint32_t)S[s0 >> 24] << 24) | ((uint32_t)S[(s1 >> 16) & 0xff] << 16) |
+                         ((uint32_t)S[(s2 >> 8) & 0xff] << 8) | S[s3 & 0xff]) ^ rk[0]);
+  RijndaelStore(output + 4, (((uint32_t)S[s1 >> 24] << 24) | ((uint32_t)S[(s2 >> 16) & 0xff] << 16) |
+                             ((uint32_t)S[(s3 >> 8) & 0xff] << 8) | S[s0 & 0xff]) ^ rk[1]);
+  RijndaelStore(output + 8, (((uint32_t)S[s2 >> 24] << 24) | ((uint32_t)S[(s3 >> 16) & 0xff] << 16) |
+                             ((uint32_t)S[(s0 >> 8) & 0xff] << 8) | S[s1 & 0xff]) ^ rk[2]);
+  RijndaelStore(output + 12, (((uint32_t)S[s3 >> 24] << 24) | ((uint32_t)S[(s0 >> 16) & 0xff] << 16) |
+                              ((uint32_t)S[(s1 >> 8) & 0xff] << 8) | S[s2 & 0xff]) ^ rk[3]);
 }
 
-/* Round key addition function */
-static inline void KeyAdd (uint8_t state[4][4], uint8_t roundKeys[11][4][4], int round) {
-  for (int i = 0; i < 4; i++)
-    for (int j = 0; j < 4; j++)
-      state[i][j] ^= roundKeys[round][i][j];
+/*
+  AES-NI version, for the x86 CPUs that have it (checked at run time,
+  so the same binary works everywhere)
+*/
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#define AES_NI_BUILD
 
-  return;
+// Next round key, from the previous one and its aeskeygenassist value
+__attribute__((target("aes,sse2")))
+static inline __m128i AesniExpand(__m128i key, __m128i assist) {
+  assist=_mm_shuffle_epi32(assist, 0xff);
+  key=_mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key=_mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key=_mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
 }
 
-/* Byte substitution transformation */
-static inline void ByteSub (uint8_t state[4][4]) {
-  for (int i = 0; i < 4; i++)
-    for (int j = 0; j < 4; j++)
-      state[i][j] = S[state[i][j]];
-
-  return;
-}
-
-/* Row shift transformation */
-static inline void ShiftRow (uint8_t state[4][4]) {
-  // left rotate row 1 by 1
-  uint8_t temp = state[1][0];
-  state[1][0]  = state[1][1];
-  state[1][1]  = state[1][2];
-  state[1][2]  = state[1][3];
-  state[1][3]  = temp;
-  //left rotate row 2 by 2
-  temp        = state[2][0];
-  state[2][0] = state[2][2];
-  state[2][2] = temp;
-  temp        = state[2][1];
-  state[2][1] = state[2][3];
-  state[2][3] = temp;
-  // left rotate row 3 by 3
-  temp        = state[3][0];
-  state[3][0] = state[3][3];
-  state[3][3] = state[3][2];
-  state[3][2] = state[3][1];
-  state[3][1] = temp;
-  return;
-}
-
-/* MixColumn transformation*/
-static inline void MixColumn ( uint8_t state[4][4]) {
-  // do one column at a time
-  for (int i = 0; i < 4; i++) {
-    uint8_t temp = state[0][i] ^ state[1][i] ^ state[2][i] ^ state[3][i];
-    uint8_t tmp0 = state[0][i];
-    // Xtime array does multiply by x in GF2^8
-    uint8_t tmp = Xtime[state[0][i] ^ state[1][i]];
-    state[0][i] ^= temp ^ tmp;
-    tmp = Xtime[state[1][i] ^ state[2][i]];
-    state[1][i] ^= temp ^ tmp;
-    tmp = Xtime[state[2][i] ^ state[3][i]];
-    state[2][i] ^= temp ^ tmp;
-    tmp = Xtime[state[3][i] ^ tmp0];
-    state[3][i] ^= temp ^ tmp;
+__attribute__((target("aes,sse2")))
+static inline void AesniKeySchedule(const uint8_t key[16], uint8_t roundKeys[11][16]) {
+  __m128i k[11];
+  k[0]=_mm_loadu_si128((const __m128i *)key);
+  // aeskeygenassist needs the round constant as an immediate value
+  k[1]=AesniExpand(k[0], _mm_aeskeygenassist_si128(k[0], 0x01));
+  k[2]=AesniExpand(k[1], _mm_aeskeygenassist_si128(k[1], 0x02));
+  k[3]=AesniExpand(k[2], _mm_aeskeygenassist_si128(k[2], 0x04));
+  k[4]=AesniExpand(k[3], _mm_aeskeygenassist_si128(k[3], 0x08));
+  k[5]=AesniExpand(k[4], _mm_aeskeygenassist_si128(k[4], 0x10));
+  k[6]=AesniExpand(k[5], _mm_aeskeygenassist_si128(k[5], 0x20));
+  k[7]=AesniExpand(k[6], _mm_aeskeygenassist_si128(k[6], 0x40));
+  k[8]=AesniExpand(k[7], _mm_aeskeygenassist_si128(k[7], 0x80));
+  k[9]=AesniExpand(k[8], _mm_aeskeygenassist_si128(k[8], 0x1b));
+  k[10]=AesniExpand(k[9], _mm_aeskeygenassist_si128(k[9], 0x36));
+
+  for (int i = 0; i < 11; i++)
+    _mm_storeu_si128((__m128i *)roundKeys[i], k[i]);
+}
+
+__attribute__((target("aes,sse2")))
+static inline void AesniEncrypt(const uint8_t input[16], uint8_t output[16], const uint8_t roundKeys[11][16]) {
+  __m128i state=_mm_xor_si128(_mm_loadu_si128((const __m128i *)input),
+                              _mm_load_si128((const __m128i *)roundKeys[0]));
+
+  for (int r = 1; r <= 9; r++)
+    state=_mm_aesenc_si128(state, _mm_load_si128((const __m128i *)roundKeys[r]));
+
+  state=_mm_aesenclast_si128(state, _mm_load_si128((const __m128i *)roundKeys[10]));
+  _mm_storeu_si128((__m128i *)output, state);
+}
+
+// Groups of 8 independent blocks, so the aesenc latencies overlap
+__attribute__((target("aes,sse2")))
+static inline void AesniEncryptBlocks(const uint8_t *input, uint8_t *output, size_t n,
+                                      const uint8_t roundKeys[11][16]) {
+  for (; n >= 8; n-=8, input+=128, output+=128) {
+    __m128i state[8];
+    __m128i k=_mm_load_si128((const __m128i *)roundKeys[0]);
+
+    for (int b = 0; b < 8; b++)
+      state[b]=_mm_xor_si128(_mm_loadu_si128((const __m128i *)input + b), k);
+
+    for (int r = 1; r <= 9; r++) {
+      k=_mm_load_si128((const __m128i *)roundKeys[r]);
+
+      for (int b = 0; b < 8; b++)
+        state[b]=_mm_aesenc_si128(state[b], k);
+    }
+
+    k=_mm_load_si128((const __m128i *)roundKeys[10]);
+
+    for (int b = 0; b < 8; b++)
+      _mm_storeu_si128((__m128i *)output + b, _mm_aesenclast_si128(state[b], k));
   }
 
-  return;
+  for (; n > 0; n--, input+=16, output+=16)
+    AesniEncrypt(input, output, roundKeys);
 }
+#endif
 
-/*-------------------------------------------------------------------
-   Rijndael encryption function. Takes 16-byte input and creates
-   16-byte output (using round keys already derived from 16-byte
-   key).
-  -----------------------------------------------------------------*/
-static inline void RijndaelEncrypt ( const uint8_t input[16], uint8_t output[16], uint8_t roundKeys[11][4][4]) {
-  uint8_t state[4][4];
-  int r;
+/*
+  Expanded key: the key schedule costs about as much as one block
+  encryption, compute it once for all the blocks under the same key
+  hw tells which implementation computed the round keys
+*/
+typedef struct {
+  union {
+    uint32_t roundKeys[44];
+    alignas(16) uint8_t hwRoundKeys[11][16];
+  };
+  bool hw;
+} aes_128_ctx_t;
 
-  // initialise state array from input byte string
-  for (int i = 0; i < 16; i++)
-    state[i & 0x3][i >> 2] = input[i];
+static inline void aes_128_init(aes_128_ctx_t *ctx, const uint8_t *key, bool hw) {
+#ifdef AES_NI_BUILD
 
-  // add first round_key
-  KeyAdd (state, roundKeys, 0);
+  if (hw) {
+    AesniKeySchedule(key, ctx->hwRoundKeys);
+    ctx->hw=true;
+    return;
+  }
 
-  // do lots of full rounds
-  for (r = 1; r <= 9; r++) {
-    ByteSub (state);
-    ShiftRow (state);
-    MixColumn (state);
-    KeyAdd (state, roundKeys, r);
+#endif
+  RijndaelKeySchedule(key, ctx->roundKeys);
+  ctx->hw=false;
+}
+
+static inline bool aes_128_self_test(bool hw);
+
+/*
+  Use AES-NI when the CPU has it and it gives the known answers,
+  UICC_AES=portable in the environment forces the portable code
+*/
+static inline bool aes_128_use_hw(void) {
+  static const bool hw = [] {
+#ifdef AES_NI_BUILD
+    const char *forced = getenv("UICC_AES");
+
+    if (forced != NULL && strcmp(forced, "portable") == 0)
+      return false;
+
+    __builtin_cpu_init();
+
+    if (!__builtin_cpu_supports("aes"))
+      return false;
+
+    if (!aes_128_self_test(true)) {
+      fprintf(stderr, "AES-NI gives wrong results, using the portable AES\n");
+      return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+  }();
+  return hw;
+}
+
+static inline void aes_128_init(aes_128_ctx_t *ctx, const uint8_t *key) {
+  aes_128_init(ctx, key, aes_128_use_hw());
+}
+
+static inline void aes_128_encrypt_block(const aes_128_ctx_t *ctx, const uint8_t *clear, uint8_t *cyphered) {
+#ifdef AES_NI_BUILD
+
+  if (ctx->hw) {
+    AesniEncrypt(clear, cyphered, ctx->hwRoundKeys);
+    return;
   }
 
-  // final round
-  ByteSub (state);
-  ShiftRow (state);
-  KeyAdd (state, roundKeys, r);
+#endif
+  RijndaelEncrypt (clear, cyphered, ctx->roundKeys);
+}
 
-  // produce output byte string from state array
-  for (int i = 0; i < 16; i++)
-    output[i] = state[i & 0x3][i >> 2];
+// n blocks under the same key (ECB), clear and cyphered may be the same buffer
+static inline void aes_128_encrypt_blocks(const aes_128_ctx_t *ctx, const uint8_t *clear,
+    uint8_t *cyphered, size_t n) {
+#ifdef AES_NI_BUILD
+
+  if (ctx->hw) {
+    AesniEncryptBlocks(clear, cyphered, n, ctx->hwRoundKeys);
+    return;
+  }
 
-  return;
+#endif
+
+  for (size_t i = 0; i < n; i++)
+    RijndaelEncrypt(clear + 16 * i, cyphered + 16 * i, ctx->roundKeys);
 }
 
 static inline void aes_128_encrypt_block(const uint8_t *key, const uint8_t *clear, uint8_t *cyphered) {
-  uint8_t roundKeys[11][4][4];
-  RijndaelKeySchedule(key, roundKeys);
-  RijndaelEncrypt (clear, cyphered, roundKeys);
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, key);
+  aes_128_encrypt_block(&ctx, clear, cyphered);
+}
+
+/*
+  Known answers: FIPS-197 appendix C.1, then E_K(OP) XOR OP = OPc of the
+  3GPP TS 35.207 test sets 1 to 6
+*/
+static inline bool aes_128_self_test(bool hw) {
+  static const uint8_t fips[3][16] = {
+    {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f},
+    {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff},
+    {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a},
+  };
+  // K, OP, OPc
+  static const uint8_t ts35207[6][3][16] = {
+    { {0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f, 0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc},
+      {0xcd, 0xc2, 0x02, 0xd5, 0x12, 0x3e, 0x20, 0xf6, 0x2b, 0x6d, 0x67, 0x6a, 0xc7, 0x2c, 0xb3, 0x18},
+      {0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e, 0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf} },
+    { {0x03, 0x96, 0xeb, 0x31, 0x7b, 0x6d, 0x1c, 0x36, 0xf1, 0x9c, 0x1c, 0x84, 0xcd, 0x6f, 0xfd, 0x16},
+      {0xff, 0x53, 0xba, 0xde, 0x17, 0xdf, 0x5d, 0x4e, 0x79, 0x30, 0x73, 0xce, 0x9d, 0x75, 0x79, 0xfa},
+      {0x53, 0xc1, 0x56, 0x71, 0xc6, 0x0a, 0x4b, 0x73, 0x1c, 0x55, 0xb4, 0xa4, 0x41, 0xc0, 0xbd, 0xe2} },
+    { {0xfe, 0xc8, 0x6b, 0xa6, 0xeb, 0x70, 0x7e, 0xd0, 0x89, 0x05, 0x75, 0x7b, 0x1b, 0xb4, 0x4b, 0x8f},
+      {0xdb, 0xc5, 0x9a, 0xdc, 0xb6, 0xf9, 0xa0, 0xef, 0x73, 0x54, 0x77, 0xb7, 0xfa, 0xdf, 0x83, 0x74},
+      {0x10, 0x06, 0x02, 0x0f, 0x0a, 0x47, 0x8b, 0xf6, 0xb6, 0x99, 0xf1, 0x5c, 0x06, 0x2e, 0x42, 0xb3} },
+    { {0x9e, 0x59, 0x44, 0xae, 0xa9, 0x4b, 0x81, 0x16, 0x5c, 0x82, 0xfb, 0xf9, 0xf3, 0x2d, 0xb7, 0x51},
+      {0x22, 0x30, 0x14, 0xc5, 0x80, 0x66, 0x94, 0xc0, 0x07, 0xca, 0x1e, 0xee, 0xf5, 0x7f, 0x00, 0x4f},
+      {0xa6, 0x4a, 0x50, 0x7a, 0xe1, 0xa2, 0xa9, 0x8b, 0xb8, 0x8e, 0xb4, 0x21, 0x01, 0x35, 0xdc, 0x87} },
+    { {0x4a, 0xb1, 0xde, 0xb0, 0x5c, 0xa6, 0xce, 0xb0, 0x51, 0xfc, 0x98, 0xe7, 0x7d, 0x02, 0x6a, 0x84},
+      {0x2d, 0x16, 0xc5, 0xcd, 0x1f, 0xdf, 0x6b, 0x22, 0x38, 0x35, 0x84, 0xe3, 0xbe, 0xf2, 0xa8, 0xd8},
+      {0xdc, 0xf0, 0x7c, 0xbd, 0x51, 0x85, 0x52, 0x90, 0xb9, 0x2a, 0x07, 0xa9, 0x89, 0x1e, 0x52, 0x3e} },
+    { {0x6c, 0x38, 0xa1, 0x16, 0xac, 0x28, 0x0c, 0x45, 0x4f, 0x59, 0x33, 0x2e, 0xe3, 0x5c, 0x8c, 0x4f},
+      {0x1b, 0xa0, 0x0a, 0x1a, 0x7c, 0x67, 0x00, 0xac, 0x8c, 0x3f, 0xf3, 0xe9, 0x6a, 0xd0, 0x87, 0x25},
+      {0x38, 0x03, 0xef, 0x53, 0x63, 0xb9, 0x47, 0xc6, 0xaa, 0xa2, 0x25, 0xe5, 0x8f, 0xae, 0x39, 0x34} },
+  };
+  aes_128_ctx_t ctx;
+  uint8_t out[16];
+  aes_128_init(&ctx, fips[0], hw);
+  aes_128_encrypt_block(&ctx, fips[1], out);
+
+  if (memcmp(out, fips[2], 16) != 0)
+    return false;
+
+  for (int i = 0; i < 6; i++) {
+    aes_128_init(&ctx, ts35207[i][0], hw);
+    aes_128_encrypt_block(&ctx, ts35207[i][1], out);
+
+    for (int j = 0; j < 16; j++)
+      if ((out[j] ^ ts35207[i][1][j]) != ts35207[i][2][j])
+        return false;
+  }
+
+  return true;
 }
 
 #endif
@@ -0,0 +1,204 @@
+/*
+  ICCID/IMSI/MSISDN range allocation, with a ledger of the issued ranges
+  and batch validation of identifier lists
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+#include <algorithm>
+#include <uicc.h>
+
+/*
+  Luhn check of many identifiers at once
+  The identifiers of the same length are transposed in a digit-major
+  buffer: the inner loop runs over the identifiers with a branchless
+  doubling, so the compiler vectorizes it.
+  Returns the index of each identifier that fails
+*/
+static inline vector<size_t> luhnCheckBatch(const vector<string> &ids) {
+  vector<size_t> failed;
+  map<size_t, vector<size_t>> byLength;
+
+  for (size_t i=0; i < ids.size(); i++)
+    byLength[ids[i].size()].push_back(i);
+
+  for (auto &group : byLength) {
+    size_t len=group.first, n=group.second.size();
+    vector<uint8_t> digits(len*n);
+    vector<uint16_t> sum(n, 0);
+    vector<uint8_t> badChar(n, 0);
+
+    for (size_t r=0; r < n; r++) {
+      const string &id=ids[group.second[r]];
+
+      for (size_t col=0; col < len; col++) {
+        uint8_t d=id[col]-'0';
+        badChar[r]|= d > 9;
+        digits[col*n+r]=d;
+      }
+    }
+
+    for (size_t col=0; col < len; col++) {
+      const uint8_t *d=&digits[col*n];
+
+      if (((len-1-col)&1) == 0)
+        for (size_t r=0; r < n; r++)
+          sum[r]+=d[r];
+      else
+        for (size_t r=0; r < n; r++)
+          sum[r]+=2*d[r] - 9*(d[r] > 4);
+    }
+
+    for (size_t r=0; r < n; r++)
+      if (badChar[r] || len == 0 || sum[r]%10 != 0)
+        failed.push_back(group.second[r]);
+  }
+
+  sort(failed.begin(), failed.end());
+  return failed;
+}
+
+/*
+  Issued ranges ledger: an append-only text file, one range per line
+  <kind> <first> <last>
+  kind is iccid, imsi or isdn, first and last are the numbers of the range
+  (without the Luhn digit for ICCIDs). Numbers of a different length are
+  different identifiers (leading zeros are significant).
+*/
+class IdentifierLedger {
+ public:
+  struct idRange {
+    string kind;
+    size_t width;
+    uint64_t first;
+    uint64_t last;
+  };
+  vector<idRange> ranges;
+
+  bool load(string path) {
+    fileName=path;
+    FILE *f=fopen(path.c_str(), "r");
+
+    if (f == NULL)
+      return errno == ENOENT;
+
+    char kind[16], first[32], last[32];
+
+    while (fscanf(f, "%15s %31s %31s", kind, first, last) == 3)
+      ranges.push_back({kind, strlen(first), strtoull(first, NULL, 10),
+                        strtoull(last, NULL, 10)});
+
+    fclose(f);
+    return true;
+  }
+
+  /*
+    Bitmap of the identifiers of [first, first+count) already issued:
+    one bit per identifier, 12.5 KB for a block of 100k
+  */
+  vector<uint64_t> issuedBitmap(string kind, size_t width, uint64_t first, uint64_t count) {
+    vector<uint64_t> bitmap((count+63)/64, 0);
+    uint64_t last=first+count-1;
+
+    for (auto &r : ranges) {
+      if (r.kind != kind || r.width != width || r.last < first || r.first > last)
+        continue;
+
+      uint64_t from=max(r.first, first)-first, to=min(r.last, last)-first;
+
+      for (uint64_t i=from; i <= to; ) {
+        // Whole words at once when aligned
+        if ((i&63) == 0 && to-i >= 63) {
+          bitmap[i/64]=~0ULL;
+          i+=64;
+        } else {
+          bitmap[i/64]|= 1ULL << (i&63);
+          i++;
+        }
+      }
+    }
+
+    return bitmap;
+  }
+
+  // Already issued identifiers of a block (at most max)
+  vector<uint64_t> collisions(string kind, size_t width, uint64_t first,
+                              uint64_t count, size_t maxNb=10) {
+    vector<uint64_t> found;
+    vector<uint64_t> bitmap=issuedBitmap(kind, width, first, count);
+
+    for (size_t w=0; w < bitmap.size() && found.size() < maxNb; w++)
+      for (uint64_t bits=bitmap[w]; bits && found.size() < maxNb; bits&=bits-1)
+        found.push_back(first + w*64 + __builtin_ctzll(bits));
+
+    return found;
+  }
+
+  // Which of these identifiers are already issued
+  vector<bool> issued(string kind, size_t width, const vector<uint64_t> &ids) {
+    vector<bool> ret(ids.size(), false);
+
+    if (ids.size() == 0)
+      return ret;
+
+    uint64_t low=*min_element(ids.begin(), ids.end());
+    uint64_t high=*max_element(ids.begin(), ids.end());
+
+    if (high-low < maxBitmapSpan) {
+      vector<uint64_t> bitmap=issuedBitmap(kind, width, low, high-low+1);
+
+      for (size_t i=0; i < ids.size(); i++)
+        ret[i]= (bitmap[(ids[i]-low)/64] >> ((ids[i]-low)&63)) & 1;
+    } else
+      // Scattered identifiers: too large for a bitmap
+      for (size_t i=0; i < ids.size(); i++)
+        for (auto &r : ranges)
+          if (r.kind == kind && r.width == width &&
+              ids[i] >= r.first && ids[i] <= r.last)
+            ret[i]=true;
+
+    return ret;
+  }
+
+  bool issue(string kind, size_t width, uint64_t first, uint64_t count) {
+    FILE *f=fopen(fileName.c_str(), "a");
+
+    if (f == NULL)
+      return false;
+
+    fprintf(f, "%s %0*" PRIu64 " %0*" PRIu64 "\n", kind.c_str(),
+            (int)width, first, (int)width, first+count-1);
+    bool ok= fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+    ranges.push_back({kind, width, first, first+count-1});
+    return ok;
+  }
+
+ private:
+  static const uint64_t maxBitmapSpan=1ULL << 28; // 32 MB
+  string fileName;
+};
+
+// A range start: digits only, small enough to count in 64 bits
+static inline bool parseRangeStart(string start, uint64_t count, uint64_t &value) {
+  if (start.size() == 0 || start.size() > 19 ||
+      start.find_first_not_of("0123456789") != string::npos)
+    return false;
+
+  value=strtoull(start.c_str(), NULL, 10);
+  // The last identifier must keep the same number of digits
+  string last=to_string(value+count-1);
+  return count > 0 && last.size() <= start.size();
+}
+
+static inline string formatId(uint64_t value, size_t width) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%0*" PRIu64, (int)width, value);
+  return buf;
+}
+#endif
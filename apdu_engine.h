@@ -0,0 +1,484 @@
+/*
+  Many card readers driven by one thread: each reader is a non-blocking
+  state machine on its serial port, epoll multiplexes all the readers,
+  a timerfd per reader gives the card timeouts
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef APDU_ENGINE_H
+#define APDU_ENGINE_H
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <memory>
+#include <uicc.h>
+
+/*
+  One reader and its card. An exchange does what UICC::write() then
+  UICC::read() do on a blocking port, as the bytes arrive:
+  sendHeader: the 5 bytes of the header, their echo drained (one wire for
+              Tx and Rx)
+  awaitProcedure: NULL procedure bytes (60) skipped, INS acknowledges,
+              SW1 refuses the command (awaitSw2 then)
+  sendBody: the data of the command, their echo drained
+  collect: the answer, until the expected size or a silence of silenceMs
+           (VTIME of the blocking port). After a body, NULL bytes come
+           first while the card computes (authentication)
+  A reset powers the card off (powerOff), then collects the ATR.
+  The handler is called once per reset() or exchange(), always from
+  ApduEngine::run(), it can start the next exchange of the reader.
+*/
+class ApduReader {
+ public:
+  // answer: data and SW, as UICC::read() returns them, error: NULL if none
+  typedef function<void(ApduReader &reader, const string &answer,
+                        const UICCError *error)> handler;
+  static const int silenceMs=100;
+  static const int powerOffMs=100;
+  static const int defaultTimeoutMs=1000;
+
+  string port;
+  string atr;
+  // Status word that ended the last card answer
+  uint16_t lastSW=0;
+  bool debug=false;
+
+  ApduReader(int epoll, uint64_t id, string portName):
+    port(portName), epollFd(epoll), index(id) {
+    char *debug_env=getenv("DEBUG");
+
+    if (debug_env != NULL &&
+        (debug_env[0] == 'Y' || debug_env[0] == 'y'))
+      debug=true;
+
+    timerFd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    Assert(timerFd >= 0, "timerfd_create() failed");
+    watch(timerFd, EPOLL_CTL_ADD, EPOLLIN, true);
+  }
+
+  ~ApduReader() {
+    closePort();
+    ::close(timerFd);
+  }
+
+  bool busy() const {
+    return state != idle;
+  }
+
+  // Power cycle the card, the answer is the ATR (also in atr)
+  void reset(handler h) {
+    start(h);
+    closePort();
+    atr="";
+
+    try {
+      fd=openReader(port.c_str(), O_NONBLOCK);
+    } catch (UICCError &e) {
+      failLater(e);
+      return;
+    }
+
+    watch(fd, EPOLL_CTL_ADD, EPOLLIN, false);
+    state=powerOff;
+    arm(powerOffMs);
+  }
+
+  // Sends the APDU command, the answer is answerSize bytes at most
+  // timeoutMs: for the first byte of the card, then silenceMs between bytes
+  void exchange(const string &command, size_t answerSize, handler h,
+                int timeoutMs=defaultTimeoutMs) {
+    if ( command.size() < 5 )
+      throw UICCError(UICCError::badRequest, "APDU shorter than 5 bytes");
+
+    start(h);
+    cmd=command;
+    begin(answerSize, timeoutMs);
+  }
+
+  // Same, cmd keeps its capacity: no allocation once the longest command was sent
+  void exchange(const Apdu &command, size_t answerSize, handler h,
+                int timeoutMs=defaultTimeoutMs) {
+    start(h);
+    cmd.assign((const char *)command.bytes(), command.size());
+    begin(answerSize, timeoutMs);
+  }
+
+  // epoll events of the port
+  void onPort(uint32_t events) {
+    if (events & EPOLLOUT)
+      flush();
+
+    if ( !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || fd < 0)
+      return;
+
+    char buf[512];
+    int ret;
+
+    while ((ret=::read(fd, buf, sizeof(buf))) > 0)
+      for (int i=0; i < ret && fd >= 0; i++)
+        received(buf[i]);
+
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+
+    if (ret == 0 && !(events & (EPOLLHUP | EPOLLERR)))
+      return;
+
+    // the reader is gone (EIO), or hang up: don't loop on it
+    string why= ret < 0 ? strerror(errno) : "hang up";
+    closePort();
+
+    if (busy())
+      fail(UICCError(UICCError::cardRemoved,
+                     stringPrintf("Error from read on %s: %s", port.c_str(), why.c_str())));
+  }
+
+  void onTimer() {
+    uint64_t expirations;
+
+    // re-armed since the expiration: not a timeout
+    if (::read(timerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+      return;
+
+    switch (state) {
+      case powerOff:
+        state=collectAtr;
+        arm(defaultTimeoutMs);
+        break;
+
+      case collectAtr:
+        if (atr == "")
+          fail(UICCError(UICCError::timeout, stringPrintf("No card answer on %s", port.c_str())));
+        else
+          done(atr);
+
+        break;
+
+      case collect:
+        // silence: the answer is shorter than expected, as with UICC::read()
+        if (answer.size() > 0) {
+          done(answer);
+          break;
+        }
+
+        fail(UICCError(UICCError::timeout, "No answer from the UICC"));
+        break;
+
+      case failing:
+        fail(*deferred);
+        break;
+
+      case idle:
+        break;
+
+      default:
+        fail(UICCError(UICCError::timeout, "No answer from the UICC"));
+    }
+  }
+
+ private:
+  enum {
+    idle, powerOff, collectAtr, sendHeader, awaitProcedure, awaitSw2, sendBody, collect,
+    failing
+  } state=idle;
+  int epollFd;
+  uint64_t index;
+  int fd=-1;
+  int timerFd;
+  handler current;
+  string cmd;
+  size_t expected=0;
+  int cardTimeoutMs=defaultTimeoutMs;
+  bool standard=true;
+  // bytes sent that will come back on the wire
+  size_t echo=0;
+  string out;
+  bool writing=false;
+  string answer;
+  char sw1=0;
+  unique_ptr<UICCError> deferred;
+
+  // epoll data: the reader index, low bit set for the timer
+  void watch(int f, int op, uint32_t events, bool timer) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events=events;
+    ev.data.u64=index << 1 | (timer ? 1 : 0);
+    Assert(epoll_ctl(epollFd, op, f, &ev) == 0, "epoll_ctl() failed on %s", port.c_str());
+  }
+
+  void arm(int ms) {
+    struct itimerspec t;
+    memset(&t, 0, sizeof(t));
+    t.it_value.tv_sec=ms / 1000;
+    // 0 would disarm the timer
+    t.it_value.tv_nsec=(ms % 1000) * 1000*1000 + 1;
+    timerfd_settime(timerFd, 0, &t, NULL);
+  }
+
+  void disarm() {
+    struct itimerspec t;
+    memset(&t, 0, sizeof(t));
+    timerfd_settime(timerFd, 0, &t, NULL);
+  }
+
+  void closePort() {
+    if (fd < 0)
+      return;
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    ::close(fd);
+    fd=-1;
+    out="";
+    writing=false;
+    echo=0;
+  }
+
+  void start(handler &h) {
+    if (busy())
+      throw UICCError(UICCError::badRequest,
+                      stringPrintf("%s: exchange in progress", port.c_str()));
+
+    current=h;
+    answer="";
+  }
+
+  // exchange() after start(), cmd set
+  void begin(size_t answerSize, int timeoutMs) {
+    expected=answerSize;
+    cardTimeoutMs=timeoutMs;
+
+    if (fd < 0) {
+      failLater(UICCError(UICCError::cardRemoved, stringPrintf("%s is not open", port.c_str())));
+      return;
+    }
+
+    if (debug)
+      dump_hex("Sending", cmd);
+
+    // the card acknowledges standard commands only (see UICC::write())
+    standard= cmd[0] == (int8_t)'\xa0'|| cmd[0] == (int8_t)'\x00';
+
+    if (!standard)
+      printf("WARNING: Non standard packet sent\n");
+
+    state=sendHeader;
+    arm(cardTimeoutMs);
+    send(cmd.c_str(), standard ? 5 : cmd.size());
+  }
+
+  // After arm(): a write error replaces the timeout
+  void send(const char *data, size_t size) {
+    out.append(data, size);
+    echo+=size;
+    flush();
+  }
+
+  // Writes what the port accepts, epoll tells when it accepts more
+  void flush() {
+    while (out.size() > 0) {
+      int ret=::write(fd, out.c_str(), out.size());
+
+      if (ret < 0 && errno == EINTR)
+        continue;
+
+      if (ret < 0 && errno == EAGAIN) {
+        if (!writing)
+          watch(fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT, false);
+
+        writing=true;
+        return;
+      }
+
+      if (ret < 0) {
+        string why=strerror(errno);
+        closePort();
+        failLater(UICCError(UICCError::cardRemoved,
+                            stringPrintf("Error from write on %s: %s", port.c_str(), why.c_str())));
+        return;
+      }
+
+      out.erase(0, ret);
+    }
+
+    if (writing)
+      watch(fd, EPOLL_CTL_MOD, EPOLLIN, false);
+
+    writing=false;
+  }
+
+  void received(char c) {
+    if (echo > 0) {
+      echo--;
+
+      if (echo == 0 && state == sendHeader && standard) {
+        state=awaitProcedure;
+        arm(cardTimeoutMs);
+      } else if (echo == 0 && (state == sendBody || state == sendHeader)) {
+        state=collect;
+        arm(cardTimeoutMs);
+      }
+
+      return;
+    }
+
+    switch (state) {
+      case collectAtr:
+        atr+=c;
+        arm(silenceMs);
+        break;
+
+      case awaitProcedure:
+        if (c == '\x60') { // NULL procedure byte: the card needs more time
+          arm(cardTimeoutMs);
+        } else if (c == cmd[1]) {
+          if (cmd.size() > 5) {
+            state=sendBody;
+            arm(cardTimeoutMs);
+            send(cmd.c_str()+5, cmd.size()-5);
+          } else {
+            state=collect;
+            arm(cardTimeoutMs);
+          }
+        } else if ((c & 0xf0) == 0x60 || (c & 0xf0) == 0x90) {
+          // The card refuses the command: we received SW1, SW2 follows
+          sw1=c;
+          state=awaitSw2;
+          arm(cardTimeoutMs);
+        } else
+          fail(UICCError(UICCError::protocol,
+                         stringPrintf("UICC answer is %02hhx instead of %02hhx", c, cmd[1])));
+
+        break;
+
+      case awaitSw2:
+        lastSW=(uint8_t)sw1<<8 | (uint8_t)c;
+        fail(UICCError(UICCError::statusWord,
+                       stringPrintf("UICC refused command %02hhx", cmd[1]), lastSW));
+        break;
+
+      case collect:
+        if (c == '\x60' && answer.size() == 0 && cmd.size() > 5) {
+          arm(cardTimeoutMs);
+          break;
+        }
+
+        answer+=c;
+
+        if (answer.size() >= expected)
+          done(answer);
+        else
+          arm(silenceMs);
+
+        break;
+
+      default:
+        if (debug)
+          printf("%s: unexpected byte %02hhx\n", port.c_str(), c);
+    }
+  }
+
+  // The handler may start the next exchange: the state is clean before
+  void finish(const string &result, const UICCError *error) {
+    state=idle;
+    disarm();
+    handler h;
+    swap(h, current);
+    h(*this, result, error);
+  }
+
+  void done(string result) {
+    if (debug)
+      dump_hex("Received", result);
+
+    // Answers end by the status word
+    if (state != collectAtr && result.size() >= 2)
+      lastSW=(uint8_t)result[result.size()-2]<<8 | (uint8_t)result[result.size()-1];
+
+    finish(result, NULL);
+  }
+
+  // From the caller of reset() or exchange(): the handler runs from run()
+  void failLater(const UICCError &e) {
+    deferred.reset(new UICCError(e));
+    state=failing;
+    arm(0);
+  }
+
+  void fail(const UICCError &e) {
+    if (debug)
+      printf("%s: %s\n", port.c_str(), e.what());
+
+    finish("", &e);
+  }
+};
+
+/*
+  The readers and the event loop. The caller starts a reset() or an
+  exchange() on readers, run() dispatches until none is busy: the
+  handlers chain the exchanges of each card session.
+*/
+class ApduEngine {
+ public:
+  ApduEngine() {
+    epollFd=epoll_create1(EPOLL_CLOEXEC);
+    Assert(epollFd >= 0, "epoll_create1() failed");
+  }
+
+  ~ApduEngine() {
+    readers.clear();
+    ::close(epollFd);
+  }
+
+  ApduReader &add(string port) {
+    readers.push_back(unique_ptr<ApduReader>(new ApduReader(epollFd, readers.size(), port)));
+    return *readers.back();
+  }
+
+  size_t size() const {
+    return readers.size();
+  }
+
+  ApduReader &operator[](size_t i) {
+    return *readers[i];
+  }
+
+  bool busy() const {
+    for (auto &r : readers)
+      if (r->busy())
+        return true;
+
+    return false;
+  }
+
+  // Dispatches the events until no reader is busy
+  void run() {
+    struct epoll_event events[64];
+
+    while (busy()) {
+      int nb=epoll_wait(epollFd, events, 64, -1);
+
+      if (nb < 0 && errno == EINTR)
+        continue;
+
+      Assert(nb >= 0, "epoll_wait() failed");
+
+      for (int i=0; i < nb; i++) {
+        ApduReader &r=*readers[events[i].data.u64 >> 1];
+
+        if (events[i].data.u64 & 1)
+          r.onTimer();
+        else
+          r.onPort(events[i].events);
+      }
+    }
+  }
+
+ private:
+  int epollFd;
+  vector<unique_ptr<ApduReader>> readers;
+};
+#endif
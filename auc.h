@@ -0,0 +1,440 @@
+/*
+  Local AuC/HSS stand-in: serves authentication vectors and AUTS
+  resynchronization over a Unix domain socket, to test cards end to end
+  without a core network
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef AUC_H
+#define AUC_H
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <uicc.h>
+#include <milenage.h>
+#include <vectors.h>
+
+/*
+  SQN management of TS 33.102 annex C: SQN = SEQ || IND, IND on 5 bits
+  The HE keeps one SEQ_HE counter per subscriber (C.1.1) and gives the
+  IND values in turn (C.1.2): each vector has a SEQ above all the SEQ
+  sent before, so the USIM accepts it whatever IND it used (C.2.2).
+  After an AUTS, SEQ_HE takes SEQ_MS, the highest SEQ of the USIM (C.3.4)
+*/
+#define aucIndBits 5
+#define aucIndNb (1 << aucIndBits)
+
+struct aucRecord {
+  uint64_t imsi;
+  u8 k[16];
+  u8 opc[16];
+  uint64_t seqHe;
+  uint32_t nextInd;
+  uint32_t reserved;
+};
+
+/*
+  Subscriber store: a file of aucRecord sorted by IMSI, after a header,
+  memory mapped: the SQN updates are in the file as soon as they are done
+*/
+class SubscriberStore {
+ public:
+  ~SubscriberStore() {
+    close();
+  }
+
+  // Build a store from a subscriber file (same format as --vectors)
+  static bool create(string path, const vector<vectorSubscriber> &subs) {
+    vector<aucRecord> records(subs.size());
+
+    for (size_t i=0; i < subs.size(); i++) {
+      aucRecord &r=records[i];
+      memset(&r, 0, sizeof(r));
+      r.imsi=strtoull(subs[i].imsi.c_str(), NULL, 10);
+      memcpy(r.k, subs[i].k, 16);
+      memcpy(r.opc, subs[i].opc, 16);
+      // the file gives the first SQN to use
+      r.seqHe= subs[i].sqn >> aucIndBits ? (subs[i].sqn >> aucIndBits) - 1 : 0;
+    }
+
+    sort(records.begin(), records.end(), [](const aucRecord &a, const aucRecord &b) {
+      return a.imsi < b.imsi;
+    });
+    storeHeader h;
+    memcpy(h.magic, storeMagic, sizeof(h.magic));
+    h.count=records.size();
+    FILE *f=fopen(path.c_str(), "wb");
+
+    if (f == NULL)
+      return false;
+
+    bool ok= fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(records.data(), sizeof(aucRecord), records.size(), f) == records.size();
+    return fclose(f) == 0 && ok;
+  }
+
+  bool open(string path) {
+    fd=::open(path.c_str(), O_RDWR);
+
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(storeHeader))
+      return false;
+
+    mapLen=st.st_size;
+    map=mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+      map=NULL;
+      return false;
+    }
+
+    storeHeader *h=(storeHeader *)map;
+
+    if (memcmp(h->magic, storeMagic, sizeof(h->magic)) != 0 ||
+        sizeof(storeHeader) + h->count * sizeof(aucRecord) > mapLen)
+      return false;
+
+    count=h->count;
+    records=(aucRecord *)(h+1);
+    return true;
+  }
+
+  void close() {
+    if (map != NULL) {
+      sync();
+      munmap(map, mapLen);
+      map=NULL;
+    }
+
+    if (fd >= 0)
+      ::close(fd);
+
+    fd=-1;
+  }
+
+  bool sync() {
+    return map != NULL && msync(map, mapLen, MS_SYNC) == 0;
+  }
+
+  aucRecord *find(uint64_t imsi) {
+    aucRecord *end=records + count;
+    aucRecord *r=lower_bound(records, end, imsi, [](const aucRecord &a, uint64_t i) {
+      return a.imsi < i;
+    });
+    return r != end && r->imsi == imsi ? r : NULL;
+  }
+
+  size_t index(const aucRecord *r) {
+    return r - records;
+  }
+
+  size_t size() {
+    return count;
+  }
+
+ private:
+  struct storeHeader {
+    char magic[8];
+    uint64_t count;
+  };
+  static constexpr const char *storeMagic="UICCAUC2";
+
+  int fd=-1;
+  void *map=NULL;
+  size_t mapLen=0;
+  aucRecord *records=NULL;
+  size_t count=0;
+};
+
+/*
+  Line protocol, hexadecimal values:
+  VECTOR <imsi>                 -> OK <sqn> <rand> <xres> <autn> <ck> <ik>
+  RESYNC <imsi> <rand> <auts>   -> OK <sqn of the next vector>
+  NEXT <imsi>                   -> OK <sqn of the next vector>
+  the SQN in decimal
+  errors                        -> ERR <reason>
+*/
+class AucServer {
+ public:
+  int workers=thread::hardware_concurrency();
+  SubscriberStore *store=NULL; // set by serve(), or before calling handle()
+
+  // Runs until SIGINT or SIGTERM
+  bool serve(string socketPath, SubscriberStore &subscribers) {
+    store=&subscribers;
+    int listenFd=socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+
+    if (listenFd < 0 || socketPath.size() >= sizeof(addr.sun_path))
+      return false;
+
+    strcpy(addr.sun_path, socketPath.c_str());
+    unlink(socketPath.c_str());
+
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listenFd, 128) != 0) {
+      ::close(listenFd);
+      return false;
+    }
+
+    // The workers don't get the signals, we wait for them here
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<thread> pool;
+
+    for (int t=0; t < max(workers, 1); t++)
+      pool.push_back(thread(&AucServer::worker, this, listenFd));
+
+    printf("AuC serving %zu subscribers on %s\n", store->size(), socketPath.c_str());
+    fflush(stdout);
+    int sig;
+    sigwait(&stop, &sig);
+    unlink(socketPath.c_str());
+
+    // Wake the workers: accept() fails, the clients read end of file
+    // after the request in progress is answered
+    {
+      lock_guard<mutex> l(clientsLock);
+      stopping=true;
+      shutdown(listenFd, SHUT_RDWR);
+
+      for (int fd : clients)
+        shutdown(fd, SHUT_RD);
+    }
+
+    // No request in progress after that: the store is consistent
+    for (auto &t : pool)
+      t.join();
+
+    ::close(listenFd);
+    store->sync();
+    printf("AuC stopped (signal %d)\n", sig);
+    return true;
+  }
+
+  string handle(const string &line) {
+    char cmd[16], imsi[32], rand[64], auts[64];
+    int nb=sscanf(line.c_str(), "%15s %31s %63s %63s", cmd, imsi, rand, auts);
+
+    if (nb < 2)
+      return "ERR bad request";
+
+    aucRecord *r=store->find(strtoull(imsi, NULL, 10));
+
+    if (r == NULL)
+      return "ERR unknown IMSI";
+
+    lock_guard<mutex> l(stripes[store->index(r) % stripeNb]);
+
+    if (strcmp(cmd, "VECTOR") == 0 && nb == 2)
+      return makeVector(*r);
+
+    if (strcmp(cmd, "NEXT") == 0 && nb == 2)
+      return "OK " + to_string(nextSqn(*r));
+
+    string binRand, binAuts;
+
+    if (strcmp(cmd, "RESYNC") == 0 && nb == 4 &&
+        makeBin(rand, binRand) == 16 && makeBin(auts, binAuts) == 14)
+      return resync(*r, (const u8 *)binRand.c_str(), (const u8 *)binAuts.c_str());
+
+    return "ERR bad request";
+  }
+
+ private:
+  static const int stripeNb=64;
+  mutex stripes[stripeNb]; // subscriber i is protected by stripes[i % stripeNb]
+  // connections in progress, to stop the workers
+  mutex clientsLock;
+  set<int> clients;
+  bool stopping=false;
+
+  static string hex(const u8 *data, int len) {
+    return hexString(string((const char *)data, len));
+  }
+
+  static uint64_t nextSqn(const aucRecord &r) {
+    return ((r.seqHe + 1) << aucIndBits | r.nextInd) & 0xFFFFFFFFFFFFULL;
+  }
+
+  string makeVector(aucRecord &r) {
+    uint64_t sqn=nextSqn(r);
+    r.seqHe++;
+    r.nextInd=(r.nextInd + 1) % aucIndNb;
+    u8 sqnBytes[6], rand[16], autn[16], ik[16], ck[16], res[8];
+    u8 amf[2]= {0x80, 0};
+
+    for (int i=0; i < 6; i++)
+      sqnBytes[i]=sqn >> (40 - 8*i);
+
+    randomBytes(rand, sizeof(rand));
+    milenage_generate(r.opc, amf, r.k, sqnBytes, rand, autn, ik, ck, res);
+    return "OK " + to_string(sqn) + " " + hex(rand, 16) + " " + hex(res, 8) + " " +
+           hex(autn, 16) + " " + hex(ck, 16) + " " + hex(ik, 16);
+  }
+
+  string resync(aucRecord &r, const u8 *rand, const u8 *auts) {
+    u8 sqnMs[6];
+
+    if (!milenage_auts(r.opc, r.k, rand, auts, sqnMs))
+      return "ERR AUTS check failed";
+
+    uint64_t sqn=0;
+
+    for (int i=0; i < 6; i++)
+      sqn=sqn << 8 | sqnMs[i];
+
+    // SEQ_MS is the highest SEQ accepted by the USIM
+    if ((sqn >> aucIndBits) > r.seqHe)
+      r.seqHe=sqn >> aucIndBits;
+
+    return "OK " + to_string(nextSqn(r));
+  }
+
+  void worker(int listenFd) {
+    while (true) {
+      int fd=accept(listenFd, NULL, NULL);
+
+      if (fd < 0) {
+        int err=errno;
+
+        {
+          lock_guard<mutex> l(clientsLock);
+
+          if (stopping)
+            return;
+        }
+
+        if (err != EINTR && err != ECONNABORTED)
+          usleep(10000); // out of file descriptors: let the others finish
+
+        continue;
+      }
+
+      {
+        lock_guard<mutex> l(clientsLock);
+
+        if (stopping) {
+          ::close(fd);
+          return;
+        }
+
+        clients.insert(fd);
+      }
+
+      string in;
+      char buf[512];
+      ssize_t got;
+
+      while ((got=read(fd, buf, sizeof(buf))) > 0) {
+        in.append(buf, got);
+        size_t eol;
+        string out;
+
+        while ((eol=in.find('\n')) != string::npos) {
+          out+=handle(in.substr(0, eol)) + "\n";
+          in.erase(0, eol+1);
+        }
+
+        if (out.size() > 0 && write(fd, out.c_str(), out.size()) != (ssize_t)out.size())
+          break;
+      }
+
+      {
+        lock_guard<mutex> l(clientsLock);
+        clients.erase(fd);
+      }
+
+      ::close(fd);
+    }
+  }
+};
+
+class AucClient {
+ public:
+  ~AucClient() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool connect(string socketPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+
+    if (socketPath.size() >= sizeof(addr.sun_path))
+      return false;
+
+    strcpy(addr.sun_path, socketPath.c_str());
+    fd=socket(AF_UNIX, SOCK_STREAM, 0);
+    return fd >= 0 && ::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+
+  // The answer without its end of line, "" if the AuC is gone
+  string request(string line) {
+    line+="\n";
+
+    if (write(fd, line.c_str(), line.size()) != (ssize_t)line.size())
+      return "";
+
+    string answer;
+    char c;
+
+    while (read(fd, &c, 1) == 1 && c != '\n')
+      answer+=c;
+
+    return answer;
+  }
+
+  bool getVector(string imsi, uint64_t &sqn, string &rand, string &xres, string &autn,
+              string &ck, string &ik) {
+    char r[64], x[64], a[64], c[64], i[64];
+    unsigned long long s;
+    string answer=request("VECTOR " + imsi);
+
+    if (sscanf(answer.c_str(), "OK %llu %63s %63s %63s %63s %63s", &s, r, x, a, c, i) != 6)
+      return false;
+
+    sqn=s;
+    return makeBin(r, rand) == 16 && makeBin(x, xres) == 8 && makeBin(a, autn) == 16 &&
+           makeBin(c, ck) == 16 && makeBin(i, ik) == 16;
+  }
+
+  bool resync(string imsi, const string &rand, const string &auts, uint64_t &nextSqn) {
+    unsigned long long s;
+    string answer=request("RESYNC " + imsi + " " + hexString(rand) + " " + hexString(auts));
+
+    if (sscanf(answer.c_str(), "OK %llu", &s) != 1)
+      return false;
+
+    nextSqn=s;
+    return true;
+  }
+
+  // The SQN of the next vector of this subscriber, -1 if unknown
+  int64_t nextSqn(string imsi) {
+    unsigned long long s;
+    string answer=request("NEXT " + imsi);
+    return sscanf(answer.c_str(), "OK %llu", &s) == 1 ? (int64_t)s : -1;
+  }
+
+ private:
+  int fd=-1;
+};
+#endif
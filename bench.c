@@ -0,0 +1,779 @@
+/*
+  Conformance and speed of the AES and Milenage code: make bench
+  - AES (FIPS 197 appendix C.1), Milenage (TS 35.208 test sets 1 to 6)
+    and GSM-Milenage (TS 55.205) known answers, for each backend
+    available on this CPU, and the USIM side AUTN checks
+  - TUAK (TS 35.232 test set 1, and a 256-bit K) for each Keccak backend
+  - SHA-256, HMAC-SHA-256 and the EPS and 5G AKA key derivations
+  - the SQN of the AuC vectors and its resynchronization
+  - the EF encoders and decoders
+  - single vector latency and batch throughput, 1 to N threads
+  Results in JSON on stdout, failures on stderr (exit status 1)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <uicc.h>
+#include <milenage_batch.h>
+#include <auc.h>
+#include <sha256.h>
+#include <tuak.h>
+
+struct milenageTestSet {
+  const char *k, *rand, *sqn, *amf, *op, *opc;
+  const char *f1, *f1star, *f2, *f5, *f3, *f4, *f5star;
+};
+
+// TS 35.208 section 4
+static const milenageTestSet testSets[]= {
+  {
+    "465b5ce8b199b49faa5f0a2ee238a6bc", "23553cbe9637a89d218ae64dae47bf35", "ff9bb4d0b607", "b9b9",
+    "cdc202d5123e20f62b6d676ac72cb318", "cd63cb71954a9f4e48a5994e37a02baf",
+    "4a9ffac354dfafb3", "01cfaf9ec4e871e9", "a54211d5e3ba50bf", "aa689c648370",
+    "b40ba9a3c58b2a05bbf0d987b21bf8cb", "f769bcd751044604127672711c6d3441", "451e8beca43b"
+  },
+  {
+    "0396eb317b6d1c36f19c1c84cd6ffd16", "c00d603103dcee52c4478119494202e8", "fd8eef40df7d", "af17",
+    "ff53bade17df5d4e793073ce9d7579fa", "53c15671c60a4b731c55b4a441c0bde2",
+    "5df5b31807e258b0", "a8c016e51ef4a343", "d3a628ed988620f0", "c47783995f72",
+    "58c433ff7a7082acd424220f2b67c556", "21a8c1f929702adb3e738488b9f5c5da", "30f1197061c1"
+  },
+  {
+    "fec86ba6eb707ed08905757b1bb44b8f", "9f7c8d021accf4db213ccff0c7f71a6a", "9d0277595ffc", "725c",
+    "dbc59adcb6f9a0ef735477b7fadf8374", "1006020f0a478bf6b699f15c062e42b3",
+    "9cabc3e99baf7281", "95814ba2b3044324", "8011c48c0c214ed2", "33484dc2136b",
+    "5dbdbb2954e8f3cde665b046179a5098", "59a92d3b476a0443487055cf88b2307b", "deacdd848cc6"
+  },
+  {
+    "9e5944aea94b81165c82fbf9f32db751", "ce83dbc54ac0274a157c17f80d017bd6", "0b604a81eca8", "9e09",
+    "223014c5806694c007ca1eeef57f004f", "a64a507ae1a2a98bb88eb4210135dc87",
+    "74a58220cba84c49", "ac2cc74a96871837", "f365cd683cd92e96", "f0b9c08ad02e",
+    "e203edb3971574f5a94b0d61b816345d", "0c4524adeac041c4dd830d20854fc46b", "6085a86c6f63"
+  },
+  {
+    "4ab1deb05ca6ceb051fc98e77d026a84", "74b0cd6031a1c8339b2b6ce2b8c4a186", "e880a1b580b6", "9f07",
+    "2d16c5cd1fdf6b22383584e3bef2a8d8", "dcf07cbd51855290b92a07a9891e523e",
+    "49e785dd12626ef2", "9e85790336bb3fa2", "5860fc1bce351e7e", "31e11a609118",
+    "7657766b373d1c2138f307e3de9242f9", "1c42e960d89b8fa99f2744e0708ccb53", "fe2555e54aa9"
+  },
+  {
+    "6c38a116ac280c454f59332ee35c8c4f", "ee6466bc96202c5a557abbeff8babf63", "414b98222181", "4464",
+    "1ba00a1a7c6700ac8c3ff3e96ad08725", "3803ef5363b947c6aaa225e58fae3934",
+    "078adfb488241a57", "80246b8d0186bcf1", "16c8233f05a0ac28", "45b0f69ab06c",
+    "3f8c7587fe8e4b233af676aede30ba3b", "a7466cc1e6b2a1337d49d3b66e95d7b4", "1f53cd2b1113"
+  },
+};
+#define testSetNb (int)(sizeof(testSets)/sizeof(testSets[0]))
+
+static int passed=0, failed=0;
+
+static string bin(const char *hex) {
+  string b;
+  makeBin(hex, b);
+  return b;
+}
+
+static const u8 *ptr(const string &s) {
+  return (const u8 *)s.c_str();
+}
+
+static void check(bool ok, const char *backend, const char *what, int set) {
+  if (ok)
+    passed++;
+  else {
+    fprintf(stderr, "FAIL %s: %s, test set %d\n", backend, what, set);
+    failed++;
+  }
+}
+
+static bool same(const u8 *data, const char *hex) {
+  string expected=bin(hex);
+  return memcmp(data, expected.c_str(), expected.size()) == 0;
+}
+
+// The functions taking an expanded key, with the AES of ctx
+static void conformanceAes(const char *backend, bool hw) {
+  aes_128_ctx_t ctx;
+  u8 out[16];
+  aes_128_init(&ctx, ptr(bin("000102030405060708090a0b0c0d0e0f")), hw);
+  aes_128_encrypt_block(&ctx, ptr(bin("00112233445566778899aabbccddeeff")), out);
+  check(same(out, "69c4e0d86a7b0430d8cdb78070b4c55a"), backend, "aes_128_encrypt_block", 0);
+
+  for (int t=0; t < testSetNb; t++) {
+    const milenageTestSet &s=testSets[t];
+    string opc=bin(s.opc), rand=bin(s.rand), sqn=bin(s.sqn), amf=bin(s.amf);
+    aes_128_init(&ctx, ptr(bin(s.k)), hw);
+    u8 macA[8], macS[8], res[8], ck[16], ik[16], ak[6], akStar[6], autn[16];
+
+    check(milenage_f1(ptr(opc), &ctx, ptr(rand), ptr(sqn), ptr(amf), macA, macS) &&
+          same(macA, s.f1) && same(macS, s.f1star), backend, "milenage_f1", t+1);
+    check(milenage_f2345(ptr(opc), &ctx, ptr(rand), res, ck, ik, ak, akStar) &&
+          same(res, s.f2) && same(ck, s.f3) && same(ik, s.f4) && same(ak, s.f5) &&
+          same(akStar, s.f5star), backend, "milenage_f2345", t+1);
+
+    bool ok=milenage_generate(ptr(opc), ptr(amf), &ctx, ptr(sqn), ptr(rand), autn, ik, ck, res) &&
+            same(autn + 6, s.amf) && same(autn + 8, s.f1) && same(res, s.f2) &&
+            same(ck, s.f3) && same(ik, s.f4);
+
+    for (int i=0; i < 6; i++)
+      ok= ok && (autn[i] ^ ak[i]) == (u8)sqn[i];
+
+    check(ok, backend, "milenage_generate", t+1);
+
+    // AUTS = SQN xor AK* || MAC-S, MAC-S with AMF 0000
+    u8 auts[14], sqnMs[6], zero[2]= {0, 0};
+
+    for (int i=0; i < 6; i++)
+      auts[i]=sqn[i] ^ akStar[i];
+
+    milenage_f1(ptr(opc), &ctx, ptr(rand), ptr(sqn), zero, NULL, auts + 6);
+    check(milenage_auts(ptr(opc), &ctx, ptr(rand), auts, sqnMs) &&
+          memcmp(sqnMs, sqn.c_str(), 6) == 0, backend, "milenage_auts", t+1);
+    auts[13]^=1;
+    check(!milenage_auts(ptr(opc), &ctx, ptr(rand), auts, sqnMs), backend,
+          "milenage_auts rejects a wrong MAC-S", t+1);
+  }
+}
+
+// SRES (c2) and Kc (c3) from the TS 35.208 RES, CK, IK: the TS 55.205 SRES#1 and Kc
+static void conformanceGsm(void) {
+  for (int t=0; t < testSetNb; t++) {
+    const milenageTestSet &s=testSets[t];
+    string res=bin(s.f2), ck=bin(s.f3), ik=bin(s.f4);
+    u8 sres[4], kc[8], expectedSres[4], expectedKc[8];
+
+    for (int i=0; i < 4; i++)
+      expectedSres[i]=res[i] ^ res[i+4];
+
+    for (int i=0; i < 8; i++)
+      expectedKc[i]=ck[i] ^ ck[i+8] ^ ik[i] ^ ik[i+8];
+
+    check(gsm_milenage(ptr(bin(s.opc)), ptr(bin(s.k)), ptr(bin(s.rand)), sres, kc) &&
+          memcmp(sres, expectedSres, 4) == 0 && memcmp(kc, expectedKc, 8) == 0,
+          "default", "gsm_milenage", t+1);
+
+    if (t == 0)
+      check(same(kc, "eae4be823af9a08b") && same(sres, "46f8416a"), "default",
+            "gsm_milenage TS 55.205", t+1);
+  }
+}
+
+// USIM side: accepted, replayed, out of the delta window, wrong MAC
+static void conformanceCheck(void) {
+  for (int t=0; t < testSetNb; t++) {
+    const milenageTestSet &s=testSets[t];
+    string k=bin(s.k), opc=bin(s.opc), rand=bin(s.rand), sqn=bin(s.sqn), amf=bin(s.amf);
+    aes_128_ctx_t ctx;
+    aes_128_init(&ctx, ptr(k));
+    u8 autn[16], ik[16], ck[16], res[8], auts[14], sqnMs[6];
+    size_t resLen;
+    milenage_generate(ptr(opc), ptr(amf), &ctx, ptr(sqn), ptr(rand), autn, ik, ck, res);
+    u8 lower[6], zero[6]= {0};
+    memcpy(lower, sqn.c_str(), 6);
+    lower[5]--;
+
+    check(milenage_check(ptr(opc), ptr(k), lower, ptr(rand), autn, ik, ck, res, &resLen, auts) == 0 &&
+          same(res, s.f2) && same(ck, s.f3) && same(ik, s.f4) && resLen == 8,
+          "default", "milenage_check accepts a fresh SQN", t+1);
+    check(milenage_check(ptr(opc), ptr(k), ptr(sqn), ptr(rand), autn, ik, ck, res, &resLen,
+                         auts) == -2 &&
+          milenage_auts(ptr(opc), &ctx, ptr(rand), auts, sqnMs) &&
+          memcmp(sqnMs, sqn.c_str(), 6) == 0,
+          "default", "milenage_check resynchronizes a replayed SQN", t+1);
+    autn[15]^=1;
+    check(milenage_check(ptr(opc), ptr(k), ptr(sqn), ptr(rand), autn, ik, ck, res, &resLen,
+                         auts) == -1 &&
+          milenage_check(ptr(opc), ptr(k), zero, ptr(rand), autn, ik, ck, res, &resLen,
+                         auts) == -1,
+          "default", "milenage_check rejects a wrong MAC before the SQN", t+1);
+
+    // Annex C.2: SEQ per IND
+    milenage_usim_sqn_t usim;
+    memset(&usim, 0, sizeof(usim));
+    uint64_t value=MilenageSqnValue(ptr(sqn));
+    usim.sqnMs=value - 2*(1 << milenageIndBits);
+    usim.seq[value % (1 << milenageIndBits)]=usim.sqnMs >> milenageIndBits;
+    milenage_generate(ptr(opc), ptr(amf), &ctx, ptr(sqn), ptr(rand), autn, ik, ck, res);
+    bool ok=milenage_check(ptr(opc), &ctx, &usim, ptr(rand), autn, ik, ck, res, &resLen, auts) == 0 &&
+            usim.sqnMs == value;
+    ok= ok && milenage_check(ptr(opc), &ctx, &usim, ptr(rand), autn, ik, ck, res, &resLen, auts) == -2;
+    // an older SEQ on another IND is still fresh
+    uint64_t other=value - (1 << milenageIndBits) + 1;
+    u8 otherSqn[6];
+
+    for (int i=0; i < 6; i++)
+      otherSqn[i]=other >> (40 - 8*i);
+
+    milenage_generate(ptr(opc), ptr(amf), &ctx, otherSqn, ptr(rand), autn, ik, ck, res);
+    ok= ok && milenage_check(ptr(opc), &ctx, &usim, ptr(rand), autn, ik, ck, res, &resLen, auts) == 0 &&
+        usim.sqnMs == value;
+    check(ok, "default", "milenage_check with the annex C.2 SQN array", t+1);
+
+    // out of the delta window: the AUTS gives the highest accepted SQN
+    memset(&usim, 0, sizeof(usim));
+    usim.sqnMs=value > (milenageSeqDelta + 1) << milenageIndBits ?
+               value - ((milenageSeqDelta + 1) << milenageIndBits) : 0;
+
+    if (usim.sqnMs > 0) {
+      milenage_generate(ptr(opc), ptr(amf), &ctx, ptr(sqn), ptr(rand), autn, ik, ck, res);
+      check(milenage_check(ptr(opc), &ctx, &usim, ptr(rand), autn, ik, ck, res, &resLen, auts) == -2 &&
+            milenage_auts(ptr(opc), &ctx, ptr(rand), auts, sqnMs) &&
+            MilenageSqnValue(sqnMs) == usim.sqnMs,
+            "default", "milenage_check refuses a SEQ beyond the delta", t+1);
+    }
+  }
+}
+
+typedef void (*tuakBatchFunction)(const tuak_in_t *in, milenage_out_t *out, size_t n);
+
+// TUAK of a 256-bit K, with the TOP of TS 35.232 test set 1
+static const char *tuakK256="202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f";
+static const char *tuakTopc256="9c542665e3dc6ac4f86b72bfa99ec3e6d491e89eacea5bfa204884a9c6bdc507";
+
+// 64-bit MAC and RES, 128-bit CK and IK, as tuak_generate(): set 1 gives
+// MAC-A only, its RES has 32 bits
+static void conformanceTuakBatch(const char *backend, tuakBatchFunction batch) {
+  tuak_in_t in[3];
+  milenage_out_t out[3];
+  memset(in, 0, sizeof(in));
+
+  for (int v=0; v < 3; v++) {
+    in[v].kLen= v == 0 ? 16 : 32;
+    memcpy(in[v].k, v == 0 ? ptr(bin("abababababababababababababababab")) : ptr(bin(tuakK256)),
+           in[v].kLen);
+    memcpy(in[v].topc, v == 0 ? ptr(bin("bd04d9530e87513c5d837ac2ad954623a8e2330c115305a73eb45d1f40cccbff")) :
+           ptr(bin(tuakTopc256)), 32);
+    memcpy(in[v].rand, v == 0 ? ptr(bin("42424242424242424242424242424242")) :
+           ptr(bin("0123456789abcdef0123456789abcdef")), 16);
+    memcpy(in[v].sqn, v == 0 ? ptr(bin("111111111111")) : ptr(bin("0123456789ab")), 6);
+    memcpy(in[v].amf, v == 0 ? ptr(bin("ffff")) : ptr(bin("8000")), 2);
+  }
+
+  // 3 vectors: the last one alone in its Keccak group
+  batch(in, out, 3);
+  check(same(out[0].autn + 8, "f9a54e6aeaa8618d"), backend, "tuak_generate_batch MAC-A", 1);
+
+  for (int v=1; v < 3; v++)
+    check(same(out[v].autn, "e749a5504b28" "8000" "883495dee186d704") &&
+          same(out[v].res, "a7fc638c79e54817") && same(out[v].ck, "94a697a03c6e62183c30d074ef3d5eca") &&
+          same(out[v].ik, "8ca75946466d8d5fc676b6601b10db88") && same(out[v].ak, "e66ae037c283"),
+          backend, "tuak_generate_batch 256-bit K", v+1);
+}
+
+/*
+  TUAK f1, f1*, f2 to f5, f5* and TOPc: TS 35.232 test set 1 (128-bit K,
+  one Keccak iteration), and a 256-bit K with 128-bit MAC and RES and
+  256-bit CK and IK. There is no published set for this one in our
+  sources: its values come from a Python model of TS 35.231 built on
+  Keccak-f[1600] checked against hashlib SHA3-256, that gives all the
+  set 1 values
+*/
+static void conformanceTuak(void) {
+  string k=bin("abababababababababababababababab"), top=bin(string(64, '5').c_str());
+  string rand=bin("42424242424242424242424242424242"), sqn=bin("111111111111"), amf=bin("ffff");
+  u8 topc[32], mac[32], res[32], ck[32], ik[32], ak[6], autn[16];
+  tuak_topc_gen(ptr(k), 16, ptr(top), topc);
+  check(same(topc, "bd04d9530e87513c5d837ac2ad954623a8e2330c115305a73eb45d1f40cccbff"), "default",
+        "tuak_topc_gen", 1);
+  tuak_f1(topc, ptr(k), 16, ptr(rand), ptr(sqn), ptr(amf), false, mac, 8);
+  check(same(mac, "f9a54e6aeaa8618d"), "default", "tuak_f1", 1);
+  tuak_f1(topc, ptr(k), 16, ptr(rand), ptr(sqn), ptr(amf), true, mac, 8);
+  check(same(mac, "e94b4dc6c7297df3"), "default", "tuak_f1 f1*", 1);
+  tuak_f2345(topc, ptr(k), 16, ptr(rand), res, 4, ck, 16, ik, 16, ak);
+  check(same(res, "657acd64") && same(ck, "d71a1e5c6caffe986a26f783e5c78be1") &&
+        same(ik, "be849fa2564f869aecee6f62d4337e72") && same(ak, "719f1e9b9054"), "default",
+        "tuak_f2345", 1);
+  tuak_f5star(topc, ptr(k), 16, ptr(rand), ak);
+  check(same(ak, "e7af6b3d0e38"), "default", "tuak_f5star", 1);
+
+  k=bin(tuakK256);
+  rand=bin("0123456789abcdef0123456789abcdef");
+  sqn=bin("0123456789ab");
+  amf=bin("8000");
+  tuak_topc_gen(ptr(k), 32, ptr(top), topc);
+  check(same(topc, tuakTopc256), "default", "tuak_topc_gen 256-bit K", 2);
+  tuak_f1(topc, ptr(k), 32, ptr(rand), ptr(sqn), ptr(amf), false, mac, 16);
+  check(same(mac, "41d0f462490dda4c8c18b331ac7c103d"), "default", "tuak_f1 256-bit K", 2);
+  tuak_f1(topc, ptr(k), 32, ptr(rand), ptr(sqn), ptr(amf), true, mac, 16);
+  check(same(mac, "7c586d6fca54e33c34901b045944058a"), "default", "tuak_f1 f1* 256-bit K", 2);
+  tuak_f2345(topc, ptr(k), 32, ptr(rand), res, 16, ck, 32, ik, 32, ak);
+  check(same(res, "78066a7162c005ed281b24f4cb103a2b") &&
+        same(ck, "16daeccc72bbab8fe467e38de8e899e2eaca777bce04474ae180856b5adefb7a") &&
+        same(ik, "701f38d83b61f326e91ffd87beb2c6fb961415eae89d7a396f5ee63f204a7ab8") &&
+        same(ak, "39a1e286f2c3"), "default", "tuak_f2345 256-bit K", 2);
+  tuak_f5star(topc, ptr(k), 32, ptr(rand), ak);
+  check(same(ak, "aa6d597ea714"), "default", "tuak_f5star 256-bit K", 2);
+  tuak_f1(topc, ptr(k), 32, ptr(rand), ptr(sqn), ptr(amf), false, mac, 32);
+  check(same(mac, "9dbdb0ff0c4ae055efb15203b1228e2c879263c85e524f851961b5ffc567b58a"), "default",
+        "tuak_f1 256-bit MAC", 2);
+
+  tuak_generate(topc, ptr(amf), ptr(k), 32, ptr(sqn), ptr(rand), autn, ik, ck, res);
+  check(same(autn, "e749a5504b288000883495dee186d704") && same(res, "a7fc638c79e54817") &&
+        same(ck, "94a697a03c6e62183c30d074ef3d5eca") && same(ik, "8ca75946466d8d5fc676b6601b10db88"),
+        "default", "tuak_generate 256-bit K", 2);
+
+  // AUTS = SQN xor AK* || MAC-S (f1* with AMF 0000)
+  u8 auts[14], sqnMs[6], zero[2]= {0, 0};
+
+  for (int i=0; i < 6; i++)
+    auts[i]=sqn[i] ^ ak[i];
+
+  tuak_f1(topc, ptr(k), 32, ptr(rand), ptr(sqn), zero, true, auts + 6, 8);
+  check(tuak_auts(topc, ptr(k), 32, ptr(rand), auts, sqnMs) && memcmp(sqnMs, sqn.c_str(), 6) == 0,
+        "default", "tuak_auts 256-bit K", 2);
+
+  conformanceTuakBatch("portable", tuakBatchPortable);
+#ifdef KECCAK_AVX2_BUILD
+
+  if (__builtin_cpu_supports("avx2"))
+    conformanceTuakBatch("avx2", tuakBatchAvx2);
+
+#endif
+}
+
+// SHA-256 (FIPS 180-4 examples) with each block function, HMAC-SHA-256
+// (RFC 4231 test case 2), and the EPS and 5G AKA keys of TS 33.401 and
+// TS 33.501 annex A from the TS 35.208 test set 1 vector. There are no
+// published vectors for these: the expected values come from Python
+// hashlib and hmac
+static void conformanceKdf(void) {
+  const char *messages[]= {"abc", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+  const char *digests[]= {
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"
+  };
+  u8 out[32];
+
+  for (int t=0; t < 2; t++) {
+    sha256(ptr(messages[t]), strlen(messages[t]), out);
+    check(same(out, digests[t]), sha256_use_hw() ? "sha-ni" : "portable", "sha256", t+1);
+    // the padded message, two blocks for the second one
+    u8 blocks[128]= {0};
+    size_t len=strlen(messages[t]), nb= len < 56 ? 1 : 2;
+    memcpy(blocks, messages[t], len);
+    blocks[len]=0x80;
+    blocks[nb*64 - 1]=len*8;
+    blocks[nb*64 - 2]=len*8 >> 8;
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    Sha256BlocksPortable(ctx.h, blocks, nb);
+    bool ok=true;
+
+    for (int i=0; i < 8; i++)
+      ok= ok && ctx.h[i] == (uint32_t)strtoul(string(digests[t] + 8*i, 8).c_str(), NULL, 16);
+
+    check(ok, "portable", "Sha256Blocks", t+1);
+#ifdef SHA_NI_BUILD
+
+    if (sha256_use_hw()) {
+      sha256_init(&ctx);
+      Sha256BlocksShaNi(ctx.h, blocks, nb);
+      ok=true;
+
+      for (int i=0; i < 8; i++)
+        ok= ok && ctx.h[i] == (uint32_t)strtoul(string(digests[t] + 8*i, 8).c_str(), NULL, 16);
+
+      check(ok, "sha-ni", "Sha256Blocks", t+1);
+    }
+
+#endif
+  }
+
+  const char *data="what do ya want for nothing?";
+  hmac_sha256(ptr("Jefe"), 4, ptr(data), strlen(data), out);
+  check(same(out, "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843"), "default",
+        "hmac_sha256 RFC 4231", 2);
+
+  const milenageTestSet &s=testSets[0];
+  const char *sn="5G:mnc093.mcc208.3gppnetwork.org";
+  string rand=bin(s.rand), res=bin(s.f2), ck=bin(s.f3), ik=bin(s.f4), sqnXorAk=bin("55f328b43577");
+  u8 kasme[32];
+  kasme_derive(ptr(ck), ptr(ik), ptr(bin("02f839")), ptr(sqnXorAk), kasme);
+  check(same(kasme, "ba595c5419be71add1212bc8e1bd843afd26e58c0ad8d54f144686b5f55cda77"), "default",
+        "kasme_derive", 1);
+
+  fiveg_in_t in;
+  memcpy(in.ck, ptr(ck), 16);
+  memcpy(in.ik, ptr(ik), 16);
+  memcpy(in.rand, ptr(rand), 16);
+  memcpy(in.xres, ptr(res), 8);
+  in.xresLen=8;
+  memcpy(in.sqnXorAk, ptr(sqnXorAk), 6);
+  strcpy(in.supi, "208930000000001");
+  fiveg_out_t five;
+  fiveg_derive_batch(&in, &five, 1, ptr(sn), strlen(sn));
+  check(same(five.xresStar, "5cc9527f4d21c43bee83a15443acf1c4"), "default", "res_star_derive", 1);
+  check(same(five.hxresStar, "6970075e3c8245fdc2073003cf166279"), "default", "hxres_star_derive", 1);
+  check(same(five.kausf, "f2e35260f85194d4f891504d02111e56689ac23dd393bee3abbcc5bfbc013ef9"),
+        "default", "kausf_derive", 1);
+  check(same(five.kseaf, "cfddde483bd1318a412e98870f556410905be4fb7500abed93ee16af71bbb3fa"),
+        "default", "kseaf_derive", 1);
+  check(same(five.kamf, "9d63b519775a92ca861ca6a50d848fa8ebf160ea7b73735a85b33737e73c55b4"),
+        "default", "kamf_derive", 1);
+
+  // A parameter longer than a block of the KDF input: all of it counts
+  u8 param[300];
+
+  for (int i=0; i < 300; i++)
+    param[i]=i;
+
+  const u8 *params[1]= {param};
+  const uint16_t lens[1]= {sizeof(param)};
+  kdf_33220(five.kausf, 0x6C, params, lens, 1, out);
+  check(same(out, "804691ff2018455cfc7e2feda80e23446f498d6e9fb61bd73b867e783428febd"), "default",
+        "kdf_33220 of a long parameter", 1);
+}
+
+// One AuC vector: its SQN, and the USIM answer with the SQN array of annex C.2
+static int aucVector(AucServer &server, const string &imsi, const aes_128_ctx_t *k,
+                     const u8 *opc, milenage_usim_sqn_t *usim, uint64_t &sqn, string &auts) {
+  char r[64], x[64], a[64], c[64], i[64];
+  unsigned long long s;
+  string rand, autn;
+
+  if (sscanf(server.handle("VECTOR " + imsi).c_str(), "OK %llu %63s %63s %63s %63s %63s",
+             &s, r, x, a, c, i) != 6 || makeBin(r, rand) != 16 || makeBin(a, autn) != 16)
+    return -3;
+
+  sqn=s;
+  u8 res[8], ck[16], ik[16], autsBuf[14];
+  size_t resLen;
+  int ret=milenage_check(opc, k, usim, ptr(rand), ptr(autn), ik, ck, res, &resLen, autsBuf);
+  auts=hexString(rand) + " " + hexString(string((char *)autsBuf, 14));
+  return ret;
+}
+
+// AuC SQN of annex C.1: SEQ_HE + 1 on each vector, IND in turn, wrapping
+// after 31, and the resynchronization on the USIM AUTS
+static void conformanceAuc(void) {
+  char path[]="/tmp/uicc_bench_aucXXXXXX";
+  int fd=mkstemp(path);
+
+  if (fd < 0) {
+    check(false, "default", "AuC store", 1);
+    return;
+  }
+
+  close(fd);
+  const milenageTestSet &t=testSets[0];
+  vectorSubscriber sub;
+  sub.imsi="208011234567890";
+  sub.algo=algoMilenage;
+  sub.kLen=16;
+  memcpy(sub.k, ptr(bin(t.k)), 16);
+  memcpy(sub.opc, ptr(bin(t.opc)), 16);
+  sub.sqn=5 << aucIndBits; // first SEQ 5, IND 0
+  SubscriberStore store;
+  AucServer server;
+  server.store=&store;
+
+  if (!SubscriberStore::create(path, vector<vectorSubscriber>(1, sub)) || !store.open(path)) {
+    check(false, "default", "AuC store", 1);
+    unlink(path);
+    return;
+  }
+
+  aes_128_ctx_t k;
+  aes_128_init(&k, sub.k);
+  milenage_usim_sqn_t usim;
+  memset(&usim, 0, sizeof(usim));
+  vector<uint64_t> sqns;
+  bool ok=true;
+
+  for (int i=0; i < aucIndNb + 2 && ok; i++) {
+    uint64_t sqn;
+    string auts;
+    ok=aucVector(server, sub.imsi, &k, sub.opc, &usim, sqn, auts) == 0;
+    sqns.push_back(sqn);
+  }
+
+  for (size_t i=0; i < sqns.size() && ok; i++)
+    ok= sqns[i] == ((5 + i) << aucIndBits | (i % aucIndNb));
+
+  check(ok && sqns.back() == (38 << aucIndBits | 1), "default", "AuC SEQ and IND wrap", 1);
+
+  // The USIM already has SEQ 100 on the next IND (2): the AUTS gives
+  // its highest SQN, the AuC goes on with SEQ 101 and the next IND
+  usim.seq[2]=100;
+  usim.sqnMs=100 << aucIndBits | 2;
+  uint64_t sqn;
+  string auts;
+  ok= aucVector(server, sub.imsi, &k, sub.opc, &usim, sqn, auts) == -2 &&
+      sqn == (39 << aucIndBits | 2);
+  string next=server.handle("RESYNC " + sub.imsi + " " + auts);
+  ok= ok && next == "OK " + to_string(101 << aucIndBits | 3) &&
+      server.handle("NEXT " + sub.imsi) == next;
+  ok= ok && aucVector(server, sub.imsi, &k, sub.opc, &usim, sqn, auts) == 0 &&
+      sqn == (101 << aucIndBits | 3);
+  check(ok, "default", "AuC resynchronization", 1);
+  check(server.handle("NEXT 208019999999999") == "ERR unknown IMSI" &&
+        server.handle("RESYNC " + sub.imsi + " 00 00") == "ERR bad request", "default",
+        "AuC errors", 1);
+  store.close();
+  unlink(path);
+}
+
+typedef void (*batchFunction)(const milenage_in_t *in, milenage_out_t *out, size_t n);
+
+static void conformanceBatch(const char *backend, batchFunction batch) {
+  // Several groups, and a last one not full
+  const int nb=3*milenageLanes+3;
+  vector<milenage_in_t> in(nb);
+  vector<milenage_out_t> out(nb);
+
+  for (int i=0; i < nb; i++) {
+    const milenageTestSet &s=testSets[i % testSetNb];
+    memcpy(in[i].k, ptr(bin(s.k)), 16);
+    memcpy(in[i].opc, ptr(bin(s.opc)), 16);
+    memcpy(in[i].rand, ptr(bin(s.rand)), 16);
+    memcpy(in[i].sqn, ptr(bin(s.sqn)), 6);
+    memcpy(in[i].amf, ptr(bin(s.amf)), 2);
+  }
+
+  batch(in.data(), out.data(), nb);
+
+  for (int i=0; i < nb; i++) {
+    const milenageTestSet &s=testSets[i % testSetNb];
+    check(same(out[i].autn + 8, s.f1) && same(out[i].res, s.f2) && same(out[i].ck, s.f3) &&
+          same(out[i].ik, s.f4) && same(out[i].ak, s.f5), backend, "milenage_generate_batch",
+          i % testSetNb + 1);
+  }
+}
+
+// Triplets of the batch against gsm_milenage(), same RAND
+static void conformanceTriplets(void) {
+  vector<milenage_in_t> in(testSetNb);
+  vector<milenage_out_t> out(testSetNb);
+  vector<gsm_triplet_t> triplets(testSetNb);
+
+  for (int t=0; t < testSetNb; t++) {
+    const milenageTestSet &s=testSets[t];
+    memcpy(in[t].k, ptr(bin(s.k)), 16);
+    memcpy(in[t].opc, ptr(bin(s.opc)), 16);
+    memcpy(in[t].rand, ptr(bin(s.rand)), 16);
+    memcpy(in[t].sqn, ptr(bin(s.sqn)), 6);
+    memcpy(in[t].amf, ptr(bin(s.amf)), 2);
+  }
+
+  milenage_generate_batch(in.data(), out.data(), triplets.data(), testSetNb);
+
+  for (int t=0; t < testSetNb; t++) {
+    u8 sres[4], kc[8];
+    gsm_milenage(in[t].opc, in[t].k, in[t].rand, sres, kc);
+    check(memcmp(sres, triplets[t].sres, 4) == 0 && memcmp(kc, triplets[t].kc, 8) == 0 &&
+          same(out[t].res, testSets[t].f2), "default", "milenage_generate_batch triplets", t+1);
+  }
+}
+
+static void conformanceOpc(void) {
+  for (int t=0; t < testSetNb; t++) {
+    u8 opc[16];
+    milenage_opc_gen(ptr(bin(testSets[t].k)), ptr(bin(testSets[t].op)), opc);
+    check(same(opc, testSets[t].opc), "default", "milenage_opc_gen", t+1);
+  }
+
+  u8 k[testSetNb][16], opc[testSetNb][16];
+
+  // Same OP for the batch: test set 1 OP, checked against the single version
+  for (int t=0; t < testSetNb; t++)
+    memcpy(k[t], ptr(bin(testSets[t].k)), 16);
+
+  string op=bin(testSets[0].op);
+  milenage_opc_gen_batch(k, ptr(op), opc, testSetNb);
+
+  for (int t=0; t < testSetNb; t++) {
+    u8 one[16];
+    milenage_opc_gen(k[t], ptr(op), one);
+    check(memcmp(one, opc[t], 16) == 0, "default", "milenage_opc_gen_batch", t+1);
+  }
+}
+
+// EF encoders and the decoders on views of a read buffer (no card)
+static void conformanceDecoders(void) {
+  USIM card;
+  const char *imsis[]= {"208011234567890", "20801123456789"};
+
+  for (int t=0; t < 2; t++)
+    check(card.decodeIMSI(card.encodeIMSI(imsis[t])[0]) == imsis[t], "default",
+          "encodeIMSI/decodeIMSI", t+1);
+
+  // MSISDN records of 14 bytes (no alpha identifier) and 34 bytes
+  for (int t=0; t < 2; t++) {
+    string record=card.encodeISDN("33612345678", 14+20*t)[0];
+    check(record.size() == (size_t)(14+20*t) && card.decodeISDN(record) == "33612345678",
+          "default", "encodeISDN/decodeISDN", t+1);
+  }
+
+  // Two records in one buffer, as readFile() puts them: the second
+  // one is empty (FF)
+  uint8_t buf[2*34];
+  memset(buf, 0xff, sizeof(buf));
+  string record=card.encodeISDN("33612345678", 34)[0];
+  memcpy(buf, record.c_str(), record.size());
+  fileSpan f;
+  f.data=buf;
+  f.stride=34;
+  f.records=2;
+  check(card.decodeISDN(f.record(0)) == "33612345678" && card.decodeISDN(f.record(1)) == "" &&
+        card.decodeISDN(f.record(0).sub(0, 10)) == "", "default", "decodeISDN of records", 1);
+  string iccid=bin("98100321436587092143");
+  check(bcdToAscii(ByteView(ptr(iccid), iccid.size())) == "89013012345678901234" &&
+        bcdToAscii(ByteView(ptr(iccid), iccid.size()).sub(8)) == "1234", "default",
+        "bcdToAscii", 1);
+  string plmns=bin("02f810130062ffffff");
+  ByteView p(ptr(plmns), plmns.size());
+  check(decodePlmn(p) == "208-01" && decodePlmn(p.sub(3)) == "310-260" &&
+        decodePlmn(p.sub(6)) == "" && decodePlmn(p.sub(7)) == "", "default", "decodePlmn", 1);
+  string fcp=bin("621a8202412183026f078a01058b036f06028002000988013880020009");
+  string info=extractTLV(ByteView(ptr(fcp), fcp.size()), "FCP Template");
+  check(info.size() == 0x1a && hexString(extractTLV(info, "File Size - Data")) == "0009" &&
+        hexString(extractTLV(info, "SFI")) == "38", "default", "extractTLV", 1);
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static const double runSeconds=0.3;
+
+// ns per milenage_generate() call, the key expanded once
+static double latency(bool hw) {
+  const milenageTestSet &s=testSets[0];
+  string opc=bin(s.opc), rand=bin(s.rand), sqn=bin(s.sqn), amf=bin(s.amf);
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, ptr(bin(s.k)), hw);
+  u8 autn[16], ik[16], ck[16], res[8];
+  uint64_t nb=0;
+  double start=now(), end;
+
+  do {
+    for (int i=0; i < 1000; i++) {
+      milenage_generate(ptr(opc), ptr(amf), &ctx, ptr(sqn), ptr(rand), autn, ik, ck, res);
+      // the next RAND depends on this vector: no overlap between calls
+      rand[0]^=res[0];
+    }
+
+    nb+=1000;
+  } while ((end=now()) - start < runSeconds);
+
+  return (end - start) * 1e9 / nb;
+}
+
+// Vectors/s of threads threads, each on its own subscribers
+static double throughput(batchFunction batch, int threads) {
+  const size_t groupVectors=1024;
+  atomic<uint64_t> total(0);
+  vector<thread> pool;
+  double start=now();
+
+  for (int t=0; t < threads; t++)
+    pool.push_back(thread([&, t] {
+      vector<milenage_in_t> in(groupVectors);
+      vector<milenage_out_t> out(groupVectors);
+
+      for (size_t i=0; i < groupVectors; i++)
+        for (int b=0; b < 16; b++) {
+          in[i].k[b]=i * 7 + b + t;
+          in[i].opc[b]=i + b * 3;
+          in[i].rand[b]=i ^ b;
+        }
+
+      uint64_t nb=0;
+
+      while (now() - start < runSeconds) {
+        batch(in.data(), out.data(), groupVectors);
+        nb+=groupVectors;
+      }
+
+      total+=nb;
+    }));
+
+  for (auto &t : pool)
+    t.join();
+
+  return total / (now() - start);
+}
+
+static void batchPortable(const milenage_in_t *in, milenage_out_t *out, size_t n) {
+  milenageBatchPortable(in, out, n);
+}
+
+#ifdef AES_NI_BUILD
+static void batchAesni(const milenage_in_t *in, milenage_out_t *out, size_t n) {
+  milenageBatchHw(in, out, n, false);
+}
+
+static void batchVaes(const milenage_in_t *in, milenage_out_t *out, size_t n) {
+  milenageBatchHw(in, out, n, true);
+}
+#endif
+
+int main(int argc, char **argv) {
+  struct backend {
+    const char *name;
+    bool hw;
+    batchFunction batch;
+  };
+  vector<backend> backends= {{"portable", false, batchPortable}};
+#ifdef AES_NI_BUILD
+
+  if (aes_128_use_hw()) {
+    backends.push_back({"aesni", true, batchAesni});
+
+    if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f"))
+      backends.push_back({"vaes", true, batchVaes});
+  }
+
+#endif
+
+  for (auto &b : backends) {
+    // vaes shares the single vector code of aesni
+    if (strcmp(b.name, "vaes") != 0)
+      conformanceAes(b.name, b.hw);
+
+    conformanceBatch(b.name, b.batch);
+  }
+
+  conformanceOpc();
+  conformanceGsm();
+  conformanceCheck();
+  conformanceTuak();
+  conformanceKdf();
+  conformanceAuc();
+  conformanceTriplets();
+  conformanceDecoders();
+  fprintf(stderr, "conformance: %d passed, %d failed\n", passed, failed);
+  int cores=max((int)thread::hardware_concurrency(), 1);
+  printf("{\n  \"conformance\": {\"passed\": %d, \"failed\": %d},\n", passed, failed);
+  printf("  \"cores\": %d,\n  \"backends\": [", cores);
+
+  for (size_t i=0; i < backends.size(); i++) {
+    backend &b=backends[i];
+    printf("%s\n    {\"name\": \"%s\", \"latency_ns\": %.1f, \"batch\": [", i ? "," : "",
+           b.name, latency(b.hw));
+
+    // 1, 2, 4, ... threads, and all the cores
+    for (int t=1; ; t= t*2 < cores ? t*2 : cores) {
+      double rate=throughput(b.batch, t);
+      printf("%s\n      {\"threads\": %d, \"vectors_per_s\": %.0f, \"vectors_per_s_per_core\": %.0f}",
+             t > 1 ? "," : "", t, rate, rate / min(t, cores));
+      fprintf(stderr, "%s, %d threads: %.0f vectors/s\n", b.name, t, rate);
+
+      if (t == cores)
+        break;
+    }
+
+    printf("\n    ]}");
+  }
+
+  printf("\n  ]\n}\n");
+  return failed == 0 ? 0 : 1;
+}
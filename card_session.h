@@ -0,0 +1,499 @@
+/*
+  Card sessions as coroutines: the USIM commands are awaited on the
+  non-blocking readers of apdu_engine.h, so a personalization script
+  keeps the sequential style of the USIM class while the sessions of
+  many readers interleave on a few threads
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef CARD_SESSION_H
+#define CARD_SESSION_H
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <apdu_engine.h>
+
+/*
+  Coroutine returning a T (not void), started when awaited (lazy):
+  the awaiting coroutine is resumed when this one returns, exceptions go
+  to the awaiting coroutine. From plain code: start(), then result() once
+  done(), syncWait() does both.
+*/
+template <class T> class Task {
+ public:
+  struct promise_type {
+    optional<T> value;
+    exception_ptr error;
+    coroutine_handle<> continuation;
+
+    Task get_return_object() {
+      return Task(coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    // back to the awaiting coroutine, without growing the stack
+    struct finalAwaiter {
+      bool await_ready() noexcept {
+        return false;
+      }
+
+      coroutine_handle<> await_suspend(coroutine_handle<promise_type> h) noexcept {
+        coroutine_handle<> c=h.promise().continuation;
+        return c ? c : noop_coroutine();
+      }
+
+      void await_resume() noexcept {}
+    };
+
+    finalAwaiter final_suspend() noexcept {
+      return {};
+    }
+
+    void return_value(T v) {
+      value=move(v);
+    }
+
+    void unhandled_exception() {
+      error=current_exception();
+    }
+  };
+
+  Task(Task &&t): coro(t.coro) {
+    t.coro=nullptr;
+  }
+
+  Task(const Task &)=delete;
+
+  ~Task() {
+    if (coro)
+      coro.destroy();
+  }
+
+  bool await_ready() {
+    return false;
+  }
+
+  coroutine_handle<> await_suspend(coroutine_handle<> caller) {
+    coro.promise().continuation=caller;
+    return coro;
+  }
+
+  T await_resume() {
+    return result();
+  }
+
+  void start() {
+    coro.resume();
+  }
+
+  bool done() const {
+    return coro.done();
+  }
+
+  T result() {
+    if (coro.promise().error)
+      rethrow_exception(coro.promise().error);
+
+    return move(*coro.promise().value);
+  }
+
+ private:
+  explicit Task(coroutine_handle<promise_type> h): coro(h) {}
+  coroutine_handle<promise_type> coro;
+};
+
+// co_await of a reset or an exchange of the reader: the answer,
+// or the UICCError thrown in the coroutine
+struct apduAwaiter {
+  ApduReader &reader;
+  bool reset;
+  const Apdu *command; // in the frame of the awaiting coroutine
+  size_t answerSize;
+  int timeoutMs;
+  uint16_t *lastSW;
+  string answer;
+  optional<UICCError> error;
+
+  bool await_ready() {
+    return false;
+  }
+
+  void await_suspend(coroutine_handle<> h) {
+    ApduReader::handler done=[this, h](ApduReader &r, const string &a, const UICCError *e) {
+      answer=a;
+      *lastSW=r.lastSW;
+
+      if (e != NULL)
+        error.emplace(*e);
+
+      h.resume();
+    };
+
+    if (reset)
+      reader.reset(done);
+    else
+      reader.exchange(*command, answerSize, done, timeoutMs);
+  }
+
+  string await_resume() {
+    if (error)
+      throw *error;
+
+    return answer;
+  }
+};
+
+/*
+  The USIM commands of the USIM class, awaitable: the same files, and
+  the same select cache, SFI use and commands (UsimFiles). The encoders,
+  lastSW and the update tracking (verifyUpdates,
+  ProvisioningJournal::track) come from UICC, the blocking read() and
+  write() are not used.
+*/
+class UsimSession: public UICC {
+ public:
+  ApduReader &reader;
+
+  UsimSession(ApduReader &r): reader(r) {}
+
+  // Power cycle the card: it comes back to the MF, with no PIN verified
+  Task<string> reset() {
+    sessionReset();
+    // named: g++ 12 mishandles the temporaries of a co_await expression
+    apduAwaiter a{reader, true, NULL, 0, 0, &lastSW};
+    co_return co_await a;
+  }
+
+  // The answer of the command: data and SW, answerSize bytes at most
+  Task<string> transmit(Apdu command, size_t answerSize,
+                        int timeoutMs=ApduReader::defaultTimeoutMs) {
+    apduAwaiter a{reader, false, &command, answerSize, timeoutMs, &lastSW};
+    co_return co_await a;
+  }
+
+  // The card answers only the status word sw
+  Task<bool> sendCheck(Apdu command, uint16_t sw) {
+    string answer=co_await transmit(command, 2);
+    bool ok= answer.size() == 2 && ((uint8_t)answer[0]<<8 | (uint8_t)answer[1]) == sw;
+
+    if (!ok && debug) {
+      char expected[2]= {(char)(sw>>8), (char)sw};
+      dump_hex("Expected: ", string(expected, 2));
+      dump_hex("got answer: ", answer);
+    }
+
+    co_return ok;
+  }
+
+  // dataSize bytes then 9000
+  static bool answerOk(const string &answ, size_t dataSize) {
+    return answ.size() == dataSize+2 && answ[dataSize] == '\x90' && answ[dataSize+1] == 0;
+  }
+
+  // USIM file names, "GSM/" and a SIM class name for the files of the
+  // GSM and TELECOM DF (the UICC selects them by path as well)
+  static string filePath(const string &filename) {
+    if (filename.compare(0, 4, "GSM/") == 0)
+      return simFilePath(filename.substr(4));
+
+    return usimFilePath(filename);
+  }
+
+  Task<bool> select(string filename) {
+    string filenameBin=filePath(filename);
+
+    if (files.cached(filename)) {
+      Apdu order=UsimFiles::select(filenameBin, false);
+
+      if (! co_await sendCheck(order, 0x9000))
+        co_return false;
+
+      files.useCached(filename);
+      co_return true;
+    }
+
+    Apdu order=UsimFiles::select(filenameBin, true);
+    string answer=co_await transmit(order, 2);
+
+    if (answer.size() != 2 || answer[0] != '\x61')
+      co_return false;
+
+    Apdu getResponse=UsimFiles::getResponse(answer[1]);
+    string values=co_await transmit(getResponse, (uint8_t)answer[1] + 2);
+
+    if (values.size() < 2)
+      co_return false;
+
+    ByteView fcp(values);
+    co_return files.addFcp(filename, filenameBin, fcp.sub(0, fcp.size-2),
+                           fcp[fcp.size-2]<<8 | fcp[fcp.size-1]);
+  }
+
+  // One string for a transparent file, one per record, empty on errors
+  Task<vector<string>> readFile(string filename) {
+    fileSpan f=co_await readFile(filename, fileBuffer(), maxFileBytes);
+    co_return splitRecords(f);
+  }
+
+  // Same as USIM::readFile() in the caller buffer
+  Task<fileSpan> readFile(string filename, uint8_t *buf, size_t capacity,
+                          int first=1, int count=-1) {
+    fileSpan f;
+    f.data=buf;
+    int sfi=files.useSfi(filename);
+
+    if (sfi < 0 && ! co_await select(filename))
+      co_return f;
+
+    if (files.transparent()) {
+      long size=files.transparentSize();
+      checkCapacity(filename, size, capacity);
+
+      for (long done=0; done < size; ) {
+        unsigned char s=min(size - done, 255L);
+        Apdu command=UsimFiles::readBinary(done, s, sfi);
+        string answ=co_await transmit(command, s+2);
+
+        if (!answerOk(answ, s))
+          co_return f;
+
+        memcpy(buf+done, answ.c_str(), s);
+        done+=s;
+      }
+
+      f.stride=size;
+      f.records=1;
+      co_return f;
+    }
+
+    int last=files.lastRecord(first, count);
+    f.stride=files.recordLength();
+    checkCapacity(filename, max(last-first+1, 0)*f.stride, capacity);
+
+    for (int i=first; i <= last; i++ ) {
+      Apdu command=UsimFiles::readRecord(i, f.stride, sfi);
+      string answ=co_await transmit(command, f.stride+2);
+
+      if (!answerOk(answ, f.stride))
+        break;
+
+      memcpy(buf+f.size(), answ.c_str(), f.stride);
+      f.records++;
+    }
+
+    co_return f;
+  }
+
+  // Same as USIM::writeFile(): fillIt pads a transparent file with FF
+  // to its size, the records are always padded
+  Task<bool> writeFile(string filename, vector<string> content, bool fillIt=false) {
+    if (alreadyUpdated.count(filename))
+      co_return true;
+
+    if (! co_await select(filename))
+      co_return false;
+
+    if (files.transparent()) {
+      if (! co_await updateBinary(filename, content[0], fillIt))
+        co_return false;
+    } else
+      for (size_t i=0; i < content.size(); i++ )
+        if (! co_await updateRecord(filename, i+1, content[i]))
+          co_return false;
+
+    updateDone(filename);
+    co_return true;
+  }
+
+  // On the selected transparent file
+  Task<bool> updateBinary(string filename, string data, bool fillIt=false) {
+    Apdu command=files.updateBinary(data, fillIt);
+
+    if (! co_await sendCheck(command, 0x9000))
+      co_return false;
+
+    recordUpdate(filename, false, string((const char *)command.data(), command.dataSize()));
+    co_return true;
+  }
+
+  // On the selected linear fixed file, padded to the record length
+  Task<bool> updateRecord(string filename, int record, string data) {
+    Apdu command=files.updateRecord(record, data);
+
+    if (! co_await sendCheck(command, 0x9000))
+      co_return false;
+
+    recordUpdate(filename, true, string((const char *)command.data(), command.dataSize()));
+    co_return true;
+  }
+
+  Task<bool> verifyChv(char chv, string pwd) {
+    Apdu order(0x00, 0x20, 0x00, chv);
+    order.append(pwd).padTo(8);
+    co_return co_await sendCheck(order, 0x9000);
+  }
+
+  Task<bool> openUSIM() {
+    vector<string> res=co_await readFile("EFDIR");
+
+    if (res.size() == 0)
+      co_return false;
+
+    string AID=extractTLV(extractTLV(res[0], "Application Template"), "AID");
+    Apdu order(0x00, 0xa4, 0x04, 0x0c);
+    order.append(AID);
+    // The ADF is now the current DF, we don't know its path
+    files.currentDir="ADF";
+    co_return co_await sendCheck(order, 0x9000);
+  }
+
+  Task<int> fileRecordSize(string filename) {
+    co_await select(filename);
+
+    if (files.transparent())
+      co_return -1;
+
+    co_return files.recordLength();
+  }
+
+ protected:
+  void sessionReset() {
+    files.clear();
+  }
+
+ private:
+  // Select cache, current file and DF, as in USIM
+  UsimFiles files;
+};
+
+// Runs the task of a session on this engine, for the blocking code
+template <class T> T syncWait(ApduEngine &engine, Task<T> task) {
+  task.start();
+  engine.run();
+  Assert(task.done(), "the card session waits, but no reader is busy");
+  return task.result();
+}
+
+// Same as withRetry() for a session: step() is a coroutine
+template <class F> Task<bool> withRetry(UsimSession &card, int attempts, F step) {
+  for (int attempt=1; ; attempt++) {
+    // no co_await in a catch block: the reset is at the next attempt
+    try {
+      if (attempt > 1)
+        co_await card.reset();
+
+      co_return co_await step();
+    } catch (UICCError &e) {
+      if (!e.retryable() || attempt >= attempts)
+        throw;
+
+      fprintf(stderr, "%s: resetting the card (attempt %d of %d)\n",
+              e.what(), attempt+1, attempts);
+
+      card.keepCompletedUpdates();
+    }
+  }
+}
+
+// verifyUpdates() of a session
+static inline Task<bool> verifyUpdates(UsimSession &card, string app, FILE *out=stdout) {
+  bool allGood=true;
+  vector<UICC::fileUpdate> updates=card.updates;
+  vector<uint8_t> buf(maxFileBytes);
+
+  for (auto &u : updates) {
+    fileSpan got;
+
+    try {
+      got=co_await card.readFile(u.name, buf.data(), buf.size());
+    } catch (UICCError &e) {
+      // Typically secret files, that can be written but never read
+      if (e.type != UICCError::statusWord)
+        throw;
+    }
+
+    if (!reportUpdate(u, got, app, card.lastSW, out))
+      allGood=false;
+  }
+
+  fflush(out);
+  co_return allGood;
+}
+
+/*
+  Sessions of many readers on a few threads: each thread has its engine
+  and a share of the readers, a script runs one card session per reader
+*/
+class SessionScheduler {
+ public:
+  typedef function<Task<bool>(UsimSession &card)> script;
+  struct result {
+    string port;
+    bool ok;
+    string error; // the UICCError that stopped the script
+  };
+  int threads=1;
+
+  void add(string port, script s) {
+    sessions.push_back(make_pair(port, s));
+  }
+
+  // The results in the add() order
+  vector<result> run() {
+    vector<result> results(sessions.size());
+    vector<thread> pool;
+    int nb=max(1, min(threads, (int)sessions.size()));
+
+    for (int t=0; t < nb; t++)
+      pool.push_back(thread(&SessionScheduler::worker, this, t, nb, ref(results)));
+
+    for (auto &t : pool)
+      t.join();
+
+    sessions.clear();
+    return results;
+  }
+
+ private:
+  vector<pair<string, script>> sessions;
+
+  void worker(int first, int step, vector<result> &results) {
+    ApduEngine engine;
+    vector<size_t> mine;
+    vector<unique_ptr<UsimSession>> cards;
+    vector<Task<bool>> tasks;
+
+    for (size_t i=first; i < sessions.size(); i+=step) {
+      mine.push_back(i);
+      cards.push_back(unique_ptr<UsimSession>(new UsimSession(engine.add(sessions[i].first))));
+      tasks.push_back(sessions[i].second(*cards.back()));
+    }
+
+    for (auto &t : tasks)
+      t.start();
+
+    engine.run();
+
+    for (size_t j=0; j < mine.size(); j++) {
+      result &r=results[mine[j]];
+      r.port=sessions[mine[j]].first;
+      r.ok=false;
+
+      try {
+        Assert(tasks[j].done(), "the card session waits, but no reader is busy");
+        r.ok=tasks[j].result();
+      } catch (UICCError &e) {
+        r.error=e.what();
+      }
+    }
+  }
+};
+#endif
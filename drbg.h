@@ -0,0 +1,171 @@
+/*
+  Random numbers for the authentication RANDs: AES-128 CTR_DRBG of
+  NIST SP 800-90A (without derivation function), seeded by getrandom()
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef DRBG_H
+#define DRBG_H
+#include <sys/random.h>
+#include <uicc.h>
+#include <aes.h>
+
+/*
+  SP 800-90A section 10.2.1, AES-128: the state is Key and V, the seed
+  is 32 bytes. Each generate() call gives at most maxRequest bytes
+  (the standard allows 64 KB) and the DRBG takes fresh entropy after
+  reseedInterval calls (the standard allows 2^48)
+*/
+class CtrDrbg {
+ public:
+  static const size_t seedLen=32;
+  static const size_t maxRequest=4096;
+  static const uint64_t reseedInterval=1 << 16;
+
+  // Instantiate from an entropy input of seedLen bytes (10.2.1.3.1)
+  void instantiate(const uint8_t entropy[seedLen]) {
+    uint8_t zero[16]= {0};
+    aes_128_init(&key, zero);
+    memset(v, 0, sizeof(v));
+    update(entropy);
+    reseedCounter=1;
+  }
+
+  // Instantiate or reseed from getrandom(), that doesn't block once the
+  // kernel pool is initialized, unlike /dev/random
+  void seed() {
+    uint8_t entropy[seedLen];
+    size_t got=0;
+
+    while (got < sizeof(entropy)) {
+      ssize_t ret=getrandom(entropy + got, sizeof(entropy) - got, 0);
+
+      if (ret < 0 && errno == EINTR)
+        continue;
+
+      Assert(ret > 0, "getrandom() failed: %s", strerror(errno));
+      got+=ret;
+    }
+
+    if (reseedCounter == 0)
+      instantiate(entropy);
+    else
+      reseed(entropy);
+
+    memset(entropy, 0, sizeof(entropy));
+  }
+
+  // 10.2.1.4.1: the new entropy is XORed in the state
+  void reseed(const uint8_t entropy[seedLen]) {
+    update(entropy);
+    reseedCounter=1;
+  }
+
+  // 10.2.1.5.1, without additional input: longer outputs are several
+  // requests of maxRequest bytes
+  void generate(uint8_t *out, size_t len) {
+    for (size_t done=0; done < len; done+=maxRequest)
+      generateRequest(out + done, min(len - done, (size_t)maxRequest));
+  }
+
+  // Known answer of the NIST CAVP CTR_DRBG tests: AES-128, no df, count 0
+  static bool selfTest() {
+    static const uint8_t entropy[seedLen]= {
+      0xce, 0x50, 0xf3, 0x3d, 0xa5, 0xd4, 0xc1, 0xd3, 0xd4, 0x00, 0x4e, 0xb3, 0x52, 0x44, 0xb7, 0xf2,
+      0xcd, 0x7f, 0x2e, 0x50, 0x76, 0xfb, 0xf6, 0x78, 0x0a, 0x7f, 0xf6, 0x34, 0xb2, 0x49, 0xa5, 0xfc
+    };
+    static const uint8_t expected[16]= {
+      0x65, 0x45, 0xc0, 0x52, 0x9d, 0x37, 0x24, 0x43, 0xb3, 0x92, 0xce, 0xb3, 0xae, 0x3a, 0x99, 0xa3
+    };
+    CtrDrbg test;
+    uint8_t out[64];
+    test.instantiate(entropy);
+    test.generate(out, sizeof(out));
+    test.generate(out, sizeof(out));
+    return memcmp(out, expected, sizeof(expected)) == 0;
+  }
+
+ private:
+  aes_128_ctx_t key;
+  uint8_t v[16];
+  uint64_t reseedCounter=0;
+
+  void generateRequest(uint8_t *out, size_t len) {
+    if (reseedCounter == 0 || reseedCounter > reseedInterval)
+      seed();
+
+    // All the counter blocks first, then encrypted together
+    uint8_t blocks[maxRequest];
+    size_t n=(len + 15) / 16;
+
+    for (size_t i=0; i < n; i++) {
+      increment();
+      memcpy(blocks + 16*i, v, 16);
+    }
+
+    aes_128_encrypt_blocks(&key, blocks, blocks, n);
+    memcpy(out, blocks, len);
+    memset(blocks, 0, 16*n);
+
+    uint8_t zero[seedLen]= {0};
+    update(zero);
+    reseedCounter++;
+  }
+
+  void increment() {
+    for (int i=15; i >= 0 && ++v[i] == 0; i--);
+  }
+
+  // 10.2.1.2: Key || V = leftmost 32 bytes of the CTR output XOR provided
+  void update(const uint8_t provided[seedLen]) {
+    uint8_t temp[seedLen];
+
+    for (size_t pos=0; pos < seedLen; pos+=16) {
+      increment();
+      aes_128_encrypt_block(&key, v, temp + pos);
+    }
+
+    for (size_t i=0; i < seedLen; i++)
+      temp[i]^=provided[i];
+
+    aes_128_init(&key, temp);
+    memcpy(v, temp + 16, 16);
+  }
+};
+
+/*
+  randomBytes - len random bytes from the DRBG of the calling thread
+  Each thread has its own DRBG and a buffer of maxRequest bytes, so a
+  RAND costs a memcpy, without lock or system call
+*/
+static inline void randomBytes(void *out, size_t len) {
+  struct threadPool {
+    CtrDrbg drbg;
+    uint8_t buf[CtrDrbg::maxRequest];
+    size_t used=sizeof(buf);
+  };
+  static thread_local threadPool pool;
+  static const bool tested=CtrDrbg::selfTest();
+  Assert(tested, "the DRBG gives wrong known answers");
+  uint8_t *o=(uint8_t *)out;
+
+  while (len > 0) {
+    if (pool.used == sizeof(pool.buf)) {
+      pool.drbg.generate(pool.buf, sizeof(pool.buf));
+      pool.used=0;
+    }
+
+    size_t n=min(len, sizeof(pool.buf) - pool.used);
+    memcpy(o, pool.buf + pool.used, n);
+    // What was served is not kept in memory
+    memset(pool.buf + pool.used, 0, n);
+    pool.used+=n;
+    o+=n;
+    len-=n;
+  }
+}
+#endif
@@ -0,0 +1,175 @@
+/*
+  Export of the programmed subscribers for the core network:
+  OAI HSS (SQL), Open5GS (mongoimport JSON) or plain CSV
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef HSS_EXPORT_H
+#define HSS_EXPORT_H
+#include <memory>
+#include <uicc.h>
+
+/*
+  One line per subscriber, written and flushed as soon as the card is
+  programmed, so a stopped batch still gives a correct file for the
+  cards already done. The format comes from the file extension:
+  .sql  OAI HSS "users" table insertions (mysql oai_db < file.sql)
+  .json Open5GS subscribers (mongoimport --db open5gs --collection subscribers --file file.json)
+  other CSV: imsi,msisdn,ki,opc,sqn with the text fields quoted
+  The SQN is the one the HSS must use next, when we know it from the
+  card AUTS, else 0 (empty in CSV): the HSS will resynchronize.
+*/
+class SubscriberExport {
+ public:
+  enum exportFormat {
+    oaiSql,
+    open5gsJson,
+    csv,
+  };
+
+  ~SubscriberExport() {
+    if (f != NULL)
+      fclose(f);
+  }
+
+  bool open(string path) {
+    if (path.size() > 4 && path.substr(path.size()-4) == ".sql")
+      format=oaiSql;
+    else if (path.size() > 5 && path.substr(path.size()-5) == ".json")
+      format=open5gsJson;
+    else
+      format=csv;
+
+    // Append: a resumed batch adds its cards to the same file
+    // Secret keys: a new file is only for its owner, as --derive-output
+    int fd=::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || (f=fdopen(fd, "a")) == NULL) {
+      if (fd >= 0)
+        ::close(fd);
+
+      return false;
+    }
+
+    bool empty= st.st_size == 0;
+
+    if (st.st_mode & (S_IRGRP | S_IROTH))
+      fprintf(stderr, "WARNING: %s is readable by other users, it will hold secret keys\n",
+              path.c_str());
+
+    if (empty && format == csv)
+      fprintf(f, "imsi,msisdn,ki,opc,sqn\n");
+
+    fflush(f);
+    return true;
+  }
+
+  // sqn < 0: not known
+  void add(string imsi, string msisdn, string ki, string opc, int64_t sqn) {
+    ki=lowerHex(ki);
+    opc=lowerHex(opc);
+
+    switch (format) {
+      case oaiSql:
+        // Same columns and default values as the OAI HSS oai_db.sql users
+        fprintf(f, "INSERT INTO `users` (`imsi`, `msisdn`, `imei`, `imei_sv`, "
+                "`ms_ps_status`, `rau_tau_timer`, `ue_ambr_ul`, `ue_ambr_dl`, "
+                "`access_restriction`, `mme_cap`, `mmeidentity_idmmeidentity`, "
+                "`key`, `RFSP-Index`, `urrp_mme`, `sqn`, `rand`, `OPc`) VALUES "
+                "(%s, %s, NULL, NULL, 'PURGED', 120, 50000000, 100000000, 47, "
+                "0000000000, 1, X%s, 1, 0, %" PRId64 ", "
+                "0x00000000000000000000000000000000, X%s);\n",
+                sqlString(imsi).c_str(),
+                msisdn.size() > 0 ? sqlString(msisdn).c_str() : "NULL",
+                sqlString(ki).c_str(), max(sqn, (int64_t)0), sqlString(opc).c_str());
+        break;
+
+      case open5gsJson:
+        // Open5GS WebUI default subscriber profile
+        fprintf(f, "{\"schema_version\":1,\"imsi\":\"%s\",\"msisdn\":[%s],"
+                "\"security\":{\"k\":\"%s\",\"amf\":\"8000\",\"op\":null,\"opc\":\"%s\","
+                "\"sqn\":{\"$numberLong\":\"%" PRId64 "\"}},"
+                "\"ambr\":{\"downlink\":{\"value\":1,\"unit\":3},\"uplink\":{\"value\":1,\"unit\":3}},"
+                "\"slice\":[{\"sst\":1,\"default_indicator\":true,\"session\":[{\"name\":\"internet\",\"type\":3,"
+                "\"qos\":{\"index\":9,\"arp\":{\"priority_level\":8,\"pre_emption_capability\":1,\"pre_emption_vulnerability\":1}},"
+                "\"ambr\":{\"downlink\":{\"value\":1,\"unit\":3},\"uplink\":{\"value\":1,\"unit\":3}}}]}],"
+                "\"access_restriction_data\":32,\"subscriber_status\":0,\"network_access_mode\":0,"
+                "\"subscribed_rau_tau_timer\":12,\"__v\":0}\n",
+                jsonEscape(imsi).c_str(),
+                msisdn.size() > 0 ? ("\"" + jsonEscape(msisdn) + "\"").c_str() : "",
+                jsonEscape(ki).c_str(), jsonEscape(opc).c_str(), max(sqn, (int64_t)0));
+        break;
+
+      case csv:
+        fprintf(f, "%s,%s,%s,%s,%s\n", csvField(imsi).c_str(), csvField(msisdn).c_str(),
+                csvField(ki).c_str(), csvField(opc).c_str(),
+                sqn >= 0 ? to_string(sqn).c_str() : "");
+        break;
+    }
+
+    fflush(f);
+  }
+
+ private:
+  static string lowerHex(string in) {
+    for (auto &c : in)
+      c=tolower(c);
+
+    return in;
+  }
+
+  // The values come from batch files: they are escaped whatever they hold
+  // SQL string, in X'' for the binary columns
+  static string sqlString(const string &in) {
+    string ret="'";
+
+    for (char c : in) {
+      if (c == '\'' || c == '\\')
+        ret+=c;
+
+      ret+=c;
+    }
+
+    return ret+"'";
+  }
+
+  // RFC 4180 field
+  static string csvField(const string &in) {
+    string ret="\"";
+
+    for (char c : in) {
+      if (c == '"')
+        ret+=c;
+
+      ret+=c;
+    }
+
+    return ret+"\"";
+  }
+
+  // Content of a JSON string
+  static string jsonEscape(const string &in) {
+    string ret;
+
+    for (char c : in) {
+      if (c == '"' || c == '\\')
+        ret+='\\';
+
+      if ((unsigned char)c < 0x20)
+        ret+=stringPrintf("\\u%04x", (unsigned char)c);
+      else
+        ret+=c;
+    }
+
+    return ret;
+  }
+
+  exportFormat format=csv;
+  FILE *f=NULL;
+};
+#endif
@@ -0,0 +1,187 @@
+/*
+  Inventory of the cards in a rack of readers, to audit returned or
+  stocked cards: one session per card reads what identifies the card
+  and its network settings, one JSON line per card (JSON Lines).
+  A file the card doesn't have, or refuses to read, is null.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef INVENTORY_H
+#define INVENTORY_H
+#include <card_session.h>
+
+// JSON string ("in" is card data): the bytes that are not printable
+// ASCII are kept as \u00XX, the code point of the same value
+static inline string jsonString(ByteView in) {
+  string ret="\"";
+
+  for (size_t i=0; i < in.size; i++) {
+    unsigned char c=in[i];
+
+    if (!isprint(c)) {
+      ret+=stringPrintf("\\u%04x", c);
+      continue;
+    }
+
+    if (c == '"' || c == '\\')
+      ret+='\\';
+
+    ret+=c;
+  }
+
+  return ret+"\"";
+}
+
+/*
+  The fields, in this order:
+  port, atr, iccid, gsm_imsi, sst (GSM DF), imsi, msisdn, spn,
+  mnc_length, ad, acc, plmn_act, oplmn_act, hplmn_act (lists of
+  {"plmn":"mcc-mnc","act":hexa}), fplmn, ehplmn (lists of "mcc-mnc"),
+  ust, loci, psloci (hexa)
+  The selects of a file are cached, the USIM files with a SFI are read
+  without select.
+*/
+class CardInventory {
+ public:
+  CardInventory(UsimSession &c): card(c), buf(maxFileBytes) {}
+
+  // Reset the card and read it: the JSON line, without the end of line
+  Task<string> run() {
+    line="{";
+    add("port", jsonString(card.reader.port));
+    string atr=co_await card.reset();
+    add("atr", hexField(atr));
+    fileSpan f=co_await read("ICCID");
+    add("iccid", f.records ? jsonString(bcdToAscii(f.record(0))) : "null");
+    f=co_await read("GSM/IMSI");
+    add("gsm_imsi", f.records ? jsonString(card.decodeIMSI(f.record(0))) : "null");
+    f=co_await read("GSM/SIM service table");
+    add("sst", hexField(f));
+
+    // a SIM (no EFDIR) or a UICC without USIM
+    bool usim=false;
+
+    try {
+      usim=co_await card.openUSIM();
+    } catch (UICCError &e) {
+      if (e.type != UICCError::statusWord)
+        throw;
+    }
+
+    if (!usim) {
+      add("usim", "false");
+      co_return line+"}";
+    }
+
+    f=co_await read("IMSI");
+    add("imsi", f.records ? jsonString(card.decodeIMSI(f.record(0))) : "null");
+    // the first number only (might be several)
+    f=co_await read("MSISDN");
+    add("msisdn", f.records ? jsonString(card.decodeISDN(f.record(0))) : "null");
+    f=co_await read("Service Provider Name");
+    add("spn", f.records ? spn(f.record(0)) : "null");
+    // TS 31.102 4.2.18: length of the MNC in the IMSI in byte 4
+    f=co_await read("Administrative data");
+    add("mnc_length", f.records && f.stride >= 4 ? to_string(f.record(0)[3] & 0xF) : "null");
+    add("ad", hexField(f));
+    f=co_await read("Access control class");
+    add("acc", hexField(f));
+    f=co_await read("PLMN selector with Access Technology");
+    add("plmn_act", plmnList(f, true));
+    f=co_await read("Operator controlled PLMN selector with Access Technology");
+    add("oplmn_act", plmnList(f, true));
+    f=co_await read("Home PLMN selector with Access Technology");
+    add("hplmn_act", plmnList(f, true));
+    f=co_await read("Forbidden PLMNs");
+    add("fplmn", plmnList(f, false));
+    f=co_await read("Equivalent Home PLMN");
+    add("ehplmn", plmnList(f, false));
+    f=co_await read("USIM service table");
+    add("ust", hexField(f));
+    f=co_await read("CS Location information");
+    add("loci", hexField(f));
+    f=co_await read("PS Location information");
+    add("psloci", hexField(f));
+    co_return line+"}";
+  }
+
+ private:
+  UsimSession &card;
+  vector<uint8_t> buf;
+  string line;
+
+  // The file in buf, no record if the card refuses it
+  Task<fileSpan> read(string name) {
+    fileSpan f;
+
+    try {
+      f=co_await card.readFile(name, buf.data(), buf.size());
+    } catch (UICCError &e) {
+      if (e.type != UICCError::statusWord)
+        throw;
+    }
+
+    co_return f;
+  }
+
+  void add(const char *name, const string &value) {
+    if (line.size() > 1)
+      line+=',';
+
+    line+='"';
+    line+=name;
+    line+="\":";
+    line+=value;
+  }
+
+  static string hexField(ByteView data) {
+    return "\"" + hexString(data.str()) + "\"";
+  }
+
+  static string hexField(const fileSpan &f) {
+    return f.records ? hexField(ByteView(f.data, f.size())) : "null";
+  }
+
+  // Display condition byte, then the name padded with FF
+  static string spn(ByteView data) {
+    ByteView name=data.sub(1);
+    size_t end=0;
+
+    while (end < name.size && name[end] != 0xff)
+      end++;
+
+    return jsonString(name.sub(0, end));
+  }
+
+  // Entries of 3 bytes, 5 with the access technology
+  static string plmnList(const fileSpan &f, bool act) {
+    if (f.records == 0)
+      return "null";
+
+    ByteView all(f.data, f.size());
+    size_t entry= act ? 5 : 3;
+    string ret="[";
+
+    for (size_t i=0; i + entry <= all.size; i+=entry) {
+      string plmn=decodePlmn(all.sub(i, 3));
+
+      if (plmn == "")
+        continue;
+
+      if (ret.size() > 1)
+        ret+=',';
+
+      if (act)
+        ret+="{\"plmn\":\"" + plmn + "\",\"act\":" + hexField(all.sub(i+3, 2)) + "}";
+      else
+        ret+="\"" + plmn + "\"";
+    }
+
+    return ret+"]";
+  }
+};
+#endif
@@ -0,0 +1,188 @@
+/*
+  Provisioning journal: which subscriber went to which card, and how far
+  the card programming went, so that a batch can be resumed after a crash
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <uicc.h>
+
+/*
+  The journal is an append-only text file, one entry per line:
+  A <index> <imsi> <iccid>      subscriber <index> of the batch goes to card <iccid>
+  F <index> <app> <file name>   the card accepted the update of this file
+  D <index> <imsi> <iccid>      the card is completely programmed, with this iccid
+  <index> is the subscriber line number in the batch file, an empty imsi
+  or iccid is "-".
+
+  A and D entries are synced to disk before we go on, F entries are synced
+  by groups: after a crash we may write again a few files, that is harmless
+*/
+class ProvisioningJournal {
+ public:
+  struct cardState {
+    string imsi;
+    string iccid;
+    bool done=false;
+    set<string> files; // "app file name" of the files already written
+  };
+  map<int, cardState> cards;
+
+  ~ProvisioningJournal() {
+    close();
+  }
+
+  // Load the existing entries (if any) and open the journal for appending
+  bool open(string path) {
+    FILE *f=fopen(path.c_str(), "r");
+
+    if (f != NULL) {
+      char line[512];
+
+      while (fgets(line, sizeof(line), f) != NULL) {
+        char type, imsi[64], iccid[64];
+        int index, pos;
+        string l(line);
+
+        if (l.size() > 0 && l.back() == '\n')
+          l.pop_back();
+
+        if (sscanf(l.c_str(), "%c %d %n", &type, &index, &pos) < 2)
+          continue; // comment or truncated line from a crash
+
+        cardState &c=cards[index];
+
+        if (type == 'F')
+          c.files.insert(l.substr(pos));
+        else if ((type == 'A' || type == 'D') &&
+                 sscanf(l.c_str()+pos, "%63s %63s", imsi, iccid) == 2) {
+          c.imsi=unmark(imsi);
+          c.iccid=unmark(iccid);
+          c.done= c.done || type == 'D';
+        }
+      }
+
+      fclose(f);
+    }
+
+    fd=::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0)
+      return false;
+
+    if (current == NULL) {
+      current=this;
+      atexit(syncAtExit);
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (fd < 0)
+      return;
+
+    sync();
+    ::close(fd);
+    fd=-1;
+
+    if (current == this)
+      current=NULL;
+  }
+
+  void assign(int index, string imsi, string iccid) {
+    cardState &c=cards[index];
+    c.imsi=imsi;
+    c.iccid=iccid;
+    append("A " + to_string(index) + " " + mark(imsi) + " " + mark(iccid), true);
+  }
+
+  void fileDone(int index, string app, string file) {
+    cards[index].files.insert(app + " " + file);
+    append("F " + to_string(index) + " " + app + " " + file,
+           ++unsynced >= syncEvery);
+  }
+
+  // iccid: the card one at the end, the batch may have changed it
+  void cardDone(int index, string iccid) {
+    cardState &c=cards[index];
+    c.done=true;
+    c.iccid=iccid;
+    append("D " + to_string(index) + " " + mark(c.imsi) + " " + mark(iccid), true);
+  }
+
+  // Make the card skip the files already written for this subscriber,
+  // and journal the new ones
+  void track(UICC &card, string app, int index) {
+    cardState &c=cards[index];
+
+    for (auto &f : c.files)
+      if (f.compare(0, app.size()+1, app + " ") == 0)
+        card.alreadyUpdated.insert(f.substr(app.size()+1));
+
+    card.onUpdate=[this, app, index](const string &file) {
+      fileDone(index, app, file);
+    };
+  }
+
+  bool sync() {
+    if (fd < 0)
+      return false;
+
+    size_t done=0;
+
+    while (done < buffer.size()) {
+      ssize_t ret=::write(fd, buffer.c_str()+done, buffer.size()-done);
+
+      if (ret < 0 && errno == EINTR)
+        continue;
+
+      if (ret <= 0)
+        return false;
+
+      done+=ret;
+    }
+
+    buffer="";
+    unsynced=0;
+    return fsync(fd) == 0;
+  }
+
+  int syncEvery=16;
+
+ private:
+  // The fields are separated by spaces: "-" for an empty one
+  static string mark(const string &field) {
+    return field.size() > 0 ? field : "-";
+  }
+
+  static string unmark(const string &field) {
+    return field == "-" ? "" : field;
+  }
+
+  void append(string entry, bool syncNow) {
+    buffer+=entry + "\n";
+
+    if (syncNow)
+      Assert(sync(), "can't write the provisioning journal");
+  }
+
+  static void syncAtExit() {
+    // An Assert() failed while programming a card: keep what we know
+    if (current != NULL)
+      current->sync();
+  }
+
+  static ProvisioningJournal *current;
+  int fd=-1;
+  string buffer;
+  int unsynced=0;
+};
+
+ProvisioningJournal *ProvisioningJournal::current=NULL;
+#endif
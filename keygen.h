@@ -0,0 +1,205 @@
+/*
+  Subscriber keys of a whole batch: Ki derived from a master key and
+  OPc from the operator OP, for the card programming and the HSS
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef KEYGEN_H
+#define KEYGEN_H
+#include <array>
+#include <memory>
+#include <uicc.h>
+#include <aes.h>
+#include <milenage_batch.h>
+#include <hss_export.h>
+
+/**
+   ki_derive_batch - Ki = AES-128(master key, 0^64 || IMSI) of n subscribers
+   @master: master key, expanded by aes_128_init()
+   @imsi: IMSI of each subscriber, as a number (64 bits big endian in the block)
+   @ki: Ki of each subscriber
+   The IMSIs are distinct and AES is a permutation: so are the Ki, and
+   without the master key they can't be told from random keys
+*/
+static inline void ki_derive_batch(const aes_128_ctx_t *master, const uint64_t *imsi,
+                                   u8 (*ki)[16], size_t n) {
+  for (size_t i=0; i < n; i++) {
+    uint64_t be=htobe64(imsi[i]);
+    memset(ki[i], 0, 8);
+    memcpy(ki[i] + 8, &be, 8);
+  }
+
+  aes_128_encrypt_blocks(master, ki[0], ki[0], n);
+}
+
+/*
+  Fills the empty key and OPc fields of a batch file (as --allocate
+  writes it): records are read, derived and written by groups, the keys
+  stay binary from the derivation to the output formatting.
+  A key or OPc given in the file is kept.
+*/
+class KeyDeriver {
+ public:
+  bool masterKey=false;
+  bool op=false;
+
+  void setMasterKey(const u8 key[16]) {
+    aes_128_init(&master, key);
+    masterKey=true;
+  }
+
+  void setOp(const u8 opBin[16]) {
+    memcpy(opValue, opBin, 16);
+    op=true;
+  }
+
+  // Returns the number of subscribers
+  size_t run(string inFile, FILE *out, vector<unique_ptr<SubscriberExport>> &exports) {
+    FILE *in=fopen(inFile.c_str(), "r");
+    Assert(in != NULL, "can't open batch file %s", inFile.c_str());
+    fprintf(out, "# iccid,imsi,key,opc,isdn\n");
+    vector<record> group;
+    char line[512];
+    int lineNb=0;
+    size_t total=0;
+
+    while (true) {
+      bool more=fgets(line, sizeof(line), in) != NULL;
+
+      if (more) {
+        lineNb++;
+
+        if (line[0] == '#' || line[0] == '\n')
+          continue;
+
+        group.push_back(parse(line, inFile, lineNb));
+      }
+
+      if (group.size() == groupRecords || (!more && group.size() > 0)) {
+        derive(group);
+        write(group, out, exports);
+        total+=group.size();
+        group.clear();
+      }
+
+      if (!more)
+        break;
+    }
+
+    fclose(in);
+    return total;
+  }
+
+ private:
+  static const size_t groupRecords=4096;
+
+  struct record {
+    string iccid, imsi, isdn;
+    u8 ki[16];
+    u8 opc[16];
+    bool hasKi, hasOpc;
+  };
+
+  aes_128_ctx_t master;
+  u8 opValue[16];
+
+  record parse(char *line, const string &inFile, int lineNb) {
+    vector<string> fields;
+    line[strcspn(line, "\r\n")]=0;
+
+    // strsep keeps the empty fields
+    for (char *p=line, *f; (f=strsep(&p, ",")) != NULL; )
+      fields.push_back(f);
+
+    Assert(fields.size() == 5, "%s line %d: expecting iccid,imsi,key,opc,isdn",
+           inFile.c_str(), lineNb);
+    record r;
+    r.iccid=fields[0];
+    r.imsi=fields[1];
+    r.isdn=fields[4];
+    string bin;
+    r.hasKi= fields[2] != "";
+    r.hasOpc= fields[3] != "";
+
+    if (r.hasKi) {
+      Assert(makeBin(fields[2], bin) == 16, "%s line %d: the key is not 32 hexa figures",
+             inFile.c_str(), lineNb);
+      memcpy(r.ki, bin.c_str(), 16);
+    } else
+      Assert(masterKey && r.imsi.size() > 0 &&
+             r.imsi.find_first_not_of("0123456789") == string::npos,
+             "%s line %d: no key, and no --master-key or no IMSI to derive it",
+             inFile.c_str(), lineNb);
+
+    if (r.hasOpc) {
+      Assert(makeBin(fields[3], bin) == 16, "%s line %d: the OPc is not 32 hexa figures",
+             inFile.c_str(), lineNb);
+      memcpy(r.opc, bin.c_str(), 16);
+    } else
+      Assert(op, "%s line %d: no OPc, and no OP (--xx) to derive it", inFile.c_str(), lineNb);
+
+    return r;
+  }
+
+  void derive(vector<record> &group) {
+    vector<uint64_t> imsis;
+    vector<size_t> missing;
+
+    for (size_t i=0; i < group.size(); i++)
+      if (!group[i].hasKi) {
+        imsis.push_back(strtoull(group[i].imsi.c_str(), NULL, 10));
+        missing.push_back(i);
+      }
+
+    vector<array<u8, 16>> buf(max(imsis.size(), group.size()));
+    ki_derive_batch(&master, imsis.data(), (u8 (*)[16])buf.data(), imsis.size());
+
+    for (size_t i=0; i < missing.size(); i++)
+      memcpy(group[missing[i]].ki, buf[i].data(), 16);
+
+    missing.clear();
+    vector<array<u8, 16>> keys;
+
+    for (size_t i=0; i < group.size(); i++)
+      if (!group[i].hasOpc) {
+        keys.push_back(array<u8, 16>());
+        memcpy(keys.back().data(), group[i].ki, 16);
+        missing.push_back(i);
+      }
+
+    milenage_opc_gen_batch((const u8 (*)[16])keys.data(), opValue, (u8 (*)[16])buf.data(),
+                           keys.size());
+
+    for (size_t i=0; i < missing.size(); i++)
+      memcpy(group[missing[i]].opc, buf[i].data(), 16);
+  }
+
+  static string hex(const u8 *data) {
+    static const char digits[]="0123456789abcdef";
+    string s(32, '0');
+
+    for (int i=0; i < 16; i++) {
+      s[2*i]=digits[data[i] >> 4];
+      s[2*i+1]=digits[data[i] & 0xF];
+    }
+
+    return s;
+  }
+
+  void write(const vector<record> &group, FILE *out,
+             vector<unique_ptr<SubscriberExport>> &exports) {
+    for (auto &r : group) {
+      string ki=hex(r.ki), opc=hex(r.opc);
+      fprintf(out, "%s,%s,%s,%s,%s\n", r.iccid.c_str(), r.imsi.c_str(), ki.c_str(),
+              opc.c_str(), r.isdn.c_str());
+
+      for (auto &e : exports)
+        e->add(r.imsi, r.isdn, ki, opc, -1);
+    }
+  }
+};
+#endif
@@ -19,10 +19,11 @@
    AKA. This can be used to implement a simple HLR/AuC into hlr_auc_gw to allow
    EAP-AKA to be tested properly with real USIM cards.
 
-   This implementations assumes that the r1..r5 and c1..c5 constants defined in
-   TS 35.206 are used, i.e., r1=64, r2=0, r3=32, r4=64, r5=96, c1=00..00,
-   c2=00..01, c3=00..02, c4=00..04, c5=00..08. The block cipher is assumed to
-   be AES (Rijndael).
+   The r1..r5 and c1..c5 constants are a template parameter: the functions
+   without it use the TS 35.206 ones, i.e., r1=64, r2=0, r3=32, r4=64, r5=96,
+   c1=00..00, c2=00..01, c3=00..02, c4=00..04, c5=00..08, known at compile
+   time; the ones taking a milenage_params_t use operator specific values.
+   The block cipher is assumed to be AES (Rijndael).
 */
 
 #ifndef MILENAGE_H
@@ -30,10 +31,70 @@
 #include "aes.h"
 
 #define u8 uint8_t
+
+/*
+  Milenage constants: n is 0 for r1/c1 (f1, f1*), 1 for r2/c2 (f2, f5),
+  2 for f3, 3 for f4, 4 for f5*
+  rot() is the rotation of TS 35.206 4.1, by r bits towards the most
+  significant bit, xorC() adds the constant c
+*/
+struct MilenageStandard {
+  // Called with constant n: the rotations become fixed byte moves
+  inline void rot(int n, const u8 *in, u8 *out) const {
+    static const int bytes[5] = {8, 0, 4, 8, 12};
+
+    for (int i = 0; i < 16; i++)
+      out[i] = in[(i + bytes[n]) % 16];
+  }
+
+  inline void xorC(int n, u8 *x) const {
+    if (n > 0)
+      x[15] ^= 1 << (n - 1);
+  }
+};
+
+typedef struct {
+  u8 r[5];     /* r1..r5 in bits, as in the card GR R file */
+  u8 c[5][16]; /* c1..c5 */
+
+  inline void rot(int n, const u8 *in, u8 *out) const {
+    int bytes = r[n] / 8 % 16, bits = r[n] % 8;
+
+    for (int i = 0; i < 16; i++)
+      out[i] = bits == 0 ? in[(i + bytes) % 16] :
+               (in[(i + bytes) % 16] << bits) | (in[(i + bytes + 1) % 16] >> (8 - bits));
+  }
+
+  inline void xorC(int n, u8 *x) const {
+    for (int i = 0; i < 16; i++)
+      x[i] ^= c[n][i];
+  }
+
+  bool isStandard() const {
+    static const u8 stdR[5] = {64, 0, 32, 64, 96};
+    u8 stdC[5][16] = {{0}};
+
+    for (int n = 1; n < 5; n++)
+      stdC[n][15] = 1 << (n - 1);
+
+    return memcmp(r, stdR, sizeof(r)) == 0 && memcmp(c, stdC, sizeof(c)) == 0;
+  }
+} milenage_params_t;
+
+static inline milenage_params_t milenage_standard_params(void) {
+  milenage_params_t p = {{64, 0, 32, 64, 96}, {{0}}};
+
+  for (int n = 1; n < 5; n++)
+    p.c[n][15] = 1 << (n - 1);
+
+  return p;
+}
+
 /**
-   milenage_f1 - Milenage f1 and f1* algorithms
+   MilenageF1 - Milenage f1 and f1* algorithms
+   @params: r1 and c1
    @opc: OPc = 128-bit value derived from OP and K
-   @k: K = 128-bit subscriber key
+   @k: K = 128-bit subscriber key, expanded by aes_128_init()
    @_rand: RAND = 128-bit random challenge
    @sqn: SQN = 48-bit sequence number
    @amf: AMF = 16-bit authentication management field
@@ -41,7 +102,8 @@
    @mac_s: Buffer for MAC-S = 64-bit resync authentication code, or %NULL
    Returns: true on success, false on failure
 */
-bool milenage_f1(const u8 *opc, const u8 *k, const u8 *_rand,
+template <class P>
+bool MilenageF1(const P &params, const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
                  const u8 *sqn, const u8 *amf, u8 *mac_a, u8 *mac_s) {
   u8 tmp1[16], tmp2[16], tmp3[16];
   int i;
@@ -57,16 +119,16 @@ bool milenage_f1(const u8 *opc, const u8 *k, const u8 *_rand,
   memcpy(tmp2 + 8, tmp2, 8);
 
   /* OUT1 = E_K(TEMP XOR rot(IN1 XOR OP_C, r1) XOR c1) XOR OP_C */
-
-  /* rotate (tmp2 XOR OP_C) by r1 (= 0x40 = 8 bytes) */
   for (i = 0; i < 16; i++)
-    tmp3[(i + 8) % 16] = tmp2[i] ^ opc[i];
+    tmp2[i] ^= opc[i];
+
+  params.rot(0, tmp2, tmp3);
 
   /* XOR with TEMP = E_K(RAND XOR OP_C) */
   for (i = 0; i < 16; i++)
     tmp3[i] ^= tmp1[i];
 
-  /* XOR with c1 (= ..00, i.e., NOP) */
+  params.xorC(0, tmp3);
   /* f1 || f1* = E_K(tmp3) XOR OP_c */
   aes_128_encrypt_block(k, tmp3, tmp1);
 
@@ -82,11 +144,24 @@ bool milenage_f1(const u8 *opc, const u8 *k, const u8 *_rand,
   return true;
 }
 
+bool milenage_f1(const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
+                 const u8 *sqn, const u8 *amf, u8 *mac_a, u8 *mac_s) {
+  return MilenageF1(MilenageStandard(), opc, k, _rand, sqn, amf, mac_a, mac_s);
+}
+
+bool milenage_f1(const u8 *opc, const u8 *k, const u8 *_rand,
+                 const u8 *sqn, const u8 *amf, u8 *mac_a, u8 *mac_s) {
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, k);
+  return milenage_f1(opc, &ctx, _rand, sqn, amf, mac_a, mac_s);
+}
+
 
 /**
-   milenage_f2345 - Milenage f2, f3, f4, f5, f5* algorithms
+   MilenageF2345 - Milenage f2, f3, f4, f5, f5* algorithms
+   @params: r2..r5 and c2..c5
    @opc: OPc = 128-bit value derived from OP and K
-   @k: K = 128-bit subscriber key
+   @k: K = 128-bit subscriber key, expanded by aes_128_init()
    @_rand: RAND = 128-bit random challenge
    @res: Buffer for RES = 64-bit signed response (f2), or %NULL
    @ck: Buffer for CK = 128-bit confidentiality key (f3), or %NULL
@@ -95,7 +170,8 @@ bool milenage_f1(const u8 *opc, const u8 *k, const u8 *_rand,
    @akstar: Buffer for AK = 48-bit anonymity key (f5*), or %NULL
    Returns: true on success, false on failure
 */
-bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
+template <class P>
+bool MilenageF2345(const P &params, const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
                     u8 *res, u8 *ck, u8 *ik, u8 *ak, u8 *akstar) {
   u8 tmp1[16], tmp2[16], tmp3[16];
   int i;
@@ -110,13 +186,12 @@ bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
   /* OUT3 = E_K(rot(TEMP XOR OP_C, r3) XOR c3) XOR OP_C */
   /* OUT4 = E_K(rot(TEMP XOR OP_C, r4) XOR c4) XOR OP_C */
   /* OUT5 = E_K(rot(TEMP XOR OP_C, r5) XOR c5) XOR OP_C */
-
-  /* f2 and f5 */
-  /* rotate by r2 (= 0, i.e., NOP) */
   for (i = 0; i < 16; i++)
-    tmp1[i] = tmp2[i] ^ opc[i];
+    tmp2[i] ^= opc[i];
 
-  tmp1[15] ^= 1; /* XOR c2 (= ..01) */
+  /* f2 and f5 */
+  params.rot(1, tmp2, tmp1);
+  params.xorC(1, tmp1);
   /* f5 || f2 = E_K(tmp1) XOR OP_c */
   aes_128_encrypt_block(k, tmp1, tmp3);
 
@@ -131,11 +206,8 @@ bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
 
   /* f3 */
   if (ck) {
-    /* rotate by r3 = 0x20 = 4 bytes */
-    for (i = 0; i < 16; i++)
-      tmp1[(i + 12) % 16] = tmp2[i] ^ opc[i];
-
-    tmp1[15] ^= 2; /* XOR c3 (= ..02) */
+    params.rot(2, tmp2, tmp1);
+    params.xorC(2, tmp1);
     aes_128_encrypt_block(k, tmp1, ck);
 
     for (i = 0; i < 16; i++)
@@ -144,11 +216,8 @@ bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
 
   /* f4 */
   if (ik) {
-    /* rotate by r4 = 0x40 = 8 bytes */
-    for (i = 0; i < 16; i++)
-      tmp1[(i + 8) % 16] = tmp2[i] ^ opc[i];
-
-    tmp1[15] ^= 4; /* XOR c4 (= ..04) */
+    params.rot(3, tmp2, tmp1);
+    params.xorC(3, tmp1);
     aes_128_encrypt_block(k, tmp1, ik);
 
     for (i = 0; i < 16; i++)
@@ -157,11 +226,8 @@ bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
 
   /* f5* */
   if (akstar) {
-    /* rotate by r5 = 0x60 = 12 bytes */
-    for (i = 0; i < 16; i++)
-      tmp1[(i + 4) % 16] = tmp2[i] ^ opc[i];
-
-    tmp1[15] ^= 8; /* XOR c5 (= ..08) */
+    params.rot(4, tmp2, tmp1);
+    params.xorC(4, tmp1);
     aes_128_encrypt_block(k, tmp1, tmp1);
 
     for (i = 0; i < 6; i++)
@@ -171,12 +237,25 @@ bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
   return true;
 }
 
+bool milenage_f2345(const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
+                    u8 *res, u8 *ck, u8 *ik, u8 *ak, u8 *akstar) {
+  return MilenageF2345(MilenageStandard(), opc, k, _rand, res, ck, ik, ak, akstar);
+}
+
+bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
+                    u8 *res, u8 *ck, u8 *ik, u8 *ak, u8 *akstar) {
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, k);
+  return milenage_f2345(opc, &ctx, _rand, res, ck, ik, ak, akstar);
+}
+
 
 /**
-   milenage_generate - Generate AKA AUTN,IK,CK,RES
+   MilenageGenerate - Generate AKA AUTN,IK,CK,RES
+   @params: Milenage constants
    @opc: OPc = 128-bit operator variant algorithm configuration field (encr.)
    @amf: AMF = 16-bit authentication management field
-   @k: K = 128-bit subscriber key
+   @k: K = 128-bit subscriber key, expanded by aes_128_init()
    @sqn: SQN = 48-bit sequence number
    @_rand: RAND = 128-bit random challenge
    @autn: Buffer for AUTN = 128-bit authentication token
@@ -185,14 +264,15 @@ bool milenage_f2345(const u8 *opc, const u8 *k, const u8 *_rand,
    @res: Buffer for RES = 64-bit signed response (f2), or %NULL
    @res_len: Max length for res; set to used length or 0 on failure
 */
-bool milenage_generate(const u8 *opc, const u8 *amf, const u8 *k,
+template <class P>
+bool MilenageGenerate(const P &params, const u8 *opc, const u8 *amf, const aes_128_ctx_t *k,
                        const u8 *sqn, const u8 *_rand, u8 *autn, u8 *ik,
                        u8 *ck, u8 *res) {
   int i;
   u8 mac_a[8], ak[6];
 
-  if (!milenage_f1(opc, k, _rand, sqn, amf, mac_a, NULL) ||
-      !milenage_f2345(opc, k, _rand, res, ck, ik, ak, NULL))
+  if (!MilenageF1(params, opc, k, _rand, sqn, amf, mac_a, NULL) ||
+      !MilenageF2345(params, opc, k, _rand, res, ck, ik, ak, NULL))
     return false;
 
   /* AUTN = (SQN ^ AK) || AMF || MAC */
@@ -204,52 +284,95 @@ bool milenage_generate(const u8 *opc, const u8 *amf, const u8 *k,
   return true;
 }
 
+bool milenage_generate(const u8 *opc, const u8 *amf, const aes_128_ctx_t *k,
+                       const u8 *sqn, const u8 *_rand, u8 *autn, u8 *ik,
+                       u8 *ck, u8 *res) {
+  return MilenageGenerate(MilenageStandard(), opc, amf, k, sqn, _rand, autn, ik, ck, res);
+}
+
+// The standard constants keep the compile time specialization
+bool milenage_generate(const milenage_params_t *params, const u8 *opc, const u8 *amf,
+                       const aes_128_ctx_t *k, const u8 *sqn, const u8 *_rand,
+                       u8 *autn, u8 *ik, u8 *ck, u8 *res) {
+  if (params->isStandard())
+    return milenage_generate(opc, amf, k, sqn, _rand, autn, ik, ck, res);
+
+  return MilenageGenerate(*params, opc, amf, k, sqn, _rand, autn, ik, ck, res);
+}
+
+bool milenage_generate(const u8 *opc, const u8 *amf, const u8 *k,
+                       const u8 *sqn, const u8 *_rand, u8 *autn, u8 *ik,
+                       u8 *ck, u8 *res) {
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, k);
+  return milenage_generate(opc, amf, &ctx, sqn, _rand, autn, ik, ck, res);
+}
+
 
 /**
-   milenage_auts - Milenage AUTS validation
+   MilenageAuts - Milenage AUTS validation
+   @params: Milenage constants
    @opc: OPc = 128-bit operator variant algorithm configuration field (encr.)
-   @k: K = 128-bit subscriber key
+   @k: K = 128-bit subscriber key, expanded by aes_128_init()
    @_rand: RAND = 128-bit random challenge
    @auts: AUTS = 112-bit authentication token from client
    @sqn: Buffer for SQN = 48-bit sequence number
    Returns: 0 = success (sqn filled), -1 on failure
 */
-bool milenage_auts(const u8 *opc, const u8 *k, const u8 *_rand, const u8 *auts,
-                   u8 *sqn) {
+template <class P>
+bool MilenageAuts(const P &params, const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
+                   const u8 *auts, u8 *sqn) {
   u8 amf[2] = { 0x00, 0x00 }; /* TS 33.102 v7.0.0, 6.3.3 */
   u8 ak[6], mac_s[8];
   int i;
 
-  if (!milenage_f2345(opc, k, _rand, NULL, NULL, NULL, NULL, ak))
+  if (!MilenageF2345(params, opc, k, _rand, NULL, NULL, NULL, NULL, ak))
     return false;
 
   for (i = 0; i < 6; i++)
     sqn[i] = auts[i] ^ ak[i];
 
-  if (!milenage_f1(opc, k, _rand, sqn, amf, NULL, mac_s) ||
+  if (!MilenageF1(params, opc, k, _rand, sqn, amf, NULL, mac_s) ||
       memcmp(mac_s, auts + 6, 8) != 0)
     return false;
 
   return true;
 }
 
+bool milenage_auts(const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand, const u8 *auts,
+                   u8 *sqn) {
+  return MilenageAuts(MilenageStandard(), opc, k, _rand, auts, sqn);
+}
+
+bool milenage_auts(const milenage_params_t *params, const u8 *opc, const aes_128_ctx_t *k,
+                   const u8 *_rand, const u8 *auts, u8 *sqn) {
+  if (params->isStandard())
+    return milenage_auts(opc, k, _rand, auts, sqn);
+
+  return MilenageAuts(*params, opc, k, _rand, auts, sqn);
+}
+
+bool milenage_auts(const u8 *opc, const u8 *k, const u8 *_rand, const u8 *auts,
+                   u8 *sqn) {
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, k);
+  return milenage_auts(opc, &ctx, _rand, auts, sqn);
+}
+
 
 /**
-   gsm_milenage - Generate GSM-Milenage (3GPP TS 55.205) authentication triplet
-   @opc: OPc = 128-bit operator variant algorithm configuration field (encr.)
-   @k: K = 128-bit subscriber key
-   @_rand: RAND = 128-bit random challenge
+   gsm_from_umts - GSM SRES and Kc from the UMTS RES, CK, IK
+   (conversion functions c2 and c3 of TS 33.102 6.8.1.2)
+   @res: 64-bit RES
+   @ck, @ik: CK and IK
    @sres: Buffer for SRES = 32-bit SRES
    @kc: Buffer for Kc = 64-bit Kc
-   Returns: 0 on success, -1 on failure
+   With GSM_MILENAGE_ALT_SRES, SRES is the first 32 bits of RES (the
+   SRES#2 of the TS 55.205 test data) instead of c2
 */
-bool gsm_milenage(const u8 *opc, const u8 *k, const u8 *_rand, u8 *sres, u8 *kc) {
-  u8 res[8], ck[16], ik[16];
+static inline void gsm_from_umts(const u8 *res, const u8 *ck, const u8 *ik, u8 *sres, u8 *kc) {
   int i;
 
-  if (milenage_f2345(opc, k, _rand, res, ck, ik, NULL, NULL))
-    return false;
-
   for (i = 0; i < 8; i++)
     kc[i] = ck[i] ^ ck[i + 8] ^ ik[i] ^ ik[i + 8];
 
@@ -261,65 +384,156 @@ bool gsm_milenage(const u8 *opc, const u8 *k, const u8 *_rand, u8 *sres, u8 *kc)
     sres[i] = res[i] ^ res[i + 4];
 
 #endif /* GSM_MILENAGE_ALT_SRES */
+}
+
+/**
+   gsm_milenage - Generate GSM-Milenage (3GPP TS 55.205) authentication triplet
+   @opc: OPc = 128-bit operator variant algorithm configuration field (encr.)
+   @k: K = 128-bit subscriber key
+   @_rand: RAND = 128-bit random challenge
+   @sres: Buffer for SRES = 32-bit SRES
+   @kc: Buffer for Kc = 64-bit Kc
+   Returns: true on success, false on failure
+*/
+bool gsm_milenage(const u8 *opc, const u8 *k, const u8 *_rand, u8 *sres, u8 *kc) {
+  u8 res[8], ck[16], ik[16];
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, k);
+
+  if (!milenage_f2345(opc, &ctx, _rand, res, ck, ik, NULL, NULL))
+    return false;
+
+  gsm_from_umts(res, ck, ik, sres, kc);
   return true;
 }
 
+static inline uint64_t MilenageSqnValue(const u8 *sqn) {
+  uint64_t v = 0;
+
+  for (int i = 0; i < 6; i++)
+    v = v << 8 | sqn[i];
+
+  return v;
+}
+
+/*
+  USIM side of the AUTN verification (TS 33.102 6.3.3): RES, CK, IK, and
+  the SQN of AUTN, if MAC-A is right (checked before the SQN: a wrong
+  AUTN is rejected, it doesn't trigger a resynchronization)
+*/
+static inline bool MilenageCheckAutn(const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
+                                     const u8 *autn, u8 *ik, u8 *ck, u8 *res, u8 *rx_sqn) {
+  u8 mac_a[8], ak[6];
+  int i;
+
+  if (!milenage_f2345(opc, k, _rand, res, ck, ik, ak, NULL))
+    return false;
+
+  /* AUTN = (SQN ^ AK) || AMF || MAC */
+  for (i = 0; i < 6; i++)
+    rx_sqn[i] = autn[i] ^ ak[i];
+
+  if (!milenage_f1(opc, k, _rand, rx_sqn, autn + 6, mac_a, NULL))
+    return false;
+
+  return memcmp(mac_a, autn + 8, 8) == 0;
+}
+
+// AUTS = (SQN_MS ^ AK*) || MAC-S, MAC-S with AMF 0000
+static inline bool MilenageAutsGen(const u8 *opc, const aes_128_ctx_t *k, const u8 *_rand,
+                                   const u8 *sqn_ms, u8 *auts) {
+  u8 auts_amf[2] = { 0x00, 0x00 }; /* TS 33.102 v7.0.0, 6.3.3 */
+  u8 ak[6];
+  int i;
+
+  if (!milenage_f2345(opc, k, _rand, NULL, NULL, NULL, NULL, ak))
+    return false;
+
+  for (i = 0; i < 6; i++)
+    auts[i] = sqn_ms[i] ^ ak[i];
+
+  return milenage_f1(opc, k, _rand, sqn_ms, auts_amf, NULL, auts + 6);
+}
 
 /**
-   milenage_generate - Generate AKA AUTN,IK,CK,RES
+   milenage_check - Check AKA authentication (USIM side)
    @opc: OPc = 128-bit operator variant algorithm configuration field (encr.)
    @k: K = 128-bit subscriber key
-   @sqn: SQN = 48-bit sequence number
+   @sqn: SQN_MS = 48-bit highest sequence number accepted so far
    @_rand: RAND = 128-bit random challenge
    @autn: AUTN = 128-bit authentication token
-   @ik: Buffer for IK = 128-bit integrity key (f4), or %NULL
-   @ck: Buffer for CK = 128-bit confidentiality key (f3), or %NULL
-   @res: Buffer for RES = 64-bit signed response (f2), or %NULL
+   @ik: Buffer for IK = 128-bit integrity key (f4)
+   @ck: Buffer for CK = 128-bit confidentiality key (f3)
+   @res: Buffer for RES = 64-bit signed response (f2)
    @res_len: Variable that will be set to RES length
    @auts: 112-bit buffer for AUTS
+   The SQN of AUTN must be greater than SQN_MS, as 48-bit numbers
    Returns: 0 on success, -1 on failure, or -2 on synchronization failure
 */
 int milenage_check(const u8 *opc, const u8 *k, const u8 *sqn, const u8 *_rand,
                    const u8 *autn, u8 *ik, u8 *ck, u8 *res, size_t *res_len,
                    u8 *auts) {
-  int i;
-  u8 mac_a[8], ak[6], rx_sqn[6];
-  const u8 *amf;
+  u8 rx_sqn[6];
+  aes_128_ctx_t ctx;
+  aes_128_init(&ctx, k);
 
-  if (milenage_f2345(opc, k, _rand, res, ck, ik, ak, NULL))
+  if (!MilenageCheckAutn(opc, &ctx, _rand, autn, ik, ck, res, rx_sqn))
     return -1;
 
   *res_len = 8;
 
-  /* AUTN = (SQN ^ AK) || AMF || MAC */
-  for (i = 0; i < 6; i++)
-    rx_sqn[i] = autn[i] ^ ak[i];
+  if (MilenageSqnValue(rx_sqn) <= MilenageSqnValue(sqn))
+    return MilenageAutsGen(opc, &ctx, _rand, sqn, auts) ? -2 : -1;
 
-  if (memcmp(rx_sqn, sqn, 6) <= 0) {
-    u8 auts_amf[2] = { 0x00, 0x00 }; /* TS 33.102 v7.0.0, 6.3.3 */
+  return 0;
+}
 
-    if (milenage_f2345(opc, k, _rand, NULL, NULL, NULL, NULL, ak))
-      return -1;
+/*
+  SQN state of a USIM that follows TS 33.102 annex C.2: SQN = SEQ || IND,
+  IND on milenageIndBits bits, the highest SEQ accepted for each IND
+*/
+#define milenageIndBits 5
+#define milenageSeqDelta (1ULL << 28) /* annex C.2.2, the recommended delta */
 
-    for (i = 0; i < 6; i++)
-      auts[i] = sqn[i] ^ ak[i];
+typedef struct {
+  uint64_t seq[1 << milenageIndBits];
+  uint64_t sqnMs; // highest SQN accepted, for AUTS
+} milenage_usim_sqn_t;
 
-    if (milenage_f1(opc, k, _rand, sqn, auts_amf, NULL, auts + 6))
-      return -1;
+/**
+   milenage_check - Check AKA authentication with the SQN array of annex C.2
+   @usim: SQN state of the USIM, updated when the AUTN is accepted
+   Other parameters and return as the previous one: the SQN of AUTN is
+   accepted if its SEQ is greater than the SEQ of the same IND, and not
+   more than milenageSeqDelta above the highest accepted SEQ
+*/
+int milenage_check(const u8 *opc, const aes_128_ctx_t *k, milenage_usim_sqn_t *usim,
+                   const u8 *_rand, const u8 *autn, u8 *ik, u8 *ck, u8 *res, size_t *res_len,
+                   u8 *auts) {
+  u8 rx_sqn[6];
 
-    return -2;
-  }
+  if (!MilenageCheckAutn(opc, k, _rand, autn, ik, ck, res, rx_sqn))
+    return -1;
 
-  amf = autn + 6;
+  *res_len = 8;
+  uint64_t sqn = MilenageSqnValue(rx_sqn);
+  uint64_t seq = sqn >> milenageIndBits, seqMs = usim->sqnMs >> milenageIndBits;
+  int ind = sqn & ((1 << milenageIndBits) - 1);
 
-  if (milenage_f1(opc, k, _rand, rx_sqn, amf, mac_a, NULL))
-    return -1;
+  if (seq <= usim->seq[ind] || (seq > seqMs && seq - seqMs > milenageSeqDelta)) {
+    u8 sqn_ms[6];
 
-  if (memcmp(mac_a, autn + 8, 8) != 0) {
-    printf( "Milenage: MAC mismatch\n");
-    return -1;
+    for (int i = 0; i < 6; i++)
+      sqn_ms[i] = usim->sqnMs >> (40 - 8 * i);
+
+    return MilenageAutsGen(opc, k, _rand, sqn_ms, auts) ? -2 : -1;
   }
 
+  usim->seq[ind] = seq;
+
+  if (sqn > usim->sqnMs)
+    usim->sqnMs = sqn;
+
   return 0;
 }
 
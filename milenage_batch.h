@@ -0,0 +1,382 @@
+/*
+  Milenage for many subscribers at once (bulk authentication vectors)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef MILENAGE_BATCH_H
+#define MILENAGE_BATCH_H
+#include <milenage.h>
+
+/*
+  The 5 AES of a vector are serial inside a subscriber (TEMP first,
+  then OUT1 to OUT4 from TEMP), but independent between subscribers:
+  we compute groups of milenageLanes subscribers so the AES unit
+  pipelines are kept full.
+  - VAES (AVX-512): OUT1..OUT4 of a subscriber in one 512 bits register,
+    8 subscribers in flight
+  - AES-NI: 8 blocks in flight (TEMP of 8 subscribers, OUT1..OUT4 of 2)
+  - else, the portable AES subscriber per subscriber
+*/
+typedef struct {
+  u8 k[16];
+  u8 opc[16];
+  u8 rand[16];
+  u8 sqn[6];
+  u8 amf[2];
+} milenage_in_t;
+
+typedef struct {
+  u8 autn[16];
+  u8 res[8];
+  u8 ck[16];
+  u8 ik[16];
+  u8 ak[6];
+} milenage_out_t;
+
+#define milenageLanes 8
+
+// Blocks to encrypt after TEMP: OUT1 (f1), OUT2 (f2, f5), OUT3 (f3), OUT4 (f4)
+static inline void milenageOutInputs(const milenage_in_t *in, const u8 temp[16], u8 blocks[4][16]) {
+  u8 in1[16];
+  memcpy(in1, in->sqn, 6);
+  memcpy(in1 + 6, in->amf, 2);
+  memcpy(in1 + 8, in1, 8);
+
+  for (int i = 0; i < 16; i++) {
+    u8 t = temp[i] ^ in->opc[i];
+    blocks[0][(i + 8) % 16] = in1[i] ^ in->opc[i];
+    blocks[1][i] = t;
+    blocks[2][(i + 12) % 16] = t;
+    blocks[3][(i + 8) % 16] = t;
+  }
+
+  for (int i = 0; i < 16; i++)
+    blocks[0][i] ^= temp[i];
+
+  blocks[1][15] ^= 1;
+  blocks[2][15] ^= 2;
+  blocks[3][15] ^= 4;
+}
+
+static inline void milenageOutputs(const milenage_in_t *in, u8 blocks[4][16], milenage_out_t *out) {
+  for (int b = 0; b < 4; b++)
+    for (int i = 0; i < 16; i++)
+      blocks[b][i] ^= in->opc[i];
+
+  for (int i = 0; i < 6; i++)
+    out->autn[i] = in->sqn[i] ^ blocks[1][i];
+
+  memcpy(out->autn + 6, in->amf, 2);
+  memcpy(out->autn + 8, blocks[0], 8);
+  memcpy(out->res, blocks[1] + 8, 8);
+  memcpy(out->ak, blocks[1], 6);
+  memcpy(out->ck, blocks[2], 16);
+  memcpy(out->ik, blocks[3], 16);
+}
+
+static inline void milenageBatchPortable(const milenage_in_t *in, milenage_out_t *out, size_t n) {
+  for (size_t l = 0; l < n; l++) {
+    aes_128_ctx_t ctx;
+    aes_128_init(&ctx, in[l].k, false);
+    u8 temp[16], blocks[4][16];
+
+    for (int i = 0; i < 16; i++)
+      temp[i] = in[l].rand[i] ^ in[l].opc[i];
+
+    aes_128_encrypt_block(&ctx, temp, temp);
+    milenageOutInputs(in + l, temp, blocks);
+
+    for (int b = 0; b < 4; b++)
+      aes_128_encrypt_block(&ctx, blocks[b], blocks[b]);
+
+    milenageOutputs(in + l, blocks, out + l);
+  }
+}
+
+#ifdef AES_NI_BUILD
+#include <immintrin.h>
+
+/*
+  Key schedules of milenageLanes subscribers, interleaved
+  aeskeygenassist is slow and wants an immediate round constant:
+  SubWord(RotWord(w3)) XOR rcon is computed by aesenclast on a block of
+  4 copies of RotWord(w3) (ShiftRows has then no effect)
+*/
+__attribute__((target("aes,ssse3")))
+static inline void milenageKeysAesni(const u8 *const keys[milenageLanes], aes_128_ctx_t *ctx) {
+  __m128i k[milenageLanes];
+  const __m128i rotWord = _mm_set1_epi32(0x0c0f0e0d);
+  __m128i rcon = _mm_set1_epi32(1);
+
+  for (int l = 0; l < milenageLanes; l++) {
+    k[l] = _mm_loadu_si128((const __m128i *)keys[l]);
+    _mm_store_si128((__m128i *)ctx[l].hwRoundKeys[0], k[l]);
+    ctx[l].hw = true;
+  }
+
+  for (int r = 1; r <= 10; r++) {
+    for (int l = 0; l < milenageLanes; l++) {
+      __m128i t = _mm_aesenclast_si128(_mm_shuffle_epi8(k[l], rotWord), rcon);
+      k[l] = _mm_xor_si128(k[l], _mm_slli_si128(k[l], 4));
+      k[l] = _mm_xor_si128(k[l], _mm_slli_si128(k[l], 8));
+      k[l] = _mm_xor_si128(k[l], t);
+      _mm_store_si128((__m128i *)ctx[l].hwRoundKeys[r], k[l]);
+    }
+
+    // rcon = xtime(rcon): 0x80 gives 0x1b
+    rcon = r == 8 ? _mm_set1_epi32(0x1b) : _mm_slli_epi32(rcon, 1);
+  }
+}
+
+// Left rotation of a block by n bytes
+#define RotBytes(x, n) _mm_or_si128(_mm_srli_si128(x, n), _mm_slli_si128(x, 16 - (n)))
+
+/*
+  TEMP = E_K(RAND XOR OPc) of milenageLanes subscribers, then the blocks
+  to encrypt for OUT1..OUT4 (same as milenageOutInputs())
+*/
+__attribute__((target("aes,sse2")))
+static inline void milenageTempAesni(const milenage_in_t *in, const aes_128_ctx_t *ctx,
+                                     u8 blocks[milenageLanes][4][16]) {
+  __m128i s[milenageLanes];
+
+  for (int l = 0; l < milenageLanes; l++)
+    s[l] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *)in[l].rand),
+                                       _mm_loadu_si128((const __m128i *)in[l].opc)),
+                         _mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[0]));
+
+  for (int r = 1; r <= 9; r++)
+    for (int l = 0; l < milenageLanes; l++)
+      s[l] = _mm_aesenc_si128(s[l], _mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[r]));
+
+  // c2, c3, c4 are in the last byte
+  const __m128i c2 = _mm_set_epi32(0x01000000, 0, 0, 0);
+  const __m128i c3 = _mm_set_epi32(0x02000000, 0, 0, 0);
+  const __m128i c4 = _mm_set_epi32(0x04000000, 0, 0, 0);
+
+  for (int l = 0; l < milenageLanes; l++) {
+    __m128i temp = _mm_aesenclast_si128(s[l], _mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[10]));
+    __m128i opc = _mm_loadu_si128((const __m128i *)in[l].opc);
+    __m128i t = _mm_xor_si128(temp, opc);
+    // IN1 = SQN || AMF || SQN || AMF
+    int64_t sqnAmf;
+    memcpy(&sqnAmf, in[l].sqn, 6);
+    memcpy((u8 *)&sqnAmf + 6, in[l].amf, 2);
+    __m128i in1 = _mm_xor_si128(_mm_set1_epi64x(sqnAmf), opc);
+    _mm_storeu_si128((__m128i *)blocks[l][0], _mm_xor_si128(RotBytes(in1, 8), temp));
+    _mm_storeu_si128((__m128i *)blocks[l][1], _mm_xor_si128(t, c2));
+    _mm_storeu_si128((__m128i *)blocks[l][2], _mm_xor_si128(RotBytes(t, 4), c3));
+    _mm_storeu_si128((__m128i *)blocks[l][3], _mm_xor_si128(RotBytes(t, 8), c4));
+  }
+}
+
+// OUT1..OUT4 of two subscribers: 8 blocks in flight
+__attribute__((target("aes,sse2")))
+static inline void milenageOutAesni(const aes_128_ctx_t *ctx, u8 blocks[][4][16]) {
+  __m128i s[8];
+
+  for (int b = 0; b < 8; b++)
+    s[b] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)blocks[b / 4][b % 4]),
+                         _mm_load_si128((const __m128i *)ctx[b / 4].hwRoundKeys[0]));
+
+  for (int r = 1; r <= 9; r++) {
+    __m128i k0 = _mm_load_si128((const __m128i *)ctx[0].hwRoundKeys[r]);
+    __m128i k1 = _mm_load_si128((const __m128i *)ctx[1].hwRoundKeys[r]);
+
+    for (int b = 0; b < 4; b++) {
+      s[b] = _mm_aesenc_si128(s[b], k0);
+      s[b + 4] = _mm_aesenc_si128(s[b + 4], k1);
+    }
+  }
+
+  for (int b = 0; b < 8; b++)
+    _mm_storeu_si128((__m128i *)blocks[b / 4][b % 4],
+                     _mm_aesenclast_si128(s[b], _mm_load_si128((const __m128i *)ctx[b / 4].hwRoundKeys[10])));
+}
+
+// Same round key for the 4 blocks of a subscriber (the masked form avoids
+// a gcc -Wuninitialized false positive on _mm512_broadcast_i32x4)
+#define Broadcast128(x) _mm512_maskz_broadcast_i32x4(0xffff, x)
+
+// OUT1..OUT4 of milenageLanes subscribers, one 512 bits register each
+__attribute__((target("aes,vaes,avx512f")))
+static inline void milenageOutVaes(const aes_128_ctx_t *ctx, u8 blocks[milenageLanes][4][16]) {
+  __m512i s[milenageLanes];
+
+  for (int l = 0; l < milenageLanes; l++)
+    s[l] = _mm512_xor_si512(_mm512_loadu_si512(blocks[l]),
+                            Broadcast128(_mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[0])));
+
+  for (int r = 1; r <= 9; r++)
+    for (int l = 0; l < milenageLanes; l++)
+      s[l] = _mm512_aesenc_epi128(s[l],
+                                  Broadcast128(_mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[r])));
+
+  for (int l = 0; l < milenageLanes; l++)
+    _mm512_storeu_si512(blocks[l],
+                        _mm512_aesenclast_epi128(s[l],
+                                                 Broadcast128(_mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[10]))));
+}
+
+static inline void milenageBatchHw(const milenage_in_t *in, milenage_out_t *out, size_t n, bool vaes) {
+  for (size_t done = 0; done < n; done += milenageLanes) {
+    size_t lanes = n - done < milenageLanes ? n - done : milenageLanes;
+    // The last group is completed with copies of its first subscriber
+    milenage_in_t group[milenageLanes];
+    const milenage_in_t *g = in + done;
+
+    if (lanes < milenageLanes) {
+      for (int l = 0; l < milenageLanes; l++)
+        group[l] = in[done + (l < (int)lanes ? l : 0)];
+
+      g = group;
+    }
+
+    aes_128_ctx_t ctx[milenageLanes];
+    u8 blocks[milenageLanes][4][16];
+    const u8 *keys[milenageLanes];
+
+    for (int l = 0; l < milenageLanes; l++)
+      keys[l] = g[l].k;
+
+    milenageKeysAesni(keys, ctx);
+    milenageTempAesni(g, ctx, blocks);
+
+    if (vaes)
+      milenageOutVaes(ctx, blocks);
+    else
+      for (int l = 0; l < milenageLanes; l += 2)
+        milenageOutAesni(ctx + l, blocks + l);
+
+    for (size_t l = 0; l < lanes; l++)
+      milenageOutputs(g + l, blocks[l], out + done + l);
+  }
+}
+
+// OPc = E_K(OP) XOR OP of milenageLanes subscribers, keys expanded together
+__attribute__((target("aes,sse2")))
+static inline void milenageOpcAesni(const u8 *const keys[milenageLanes], const u8 op[16],
+                                    u8 *const opc[milenageLanes]) {
+  aes_128_ctx_t ctx[milenageLanes];
+  milenageKeysAesni(keys, ctx);
+  __m128i o = _mm_loadu_si128((const __m128i *)op);
+  __m128i s[milenageLanes];
+
+  for (int l = 0; l < milenageLanes; l++)
+    s[l] = _mm_xor_si128(o, _mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[0]));
+
+  for (int r = 1; r <= 9; r++)
+    for (int l = 0; l < milenageLanes; l++)
+      s[l] = _mm_aesenc_si128(s[l], _mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[r]));
+
+  for (int l = 0; l < milenageLanes; l++)
+    _mm_storeu_si128((__m128i *)opc[l],
+                     _mm_xor_si128(_mm_aesenclast_si128(s[l], _mm_load_si128((const __m128i *)ctx[l].hwRoundKeys[10])), o));
+}
+#endif
+
+enum milenageBatchImpl {
+  milenagePortable,
+  milenageAesni,
+  milenageVaes,
+};
+
+// UICC_AES=aesni in the environment disables the VAES version
+static inline milenageBatchImpl milenage_batch_impl(void) {
+  static const milenageBatchImpl impl = [] {
+#ifdef AES_NI_BUILD
+
+    if (!aes_128_use_hw())
+      return milenagePortable;
+
+    const char *forced = getenv("UICC_AES");
+
+    if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") &&
+        (forced == NULL || strcmp(forced, "aesni") != 0))
+      return milenageVaes;
+
+    return milenageAesni;
+#else
+    return milenagePortable;
+#endif
+  }();
+  return impl;
+}
+
+/**
+   milenage_generate_batch - milenage_generate() for n subscribers
+   @in: K, OPc, RAND, SQN, AMF of each vector
+   @out: AUTN, RES, CK, IK, AK of each vector
+*/
+void milenage_generate_batch(const milenage_in_t *in, milenage_out_t *out, size_t n) {
+  switch (milenage_batch_impl()) {
+#ifdef AES_NI_BUILD
+
+    case milenageVaes:
+      milenageBatchHw(in, out, n, true);
+      break;
+
+    case milenageAesni:
+      milenageBatchHw(in, out, n, false);
+      break;
+#endif
+
+    default:
+      milenageBatchPortable(in, out, n);
+  }
+}
+typedef struct {
+  u8 sres[4];
+  u8 kc[8];
+} gsm_triplet_t;
+
+/**
+   milenage_generate_batch - quintuplets and GSM triplets of n subscribers
+   @triplets: SRES and Kc of each vector, for the same RAND: c2 and c3 of
+   the quintuplet (gsm_from_umts()), TEMP and OUT2..OUT4 are shared
+*/
+void milenage_generate_batch(const milenage_in_t *in, milenage_out_t *out,
+                             gsm_triplet_t *triplets, size_t n) {
+  milenage_generate_batch(in, out, n);
+
+  for (size_t i = 0; i < n; i++)
+    gsm_from_umts(out[i].res, out[i].ck, out[i].ik, triplets[i].sres, triplets[i].kc);
+}
+
+/**
+   milenage_opc_gen_batch - milenage_opc_gen() for n subscribers of the same OP
+   @k: K of each subscriber
+   @op: OP of the operator
+   @opc: OPc of each subscriber
+*/
+void milenage_opc_gen_batch(const u8 (*k)[16], const u8 *op, u8 (*opc)[16], size_t n) {
+#ifdef AES_NI_BUILD
+
+  if (milenage_batch_impl() != milenagePortable) {
+    for (size_t done = 0; done < n; done += milenageLanes) {
+      // The last group is completed with its first subscriber, computed again
+      u8 spare[16];
+      const u8 *keys[milenageLanes];
+      u8 *out[milenageLanes];
+
+      for (size_t l = 0; l < milenageLanes; l++) {
+        keys[l] = done + l < n ? k[done + l] : k[done];
+        out[l] = done + l < n ? opc[done + l] : spare;
+      }
+
+      milenageOpcAesni(keys, op, out);
+    }
+
+    return;
+  }
+
+#endif
+
+  for (size_t i = 0; i < n; i++)
+    milenage_opc_gen(k[i], op, opc[i]);
+}
+#endif
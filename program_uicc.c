@@ -18,6 +18,16 @@
 */
 #include <uicc.h>
 #include <milenage.h>
+#include <journal.h>
+#include <hss_export.h>
+#include <allocator.h>
+#include <vectors.h>
+#include <auc.h>
+#include <sqn_cache.h>
+#include <resync.h>
+#include <keygen.h>
+#include <card_session.h>
+#include <inventory.h>
 
 struct uicc_vals {
   bool setIt=false;
@@ -33,6 +43,13 @@ struct uicc_vals {
   string rusimv="";
   int mncLen=2;
   bool authenticate=false;
+  bool verify=false;
+  int retries=3;
+  string auc="";
+  string sqnCache="sqn.cache";
+  milenage_params_t milenage=milenage_standard_params();
+  authAlgo algo=algoMilenage;
+  string snName=""; // 5G serving network name: --authenticate prints RES*
 };
 
 #define sc(in, out)           \
@@ -44,16 +61,23 @@ bool readSIMvalues(char *port) {
   string ATR;
   Assert((ATR=SIMcard.open(port))!="", "Failed to open %s", port);
   //dump_hex("ATR", ATR);
-  vector<string> res;
-  cout << "GSM IMSI: " << SIMcard.decodeIMSI(SIMcard.readFile("IMSI")[0]) << endl;
+  uint8_t buf[256];
+  fileSpan f=SIMcard.readFile("IMSI", buf, sizeof(buf));
+
+  if (f.records)
+    cout << "GSM IMSI: " << SIMcard.decodeIMSI(f.record(0)) << endl;
+
   // Show only the first isdn (might be several)
-  cout << "GSM MSISDN: " << SIMcard.decodeISDN(SIMcard.readFile("MSISDN")[0]) <<endl;
+  f=SIMcard.readFile("MSISDN", buf, sizeof(buf), 1, 1);
+
+  if (f.records)
+    cout << "GSM MSISDN: " << SIMcard.decodeISDN(f.record(0)) <<endl;
+
   SIMcard.close();
   return true;
 }
 
 bool readUSIMvalues(char *port) {
-  vector<string> res;
   USIM USIMcard;
   string ATR;
   //printf("USIM card open is %s\n",USIMcard.open(port));
@@ -61,147 +85,167 @@ bool readUSIMvalues(char *port) {
   //dump_hex("ATR", USIMcard.open(port));
   Assert((ATR=USIMcard.open(port))!="", "Failed to open %s", port);
   //dump_hex("ATR", ATR);
-  res=USIMcard.readFile("ICCID");
-  string iccid=bcdToAscii(res[0]);
-  cout << "ICCID: " << iccid <<endl;
+  // The files the card doesn't have are not shown
+  uint8_t buf[256];
+  fileSpan f=USIMcard.readFile("ICCID", buf, sizeof(buf));
+
+  if (f.records) {
+    string iccid=bcdToAscii(f.record(0));
+    cout << "ICCID: " << iccid <<endl;
 
-  if (!luhn( iccid))
-    printf("WARNING: iccid luhn encoding of last digit not done \n");
+    if (!luhn( iccid))
+      printf("WARNING: iccid luhn encoding of last digit not done \n");
+  }
 
   USIMcard.openUSIM();
-  cout << "USIM IMSI: " << USIMcard.decodeIMSI(USIMcard.readFile("IMSI")[0]) << endl;
-  res=USIMcard.readFile("PLMN selector with Access Technology");
-  //cout << "USIM PLMN selector: " << bcdToAscii(res[0]) <<endl;
+  f=USIMcard.readFile("IMSI", buf, sizeof(buf));
+
+  if (f.records)
+    cout << "USIM IMSI: " << USIMcard.decodeIMSI(f.record(0)) << endl;
+
   // Show only the first isdn (might be several)
-  vector<string> x=USIMcard.readFile("MSISDN");
-  cout << "USIM MSISDN: " << USIMcard.decodeISDN(USIMcard.readFile("MSISDN")[0]) <<endl;
-  res=USIMcard.readFile("Service Provider Name");
-  cout << "USIM Service Provider Name: " << printable(res[0].substr(1)) <<endl;
+  f=USIMcard.readFile("MSISDN", buf, sizeof(buf), 1, 1);
+
+  if (f.records)
+    cout << "USIM MSISDN: " << USIMcard.decodeISDN(f.record(0)) <<endl;
+
+  f=USIMcard.readFile("Service Provider Name", buf, sizeof(buf));
+
+  if (f.records)
+    cout << "USIM Service Provider Name: " << printable(f.record(0).sub(1).str()) <<endl;
+
   return true;
 }
 
 
-bool writeSIMvalues(char *port, struct uicc_vals &values) {
-  vector<string> res;
-  SIM USIMcard;
-  string ATR;
-  Assert((ATR=USIMcard.open(port))!="", "Failed to open %s", port);
-
+bool writeSIMfiles(SIM &USIMcard, struct uicc_vals &values) {
   if (!USIMcard.verifyChv('\x0a', values.adm)) {
     printf("chv 0a Nok\n");
     return false;
   }
 
   if (values.iccid.size() > 0)
-    Assert(USIMcard.writeFile("ICCID", USIMcard.encodeICCID(values.iccid)),
-           "can't set iccid %s",values.iccid.c_str());
+    Require(USIMcard, USIMcard.writeFile("ICCID", USIMcard.encodeICCID(values.iccid)),
+            "can't set iccid %s",values.iccid.c_str());
 
   vector<string> li;
   li.push_back("en");
-  Assert(USIMcard.writeFile("Extended language preference", li), "can't set language");
-  Assert(USIMcard.writeFile("language preference", makeBcdVect("01",false)), "can't set language");
+  Require(USIMcard, USIMcard.writeFile("Extended language preference", li), "can't set language");
+  Require(USIMcard, USIMcard.writeFile("language preference", makeBcdVect("01",false)), "can't set language");
 
   if ( values.imsi.size() > 0) {
-    Assert(USIMcard.writeFile("IMSI", USIMcard.encodeIMSI(values.imsi)),
-           "can't set imsi %s",values.imsi.c_str());
+    Require(USIMcard, USIMcard.writeFile("IMSI", USIMcard.encodeIMSI(values.imsi)),
+            "can't set imsi %s",values.imsi.c_str());
     string MccMnc=USIMcard.encodeMccMnc(values.imsi.substr(0,3),
                                         values.imsi.substr(3,values.mncLen));
     vector<string> VectMccMnc;
     VectMccMnc.push_back(MccMnc);
-    Assert(USIMcard.writeFile("PLMN selector", VectMccMnc, true), "Can't write PLMN Selector");
-    Assert(USIMcard.writeFile("Equivalent home PLMN", VectMccMnc), "Can't write Equivalent PLMN");
+    Require(USIMcard, USIMcard.writeFile("PLMN selector", VectMccMnc, true), "Can't write PLMN Selector");
+    Require(USIMcard, USIMcard.writeFile("Equivalent home PLMN", VectMccMnc), "Can't write Equivalent PLMN");
     vector<string> loci;
     loci.push_back(makeBcd("",true,4));
     loci[0]+=MccMnc;
     loci[0]+=makeBcd("0000ff01", false);
-    Assert(USIMcard.writeFile("Location information",
-                              loci), "location information");
+    Require(USIMcard, USIMcard.writeFile("Location information",
+                                        loci), "location information");
   }
 
   if ( values.acc.size() > 0)
-    Assert(USIMcard.writeFile("Access control class", USIMcard.encodeACC(values.acc)),
-           "can't set acc %s",values.acc.c_str());
+    Require(USIMcard, USIMcard.writeFile("Access control class", USIMcard.encodeACC(values.acc)),
+            "can't set acc %s",values.acc.c_str());
 
   vector<string> ad;
   ad.push_back(makeBcd("000000",false));
   ad[0]+=(char) values.mncLen;
-  Assert(USIMcard.writeFile("Administrative data", ad),
-         "can't set Administrative data");
+  Require(USIMcard, USIMcard.writeFile("Administrative data", ad),
+          "can't set Administrative data");
   vector<string> spn;
   spn.push_back(string(u8"\x01",1));
   spn[0]+=values.spn;
-  Assert(USIMcard.writeFile("Service Provider Name", spn, true), "can't set spn");
-  Assert(USIMcard.writeFile("Higher Priority PLMN search period",
-                            makeBcdVect("02", false)), "can't set plmn search period");
-  Assert(USIMcard.writeFile("Forbidden PLMN",
-                            makeBcdVect(""),true), "can't set forbidden plmn");
-  Assert(USIMcard.writeFile("Group Identifier Level 1",
-                            makeBcdVect(""),true), "can't set GID1");
-  Assert(USIMcard.writeFile("Group Identifier Level 2",
-                            makeBcdVect(""),true), "can't set GID2");
-  Assert(USIMcard.writeFile("emergency call codes",
-                            makeBcdVect(""),true), "can't set emergency call codes");
+  Require(USIMcard, USIMcard.writeFile("Service Provider Name", spn, true), "can't set spn");
+  Require(USIMcard, USIMcard.writeFile("Higher Priority PLMN search period",
+                                      makeBcdVect("02", false)), "can't set plmn search period");
+  Require(USIMcard, USIMcard.writeFile("Forbidden PLMN",
+                                      makeBcdVect(""),true), "can't set forbidden plmn");
+  Require(USIMcard, USIMcard.writeFile("Group Identifier Level 1",
+                                      makeBcdVect(""),true), "can't set GID1");
+  Require(USIMcard, USIMcard.writeFile("Group Identifier Level 2",
+                                      makeBcdVect(""),true), "can't set GID2");
+  Require(USIMcard, USIMcard.writeFile("emergency call codes",
+                                      makeBcdVect(""),true), "can't set emergency call codes");
   // Typical service list, a bit complex to define (see 3GPP TS 51.011)
-  Assert(USIMcard.writeFile("SIM service table", makeBcdVect("ff33ffff00003f033000f0c3",false)),
-         "can't set GSM service table");
+  Require(USIMcard, USIMcard.writeFile("SIM service table", makeBcdVect("ff33ffff00003f033000f0c3",false)),
+          "can't set GSM service table");
 
   if (values.isdn.size() > 0)
-    Assert(USIMcard.writeFile("MSISDN",
-                              USIMcard.encodeISDN(values.isdn, USIMcard.fileRecordSize("MSISDN"))),
-           "can't set msisdn %s",values.isdn.c_str());
+    Require(USIMcard, USIMcard.writeFile("MSISDN",
+                                        USIMcard.encodeISDN(values.isdn, USIMcard.fileRecordSize("MSISDN"))),
+            "can't set msisdn %s",values.isdn.c_str());
+
+  Require(USIMcard, USIMcard.writeFile("SMSC", makeBcdVect(""),true), "can't set SMS center");
+
+  if (values.verify)
+    return verifyUpdates(USIMcard, "GSM");
 
-  Assert(USIMcard.writeFile("SMSC", makeBcdVect(""),true), "can't set SMS center");
   return true;
 }
 
-bool writeUSIMvalues(char *port, struct uicc_vals &values) {
-  vector<string> res;
-  USIM USIMcard;
-  string ATR;
-  Assert((ATR=USIMcard.open(port))!="", "Failed to open %s", port);
-  //dump_hex("ATR", ATR);
-  USIMcard.openUSIM();
+bool writeSIMvalues(char *port, struct uicc_vals &values,
+                    ProvisioningJournal *journal=NULL, int index=0) {
+  SIM USIMcard;
+  USIMcard.open(port);
 
-  if (!USIMcard.verifyChv('\x0a', values.adm)) {
+  if (journal)
+    journal->track(USIMcard, "GSM", index);
+
+  return withRetry(USIMcard, values.retries, [&]() {
+    return writeSIMfiles(USIMcard, values);
+  });
+}
+
+// The USIM personalization script, one card session
+Task<bool> writeUSIMfiles(UsimSession &USIMcard, struct uicc_vals &values) {
+  co_await USIMcard.openUSIM();
+
+  if (! co_await USIMcard.verifyChv('\x0a', values.adm)) {
     printf("chv 0a Nok\n");
-    return false;
+    co_return false;
   }
 
   if ( values.key.size() > 0)
     // Ki files and Milenage algo parameters are specific to the card manufacturer
-    Assert(USIMcard.writeFile("GR Ki", USIMcard.encodeKi(values.key)),
-           "can't set Ki %s",values.key.c_str());
+    Require(USIMcard, co_await USIMcard.writeFile("GR Ki", USIMcard.encodeKi(values.key)),
+            "can't set Ki %s",values.key.c_str());
 
   if (values.opc.size() > 0)
-    Assert(USIMcard.writeFile("GR OPc", USIMcard.encodeOPC(values.opc)),
-           "can't set OPc %s",values.opc.c_str());
+    Require(USIMcard, co_await USIMcard.writeFile("GR OPc", USIMcard.encodeOPC(values.opc)),
+            "can't set OPc %s",values.opc.c_str());
 
   //Milenage internal paramters
-  USIMcard.writeFile("GR R",makeBcdVect("4000204060",false));
+  co_await USIMcard.writeFile("GR R",vector<string>(1, string((char *)values.milenage.r, 5)));
   vector<string> C;
-  C.push_back(makeBcd("00000000000000000000000000000000",false));
-  C.push_back(makeBcd("00000000000000000000000000000001",false));
-  C.push_back(makeBcd("00000000000000000000000000000002",false));
-  C.push_back(makeBcd("00000000000000000000000000000004",false));
-  C.push_back(makeBcd("00000000000000000000000000000008",false));
-  USIMcard.writeFile("GR C",C);
+
+  for (int i=0; i<5; i++)
+    C.push_back(string((char *)values.milenage.c[i], 16));
+
+  co_await USIMcard.writeFile("GR C",C);
   vector<string> li;
   li.push_back("en");
-  Assert(USIMcard.writeFile("language preference", li), "can't set language");
-  Assert(USIMcard.writeFile("SMSC", makeBcdVect("",true,40)),
-         "can't set SMSC");
+  Require(USIMcard, co_await USIMcard.writeFile("language preference", li), "can't set language");
+  Require(USIMcard, co_await USIMcard.writeFile("SMSC", makeBcdVect("",true,40)),
+          "can't set SMSC");
 
   if (values.isdn.size() > 0)
-    Assert(USIMcard.writeFile("MSISDN", USIMcard.encodeISDN(values.isdn, USIMcard.fileRecordSize("MSISDN"))),
-           "can't set msisdn %s",values.isdn.c_str());
+    Require(USIMcard, co_await USIMcard.writeFile("MSISDN", USIMcard.encodeISDN(values.isdn, co_await USIMcard.fileRecordSize("MSISDN"))),
+            "can't set msisdn %s",values.isdn.c_str());
 
   if ( values.acc.size() > 0)
-    Assert(USIMcard.writeFile("Access control class", USIMcard.encodeACC(values.acc)),
-           "can't set acc %s",values.acc.c_str());
+    Require(USIMcard, co_await USIMcard.writeFile("Access control class", USIMcard.encodeACC(values.acc)),
+            "can't set acc %s",values.acc.c_str());
 
   if ( values.imsi.size() > 0) {
-    Assert(USIMcard.writeFile("IMSI", USIMcard.encodeIMSI(values.imsi)),
-           "can't set imsi %s",values.imsi.c_str());
+    Require(USIMcard, co_await USIMcard.writeFile("IMSI", USIMcard.encodeIMSI(values.imsi)),
+            "can't set imsi %s",values.imsi.c_str());
     string MccMnc=USIMcard.encodeMccMnc(values.imsi.substr(0,3),
                                         values.imsi.substr(3,values.mncLen));
     vector<string> VectMccMnc;
@@ -209,101 +253,88 @@ bool writeUSIMvalues(char *port, struct uicc_vals &values) {
     vector<string> MccMncWithAct=VectMccMnc;
     // Add EUTRAN access techno only
     MccMncWithAct[0]+=string(u8"\x40\x00",2);
-    Assert(USIMcard.writeFile("PLMN selector with Access Technology",
-                              MccMncWithAct, true), "Can't write PLMN Selector");
-    Assert(USIMcard.writeFile("Operator controlled PLMN selector with Access Technology",
-                              MccMncWithAct, true), "Can't write Operator PLMN Selector");
-    Assert(USIMcard.writeFile("Home PLMN selector with Access Technology",
-                              MccMncWithAct, true), "Can't write home  PLMN Selector");
-    Assert(USIMcard.writeFile("Equivalent Home PLMN",
-                              VectMccMnc), "Can't write Equivalent PLMN");
+    Require(USIMcard, co_await USIMcard.writeFile("PLMN selector with Access Technology",
+                                        MccMncWithAct, true), "Can't write PLMN Selector");
+    Require(USIMcard, co_await USIMcard.writeFile("Operator controlled PLMN selector with Access Technology",
+                                        MccMncWithAct, true), "Can't write Operator PLMN Selector");
+    Require(USIMcard, co_await USIMcard.writeFile("Home PLMN selector with Access Technology",
+                                        MccMncWithAct, true), "Can't write home  PLMN Selector");
+    Require(USIMcard, co_await USIMcard.writeFile("Equivalent Home PLMN",
+                                        VectMccMnc), "Can't write Equivalent PLMN");
     vector<string> psloci;
     psloci.push_back(makeBcd("",true,7));
     psloci[0]+=MccMnc;
     psloci[0]+=makeBcd("0000ff01", false);
-    Assert(USIMcard.writeFile("PS Location information",
-                              psloci,false),
-           "PS location information");
+    Require(USIMcard, co_await USIMcard.writeFile("PS Location information",
+                                        psloci,false),
+            "PS location information");
     vector<string> csloci;
     csloci.push_back(makeBcd("",true,4));
     csloci[0]+=MccMnc;
     csloci[0]+=makeBcd("0000ff01", false);
-    Assert(USIMcard.writeFile("CS Location information",
-                              csloci, false),
-           "CS location information");
+    Require(USIMcard, co_await USIMcard.writeFile("CS Location information",
+                                        csloci, false),
+            "CS location information");
   }
 
   vector<string> ad;
   ad.push_back(makeBcd("000000",false));
   ad[0]+=(char) values.mncLen;
-  Assert(USIMcard.writeFile("Administrative data", ad),
-         "can't set Administrative data");
+  Require(USIMcard, co_await USIMcard.writeFile("Administrative data", ad),
+          "can't set Administrative data");
   vector<string> spn;
   spn.push_back(string(u8"\x01",1));
   spn[0]+=values.spn;
-  Assert(USIMcard.writeFile("Service Provider Name", spn, true), "can't set spn");
-  Assert(USIMcard.writeFile("Higher Priority PLMN search period", makeBcdVect("02", false)), "can't set plmn search period");
-  Assert(USIMcard.writeFile("Forbidden PLMNs", makeBcdVect("",true,12)), "can't set forbidden plmn");
-  Assert(USIMcard.writeFile("Group Identifier Level 1", makeBcdVect("",true,4)), "can't set GID1");
-  Assert(USIMcard.writeFile("Group Identifier Level 2", makeBcdVect("",true,4)), "can't set GID2");
+  Require(USIMcard, co_await USIMcard.writeFile("Service Provider Name", spn, true), "can't set spn");
+  Require(USIMcard, co_await USIMcard.writeFile("Higher Priority PLMN search period", makeBcdVect("02", false)), "can't set plmn search period");
+  Require(USIMcard, co_await USIMcard.writeFile("Forbidden PLMNs", makeBcdVect("",true,12)), "can't set forbidden plmn");
+  Require(USIMcard, co_await USIMcard.writeFile("Group Identifier Level 1", makeBcdVect("",true,4)), "can't set GID1");
+  Require(USIMcard, co_await USIMcard.writeFile("Group Identifier Level 2", makeBcdVect("",true,4)), "can't set GID2");
   vector<string> ecc;
   ecc.push_back(makeBcd("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",false));
   ecc.push_back(makeBcd("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",false));
   ecc.push_back(makeBcd("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",false));
   ecc.push_back(makeBcd("FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",false));
-  Assert(USIMcard.writeFile("emergency call codes", ecc), "can't set emergency call codes");
+  Require(USIMcard, co_await USIMcard.writeFile("emergency call codes", ecc), "can't set emergency call codes");
   // Typical service list, a bit complex to define (see 3GPP TS 51.011)
-  Assert(USIMcard.writeFile("USIM service table", makeBcdVect("867F1F1C230E0000400050", false)),
-         "can't set USIM service table");
-  return true;
-}
+  Require(USIMcard, co_await USIMcard.writeFile("USIM service table", makeBcdVect("867F1F1C230E0000400050", false)),
+          "can't set USIM service table");
 
-static inline int makeBin(string in, string &out) {
-  out="";
+  if (values.verify)
+    co_return co_await verifyUpdates(USIMcard, "USIM");
 
-  if ( in.size() %2 == 1)
-    return -1;
-
-  for (size_t i=0; i<in.size(); i++) {
-    uint8_t tmp=255;
-
-    if (in[i] >= '0' && in[i]<= '9')
-      tmp=in[i]-'0';
-
-    if (in[i] >= 'a' && in[i]<= 'f')
-      tmp=in[i]-'a'+10;
-
-    if (in[i] >= 'A' && in[i]<= 'F')
-      tmp=in[i]-'A'+10;
-
-    if (tmp == 255)
-      return -1;
-
-    i++;
-
-    if (in[i] >= '0' && in[i] <= '9') {
-      out+=(unsigned char) ((in[i]-'0') | tmp <<4);
-      continue;
-    }
+  co_return true;
+}
 
-    if (in[i] >= 'a' && in[i] <= 'f') {
-      out+=(unsigned char) ((in[i]-'a'+10) | tmp <<4);
-      continue;
-    }
+bool writeUSIMvalues(char *port, struct uicc_vals &values,
+                     ProvisioningJournal *journal=NULL, int index=0) {
+  ApduEngine engine;
+  UsimSession USIMcard(engine.add(port));
+  syncWait(engine, USIMcard.reset());
 
-    if (in[i] >= 'A' && in[i] <= 'F') {
-      out+=(unsigned char) ((in[i]-'A'+10) | tmp <<4);
-      continue;
-    }
+  if (journal)
+    journal->track(USIMcard, "USIM", index);
 
-    return -1;
-  }
-
-  return in.size()/2;
+  return syncWait(engine, withRetry(USIMcard, values.retries, [&]() {
+    return writeUSIMfiles(USIMcard, values);
+  }));
 }
 
 void setOPc(struct uicc_vals &values) {
   string key;
+
+  if (values.algo == algoTuak) {
+    // TOPc from TOP
+    string top;
+    int kLen=makeBin(values.key, key);
+    Assert(kLen == 16 || kLen == 32, "can't read a correct key: 32 or 64 hexa figures\n");
+    Assert(makeBin(values.op, top) == 32, "can't read a correct TOP: 64 hexa figures\n");
+    uint8_t topc[32];
+    tuak_topc_gen((const uint8_t *)key.c_str(), kLen, (const uint8_t *)top.c_str(), topc);
+    values.opc=hexString(string((char *)topc, sizeof(topc)));
+    return;
+  }
+
   Assert(makeBin(values.key, key) == 16, "can't read a correct key: 16 hexa figures\n");
   string op;
   Assert(makeBin(values.op, op) == 16, "can't read a correct op: 16 hexa figures\n");
@@ -319,95 +350,732 @@ void setOPc(struct uicc_vals &values) {
   }
 }
 
-void authenticate(char *port, struct uicc_vals &values) {
-  string key;
-  Assert(makeBin(values.key, key) == 16, "can't read a correct key: 16 hexa figures\n");
-  string opc;
-  Assert(makeBin(values.opc, opc) == 16, "can't read a correct opc: 16 hexa figures\n");
+// Authentication with the vectors of the AuC stand-in, that manages the SQN:
+// one challenge, a second one only after a resynchronization
+int64_t aucAuthenticate(USIM &USIMcard, struct uicc_vals &values) {
+  AucClient auc;
+  Assert(auc.connect(values.auc), "can't connect to the AuC on %s", values.auc.c_str());
+  uint8_t buf[256];
+  fileSpan imsiFile=USIMcard.readFile("IMSI", buf, sizeof(buf));
+
+  if (imsiFile.records == 0) {
+    printf("can't read the IMSI of the card\n");
+    return -1;
+  }
+
+  string imsi=USIMcard.decodeIMSI(imsiFile.record(0));
+
+  for (int attempt=0; attempt < 2; attempt++) {
+    uint64_t sqn;
+    string rand, xres, autn, ck, ik;
+
+    if (!auc.getVector(imsi, sqn, rand, xres, autn, ck, ik)) {
+      printf("The AuC has no vector for IMSI %s\n", imsi.c_str());
+      return -1;
+    }
+
+    vector<string> returned=USIMcard.authenticate(rand, autn);
+
+    if (returned.size() == 4) {
+      if (returned[0] != xres || returned[1] != ck || returned[2] != ik) {
+        printf("The card sent back vectors, but they are not the AuC ones\n");
+        return -1;
+      }
+
+      printf("Succeeded to authentify with SQN: %" PRIu64 "\n", sqn);
+      // the AuC gives the next SQN itself, for the same IND or not
+      return auc.nextSqn(imsi);
+    }
+
+    uint64_t nextSqn;
+
+    if (returned.size() != 1 || attempt > 0 ||
+        !auc.resync(imsi, rand, returned[0], nextSqn))
+      break;
+
+    printf("Card SQN resynchronized, the AuC goes on with SQN %" PRIu64 "\n", nextSqn);
+  }
+
+  printf("The card didn't accept the AuC challenge: OPc or Ki is wrong\n");
+  return -1;
+}
+
+// One AUTHENTICATE with a fresh RAND and this SQN
+// Returns the card answer (RES, CK, IK, Kc if it accepts the challenge,
+// the AUTS if the SQN is not fresh) and the expected RES, CK, IK
+vector<string> authChallenge(USIM &USIMcard, const struct uicc_vals &values,
+                             const string &key, const string &opc,
+                             const aes_128_ctx_t *kCtx, uint64_t intSqn, u8 rand[16],
+                             string &expected) {
+  u8 amf[2]= {0};
+  u8 autn[16], ik[16], ck[16], res[8];
+  uint64_t sqn=htobe64(intSqn);
+  randomBytes(rand, 16);
+
+  if (values.algo == algoTuak)
+    tuak_generate((const uint8_t *)opc.c_str(), amf, (const uint8_t *)key.c_str(), key.size(),
+                  ((u8 *)&sqn)+2, rand, autn, ik, ck, res);
+  else
+    Assert(milenage_generate(&values.milenage, (const uint8_t *)opc.c_str(), amf, kCtx,
+                             ((u8 *)&sqn)+2, rand, autn, ik, ck, res),
+           "Milenage internal failure\n");
+
+  expected=string((char *)res, sizeof(res)) + string((char *)ck, sizeof(ck)) +
+           string((char *)ik, sizeof(ik));
+  vector<string> returned=USIMcard.authenticate(string((char *)rand, 16),
+                          string((char *)autn, sizeof(autn)));
+
+  if ( USIMcard.debug )
+    for (size_t i=0; i< returned.size(); i++)
+      dump_hex("auth answer",returned[i]);
+
+  return returned;
+}
+
+// Returns the SQN the HSS has to use next, -1 if the authentication failed
+int64_t authenticate(char *port, struct uicc_vals &values) {
   USIM USIMcard;
   string ATR;
   Assert((ATR=USIMcard.open(port))!="", "Failed to open %s", port);
   //dump_hex("ATR", ATR);
   USIMcard.openUSIM();
   USIMcard.debug=false;
-  // We don't make proper values for rand, sqn,
-  // we perform first authentication only to get the AUTS from the USIM
-  u8 amf[2]= {0};
-  u8 sqn[6]= {0};
-  u8 rand[16]= {0};
-  u8 autn[16]= {0};
-  u8 ik[16]= {0};
-  u8 ck[16]= {0};
-  u8 res[8]= {0};
-  Assert(milenage_generate((const uint8_t *)opc.c_str(), amf,
-                           (const uint8_t *)key.c_str(), sqn,
-                           rand,
-                           autn, ik, ck, res),
-         "Milenage internal failure\n");
-  string srand((char *)rand,sizeof(rand));
-  string sautn((char *)autn,sizeof(autn));
-  vector<string> returned=USIMcard.authenticate(srand, sautn);
-
-  // We should have one LV value returned, the AUTS
-  if (returned.size()!=1) {
+
+  if (values.auc != "")
+    return aucAuthenticate(USIMcard, values);
+
+  string key, opc;
+
+  if (values.algo == algoTuak) {
+    int kLen=makeBin(values.key, key);
+    Assert(kLen == 16 || kLen == 32, "can't read a correct key: 32 or 64 hexa figures\n");
+    Assert(makeBin(values.opc, opc) == 32, "can't read a correct TOPc: 64 hexa figures\n");
+  } else {
+    Assert(makeBin(values.key, key) == 16, "can't read a correct key: 16 hexa figures\n");
+    Assert(makeBin(values.opc, opc) == 16, "can't read a correct opc: 16 hexa figures\n");
+  }
+
+  // All the Milenage computations below use the same Ki
+  aes_128_ctx_t kCtx;
+  aes_128_init(&kCtx, (const uint8_t *)key.c_str());
+  SqnCache cache;
+  Assert(cache.load(values.sqnCache), "can't read the SQN cache %s: %s",
+         values.sqnCache.c_str(), strerror(errno));
+  uint8_t iccidBuf[10];
+  fileSpan iccidFile=USIMcard.readFile("ICCID", iccidBuf, sizeof(iccidBuf));
+
+  if (iccidFile.records == 0) {
+    printf("can't read the ICCID of the card, it is the SQN cache key\n");
+    return -1;
+  }
+
+  string iccid=bcdToAscii(iccidFile.record(0));
+  int64_t known=cache.lookup(iccid);
+  // A known card gets the next SEQ of the same IND (TS 33.102 annex C.3.2)
+  // else SQN 0, that the card rejects with its AUTS
+  uint64_t intSqn= known >= 0 ? known+32 : 0;
+  u8 rand[16];
+  string expected;
+  vector<string> returned=authChallenge(USIMcard, values, key, opc, &kCtx, intSqn, rand,
+                                       expected);
+
+  if (returned.size() == 1) {
+    if (known >= 0)
+      printf("The card is ahead of the cached SQN %" PRId64 ", resynchronizing\n", known);
+
+    u8 SIMsqn[8]= {0};
+
+    const u8 *auts=(const u8 *)returned[0].c_str();
+
+    if ( ! (values.algo == algoTuak ?
+            tuak_auts((const uint8_t *)opc.c_str(), (const uint8_t *)key.c_str(), key.size(),
+                      rand, auts, SIMsqn+2) :
+            milenage_auts(&values.milenage, (const uint8_t *)opc.c_str(), &kCtx, rand, auts,
+                          SIMsqn+2)) ) {
+      printf("Can't decode the AUTS returned by the card (wrong Ki or OPc)\n");
+      return -1;
+    }
+
+    intSqn=be64toh(*(uint64_t *)SIMsqn);
+    intSqn+=32; // according to 3GPP TS 33.102 version 11, annex C. 3.2
+    returned=authChallenge(USIMcard, values, key, opc, &kCtx, intSqn, rand, expected);
+
+    if (returned.size() != 4) {
+      printf("We tried SQN %" PRId64 ", but the card refused!\n",intSqn);
+      return -1;
+    }
+  }
+
+  if (returned.size() != 4) {
     printf("The card didn't accept our challenge: OPc or Ki is wrong\n");
-    return;
+    return -1;
   }
 
-  u8 SIMsqn[8]= {0};
+  if (returned[0] + returned[1] + returned[2] != expected) {
+    printf("The card sent back vectors, but they are not our %s computation\n",
+           values.algo == algoTuak ? "TUAK" : "milenage");
+    return -1;
+  }
 
-  if ( ! milenage_auts((const uint8_t *)opc.c_str(),
-                       (const uint8_t *)key.c_str(),
-                       rand,
-                       (const uint8_t *)returned[0].c_str(),
-                       SIMsqn+2) ) {
-    printf("Can't decode the AUTS returned by the card (wrong Ki or OPc)\n");
-    return;
+  if (values.snName != "") {
+    // 5G AKA: the ME computes RES* from the card RES, CK and IK, the card
+    // answer is already checked, so this is only the value the network expects
+    u8 resStar[16];
+    hmac_sha256_key_t ckIk;
+    ck_ik_key(&ckIk, (const u8 *)returned[1].c_str(), (const u8 *)returned[2].c_str());
+    res_star_derive(&ckIk, (const u8 *)values.snName.c_str(), values.snName.size(), rand,
+                    (const u8 *)returned[0].c_str(), returned[0].size(), resStar);
+    printf("RES* for %s: %s\n", values.snName.c_str(),
+           hexString(string((char *)resStar, sizeof(resStar))).c_str());
   }
 
-  uint64_t intSqn=be64toh(*(uint64_t *)SIMsqn);
-  intSqn+=32; // according to 3GPP TS 33.102 version 11, annex C. 3.2
-  uint64_t newSqn=htobe64(intSqn);
-  // To make better validation, let's generate a random value in milenage "rand"
-  FILE *h=fopen("/dev/random","r");
-  fread(rand,sizeof(rand),1,h);
-  fclose(h);
-  Assert( milenage_generate((const uint8_t *)opc.c_str(), amf,
-                            (const uint8_t *)key.c_str(),
-                            ((u8 *)&newSqn)+2,
-                            rand,
-                            autn, ik, ck, res),
-          "Milenage internal failure\n");
-  // Now, we can test a authentication that should be sucessful
-  string new_autn((char *)autn,16);
-  string new_rand((char *)rand,16);
-  vector<string>  returned_newSQN=USIMcard.authenticate(new_rand, new_autn);
+  if (!cache.record(iccid, intSqn))
+    printf("WARNING: can't update the SQN cache %s: %s\n", values.sqnCache.c_str(),
+           strerror(errno));
 
-  if ( USIMcard.debug )
-    for (size_t i=0; i< returned_newSQN.size(); i++)
-      dump_hex("auth answer",returned_newSQN[i]);
-
-  if (returned_newSQN.size() != 4)
-    printf("We tried SQN %" PRId64 ", but the card refused!\n",intSqn);
-  else {
-    string s_ik((char *)ik,sizeof(ik));
-    string s_ck((char *)ck,sizeof(ck));
-    string s_res((char *)res,sizeof(res));
-
-    if ( s_res != returned_newSQN[0] ||
-         s_ck  != returned_newSQN[1] ||
-         s_ik  != returned_newSQN[2] )
-      printf("The card sent back vectors, but they are not our milenage computation\n");
-    else {
-      printf("Succeeded to authentify with SQN: %" PRId64 "\n", intSqn);
-      printf("set HSS SQN value as: %" PRId64 "\n", intSqn+32 );
+  printf("Succeeded to authentify with SQN: %" PRId64 "\n", intSqn);
+  printf("set HSS SQN value as: %" PRId64 "\n", intSqn+32 );
+
+  return intSqn+32;
+}
+
+// GR R: r1..r5 in bits, as 10 hexa figures (4000204060 is TS 35.206)
+bool parseMilenageR(string r, milenage_params_t &params) {
+  string bin;
+
+  if (makeBin(r, bin) != 5)
+    return false;
+
+  memcpy(params.r, bin.c_str(), 5);
+  return true;
+}
+
+// GR C: c1..c5, 5 values of 32 hexa figures separated by commas
+bool parseMilenageC(string c, milenage_params_t &params) {
+  vector<string> values;
+  size_t start=0, comma;
+
+  do {
+    comma=c.find(',', start);
+    values.push_back(c.substr(start, comma - start));
+    start=comma + 1;
+  } while (comma != string::npos);
+
+  if (values.size() != 5)
+    return false;
+
+  for (int i=0; i<5; i++) {
+    string bin;
+
+    if (makeBin(values[i], bin) != 16)
+      return false;
+
+    memcpy(params.c[i], bin.c_str(), 16);
+  }
+
+  return true;
+}
+
+string readICCID(char *port) {
+  USIM USIMcard;
+  string ATR;
+  Assert((ATR=USIMcard.open(port))!="", "Failed to open %s", port);
+  uint8_t iccid[10];
+  fileSpan f=USIMcard.readFile("ICCID", iccid, sizeof(iccid));
+  return f.records > 0 ? bcdToAscii(f.record(0)) : "";
+}
+
+vector<string> splitPorts(string ports) {
+  vector<string> portList;
+  size_t start=0, comma;
+
+  while ((comma=ports.find(',', start)) != string::npos) {
+    portList.push_back(ports.substr(start, comma-start));
+    start=comma+1;
+  }
+
+  portList.push_back(ports.substr(start));
+  return portList;
+}
+
+// ATR and ICCID of the cards in many readers (comma separated ports),
+// all the readers at once on this thread: one line per reader
+bool probeReaders(string ports) {
+  SessionScheduler scheduler;
+  vector<string> portList=splitPorts(ports), iccids;
+  vector<string> atrs(portList.size());
+  iccids.resize(portList.size());
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  for (size_t i=0; i < portList.size(); i++)
+    scheduler.add(portList[i], [&, i](UsimSession &card) -> Task<bool> {
+      atrs[i]=co_await card.reset();
+      uint8_t iccid[10];
+      fileSpan f=co_await card.readFile("ICCID", iccid, sizeof(iccid));
+
+      if (f.records == 0 || f.stride != sizeof(iccid))
+        co_return false;
+
+      iccids[i]=bcdToAscii(f.record(0));
+      co_return true;
+    });
+
+  vector<SessionScheduler::result> results=scheduler.run();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int failed=0;
+
+  for (size_t i=0; i < results.size(); i++)
+    if (!results[i].ok) {
+      printf("%s: %s\n", results[i].port.c_str(),
+             results[i].error != "" ? results[i].error.c_str() : "can't read the ICCID");
+      failed++;
+    } else
+      printf("%s: ATR %s, ICCID %s\n", results[i].port.c_str(),
+             hexString(atrs[i]).c_str(), iccids[i].c_str());
+
+  fprintf(stderr, "%zu readers in %.3f s, %d failed\n", results.size(),
+          end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) / 1e9, failed);
+  return failed == 0;
+}
+
+// What the cards in many readers (comma separated ports) hold, all the
+// readers at once on this thread: one JSON line per card on stdout
+// (see inventory.h), an "error" line for the readers that failed
+bool inventoryReaders(string ports) {
+  SessionScheduler scheduler;
+  vector<string> portList=splitPorts(ports);
+  vector<string> lines(portList.size());
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  for (size_t i=0; i < portList.size(); i++)
+    scheduler.add(portList[i], [&, i](UsimSession &card) -> Task<bool> {
+      CardInventory inventory(card);
+      lines[i]=co_await inventory.run();
+      co_return true;
+    });
+
+  vector<SessionScheduler::result> results=scheduler.run();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int failed=0;
+
+  for (size_t i=0; i < results.size(); i++)
+    if (!results[i].ok) {
+      printf("{\"port\":%s,\"error\":%s}\n", jsonString(results[i].port).c_str(),
+             jsonString(results[i].error).c_str());
+      failed++;
+    } else
+      printf("%s\n", lines[i].c_str());
+
+  fflush(stdout);
+  fprintf(stderr, "%zu readers in %.3f s, %d failed\n", results.size(),
+          end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) / 1e9, failed);
+  return failed == 0;
+}
+
+// Batch file: one card per line "iccid,imsi,key,opc,isdn"
+// an empty field keeps the command line value, # starts a comment line
+// Returns the entries with their line number
+vector<pair<int, uicc_vals>> readBatchFile(string name, const struct uicc_vals &common) {
+  vector<pair<int, uicc_vals>> entries;
+  FILE *f=fopen(name.c_str(), "r");
+  Assert(f != NULL, "can't open batch file %s", name.c_str());
+  char line[1024];
+  int lineNb=0;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineNb++;
+    string l(line);
+
+    while (l.size() > 0 && isspace(l.back()))
+      l.pop_back();
+
+    if (l.size() == 0 || l[0] == '#')
+      continue;
+
+    vector<string> fields;
+    size_t start=0, comma;
+
+    while ((comma=l.find(',', start)) != string::npos) {
+      fields.push_back(l.substr(start, comma-start));
+      start=comma+1;
+    }
+
+    fields.push_back(l.substr(start));
+    fields.resize(5);
+    uicc_vals v=common;
+    string *dest[5]= {&v.iccid, &v.imsi, &v.key, &v.opc, &v.isdn};
+
+    for (int i=0; i<5; i++)
+      if (fields[i].size() > 0)
+        *dest[i]=fields[i];
+
+    if ( v.op != "" && fields[3].size() == 0) {
+      v.opc="";
+      setOPc(v);
+    }
+
+    entries.push_back(make_pair(lineNb, v));
+  }
+
+  fclose(f);
+  return entries;
+}
+
+// Program one card per batch file line, recording the progress in a journal
+// With resume, the cards completed in the journal are skipped and
+// a partially programmed card gets only the files not yet written
+// Each programmed card is added to the HSS exports
+bool programBatch(char *port, struct uicc_vals &common, string batchFile,
+                  string journalFile, bool resume,
+                  vector<unique_ptr<SubscriberExport>> &exports) {
+  vector<pair<int, uicc_vals>> subscribers=readBatchFile(batchFile, common);
+  ProvisioningJournal journal;
+  struct stat st;
+
+  if (!resume && stat(journalFile.c_str(), &st) == 0 && st.st_size > 0) {
+    printf("Journal %s already exists, use --resume to continue this batch\n",
+           journalFile.c_str());
+    return false;
+  }
+
+  Assert(journal.open(journalFile), "can't open journal %s", journalFile.c_str());
+  int programmed=0, failed=0;
+
+  for (auto &s : subscribers) {
+    int index=s.first;
+    struct uicc_vals &values=s.second;
+    auto known=journal.cards.find(index);
+
+    if (known != journal.cards.end() && known->second.done)
+      continue;
+
+    string iccid;
+
+    while (true) {
+      if (known != journal.cards.end())
+        printf("Insert again card %s (IMSI %s, line %d) and press Enter\n",
+               known->second.iccid.c_str(), values.imsi.c_str(), index);
+      else
+        printf("Insert a card for IMSI %s (line %d) and press Enter\n",
+               values.imsi.c_str(), index);
+
+      fflush(stdout);
+      int c;
+
+      while ((c=getchar()) != '\n' && c != EOF);
+
+      if (c == EOF) {
+        printf("End of input, batch stopped: %d cards programmed, %d failed\n",
+               programmed, failed);
+        return failed == 0;
+      }
+
+      try {
+        iccid=readICCID(port);
+      } catch (UICCError &e) {
+        printf("Can't read this card: %s\n", e.what());
+        continue;
+      }
+
+      // The card of the journal: it has the ICCID it came with, or the
+      // one of the batch line once we wrote it
+      if (known == journal.cards.end() || iccid == known->second.iccid ||
+          (values.iccid.size() > 0 && iccid == values.iccid))
+        break;
+
+      printf("This card is %s, not %s\n", iccid.c_str(), known->second.iccid.c_str());
+    }
+
+    if (known == journal.cards.end())
+      journal.assign(index, values.imsi, iccid);
+
+    bool done=false;
+
+    // A card error stops only this card, the next ones are programmed
+    try {
+      done=writeSIMvalues(port, values, &journal, index) &&
+           writeUSIMvalues(port, values, &journal, index);
+    } catch (UICCError &e) {
+      printf("Card error: %s\n", e.what());
+    }
+
+    int64_t sqn=-1;
+
+    if (done && values.authenticate) {
+      try {
+        sqn=authenticate(port, values);
+      } catch (UICCError &e) {
+        printf("Card error during authentication: %s\n", e.what());
+      }
+
+      // Written as asked, but the network won't attach it
+      if (sqn < 0) {
+        printf("Card %s (line %d) failed the authentication\n", iccid.c_str(), index);
+        failed++;
+        continue;
+      }
+    }
+
+    if (done) {
+      journal.cardDone(index, values.iccid.size() > 0 ? values.iccid : iccid);
+      programmed++;
+
+      for (auto &e : exports)
+        e->add(values.imsi, values.isdn, values.key, values.opc, sqn);
+    } else {
+      printf("Card %s (line %d) is not completely programmed\n", iccid.c_str(), index);
+      failed++;
     }
   }
+
+  printf("Batch done: %d cards programmed, %d failed\n", programmed, failed);
+  return failed == 0;
+}
+
+// Allocate count consecutive ICCIDs (--iccid is the first one, without
+// its Luhn digit), IMSIs and MSISDNs, record them in the ledger and write
+// the batch file to program them (key and OPc are left to the command line)
+bool allocateBatch(struct uicc_vals &values, uint64_t count,
+                   string ledgerFile, string batchFile) {
+  IdentifierLedger ledger;
+  Assert(ledger.load(ledgerFile), "can't read ledger %s", ledgerFile.c_str());
+  struct {
+    string kind;
+    string start;
+    uint64_t first;
+  } ids[3]= {{"iccid", values.iccid, 0}, {"imsi", values.imsi, 0}, {"isdn", values.isdn, 0}};
+  bool ok=true;
+
+  for (auto &id : ids) {
+    if (id.start == "")
+      continue;
+
+    if (!parseRangeStart(id.start, count, id.first)) {
+      printf("Can't allocate %" PRIu64 " %s from %s\n", count, id.kind.c_str(), id.start.c_str());
+      ok=false;
+      continue;
+    }
+
+    vector<uint64_t> used=ledger.collisions(id.kind, id.start.size(), id.first, count);
+
+    for (auto u : used) {
+      printf("%s %s is already issued\n", id.kind.c_str(), formatId(u, id.start.size()).c_str());
+      ok=false;
+    }
+  }
+
+  if (ids[0].start == "" && ids[1].start == "") {
+    printf("Give the first --iccid and/or --imsi to allocate\n");
+    ok=false;
+  }
+
+  if (!ok)
+    return false;
+
+  FILE *f=fopen(batchFile.c_str(), "wx");
+
+  if (f == NULL) {
+    printf("Can't create %s (it must not exist)\n", batchFile.c_str());
+    return false;
+  }
+
+  for (auto &id : ids)
+    if (id.start != "")
+      Assert(ledger.issue(id.kind, id.start.size(), id.first, count),
+             "can't write ledger %s", ledgerFile.c_str());
+
+  fprintf(f, "# iccid,imsi,key,opc,isdn\n");
+
+  for (uint64_t i=0; i < count; i++) {
+    string iccid;
+
+    if (ids[0].start != "") {
+      iccid=formatId(ids[0].first+i, ids[0].start.size());
+      iccid+=luhnDigit(iccid);
+    }
+
+    fprintf(f, "%s,%s,,,%s\n", iccid.c_str(),
+            ids[1].start != "" ? formatId(ids[1].first+i, ids[1].start.size()).c_str() : "",
+            ids[2].start != "" ? formatId(ids[2].first+i, ids[2].start.size()).c_str() : "");
+  }
+
+  Assert(fclose(f) == 0, "can't write %s", batchFile.c_str());
+  printf("Allocated %" PRIu64 " cards in %s\n", count, batchFile.c_str());
+  return true;
+}
+
+// Check a batch file from elsewhere (card vendor, other tool) before using
+// it: ICCID Luhn digits, identifiers repeated in the file or already issued
+bool checkBatch(string batchFile, string ledgerFile) {
+  struct uicc_vals none;
+  vector<pair<int, uicc_vals>> entries=readBatchFile(batchFile, none);
+  IdentifierLedger ledger;
+  Assert(ledger.load(ledgerFile), "can't read ledger %s", ledgerFile.c_str());
+  int errors=0;
+  vector<string> iccids;
+  vector<int> lines;
+
+  for (auto &e : entries)
+    if (e.second.iccid != "") {
+      iccids.push_back(e.second.iccid);
+      lines.push_back(e.first);
+    }
+
+  for (auto i : luhnCheckBatch(iccids)) {
+    printf("line %d: ICCID %s has a wrong Luhn digit\n", lines[i], iccids[i].c_str());
+    errors++;
+  }
+
+  const char *kinds[3]= {"iccid", "imsi", "isdn"};
+
+  for (int k=0; k < 3; k++) {
+    // The ledger keeps ICCIDs without their Luhn digit
+    map<size_t, vector<pair<uint64_t, int>>> byWidth;
+    map<string, int> seen;
+
+    for (auto &e : entries) {
+      string id= k == 0 ? e.second.iccid : k == 1 ? e.second.imsi : e.second.isdn;
+
+      if (id == "")
+        continue;
+
+      auto prev=seen.insert(make_pair(id, e.first));
+
+      if (!prev.second) {
+        printf("line %d: %s %s already at line %d\n", e.first, kinds[k], id.c_str(), prev.first->second);
+        errors++;
+      }
+
+      if (k == 0)
+        id.pop_back();
+
+      if (id.size() <= 19 && id.find_first_not_of("0123456789") == string::npos)
+        byWidth[id.size()].push_back(make_pair(strtoull(id.c_str(), NULL, 10), e.first));
+    }
+
+    for (auto &w : byWidth) {
+      vector<uint64_t> values;
+
+      for (auto &v : w.second)
+        values.push_back(v.first);
+
+      vector<bool> used=ledger.issued(kinds[k], w.first, values);
+
+      for (size_t i=0; i < used.size(); i++)
+        if (used[i]) {
+          printf("line %d: %s %s is already issued\n", w.second[i].second, kinds[k],
+                 formatId(values[i], w.first).c_str());
+          errors++;
+        }
+    }
+  }
+
+  printf("%s: %zu cards, %d errors\n", batchFile.c_str(), entries.size(), errors);
+  return errors == 0;
+}
+
+// Authentication vectors of all subscribers of a file, to a .bin (binary
+// records) or CSV file
+bool generateVectors(string subscriberFile, VectorGenerator &gen, string outFile) {
+  vector<vectorSubscriber> subs=readVectorSubscribers(subscriberFile);
+  FILE *out=stdout;
+
+  if (outFile != "") {
+    gen.binary= outFile.size() > 4 && outFile.substr(outFile.size()-4) == ".bin";
+    out=fopen(outFile.c_str(), gen.binary ? "wb" : "w");
+    Assert(out != NULL, "can't create %s", outFile.c_str());
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t nb=gen.run(subs, out);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds=end.tv_sec-start.tv_sec + (end.tv_nsec-start.tv_nsec)/1e9;
+
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "can't write %s\n", outFile.c_str());
+    return false;
+  }
+
+  fprintf(stderr, "%" PRIu64 " vectors for %zu subscribers in %.3f s (%.0f vectors/s, %d threads)\n",
+          nb, subs.size(), seconds, nb / seconds, gen.threads);
+  return true;
+}
+
+// SQN of each subscriber from the AUTS of a file, K and OPc from the AuC store
+bool resyncAuts(string autsFile, string storeFile, int threads) {
+  vector<autsRecord> records=readAutsRecords(autsFile);
+  SubscriberStore store;
+  Assert(store.open(storeFile), "can't open the subscriber store %s", storeFile.c_str());
+  AutsResync resync;
+  resync.threads=threads;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t failed=resync.run(records, store, stdout);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds=end.tv_sec-start.tv_sec + (end.tv_nsec-start.tv_nsec)/1e9;
+  fprintf(stderr, "%zu AUTS in %.3f s (%.0f AUTS/s, %d threads), %zu failed\n",
+          records.size(), seconds, records.size() / seconds, threads, failed);
+  return failed == 0;
+}
+
+// Ki and OPc of the batch file records that don't have them, to a new
+// batch file (stdout if "") and the --export files
+bool deriveKeys(string batchFile, string outFile, string masterKey, string op,
+                vector<unique_ptr<SubscriberExport>> &exports) {
+  KeyDeriver deriver;
+  string bin;
+
+  if (masterKey != "") {
+    Assert(makeBin(masterKey, bin) == 16, "can't read a correct master key: 32 hexa figures\n");
+    deriver.setMasterKey((const u8 *)bin.c_str());
+  }
+
+  if (op != "") {
+    Assert(makeBin(op, bin) == 16, "can't read a correct op: 32 hexa figures\n");
+    deriver.setOp((const u8 *)bin.c_str());
+  }
+
+  FILE *out=stdout;
+
+  if (outFile != "") {
+    // Secret keys: a new file that only its owner reads
+    int fd=open(outFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0 || (out=fdopen(fd, "w")) == NULL) {
+      printf("Can't create %s (it must not exist)\n", outFile.c_str());
+      return false;
+    }
+  }
+
+  size_t nb=deriver.run(batchFile, out, exports);
+
+  if (out != stdout && fclose(out) != 0) {
+    fprintf(stderr, "can't write %s\n", outFile.c_str());
+    return false;
+  }
+
+  fprintf(stderr, "Keys of %zu subscribers derived\n", nb);
+  return true;
 }
 
 int main(int argc, char **argv) {
   char portName[FILENAME_MAX+1] = "/dev/ttyUSB0";
   struct uicc_vals new_vals;
+  string batchFile, journalFile;
+  string allocateFile, checkFile, ledgerFile="issued.ledger";
+  uint64_t count=0;
+  string vectorsFile, vectorsOutput;
+  string aucStore, aucImport, aucServe, autsFile;
+  string deriveFile, deriveOutput, masterKey;
+  string probePorts;
+  string inventoryPorts;
+  AucServer aucServer;
+  VectorGenerator vectorGen;
+  vector<unique_ptr<SubscriberExport>> exports;
+  bool resume=false;
   static struct option long_options[] = {
     {"port",  required_argument, 0, 0},
     {"adm",   required_argument, 0, 1},
@@ -422,6 +1090,37 @@ int main(int argc, char **argv) {
     {"authenticate",  no_argument, 0, 10},
     {"spn", required_argument, 0, 11},
     {"rusimv", required_argument, 0, 12},
+    {"verify", no_argument, 0, 13},
+    {"batch", required_argument, 0, 14},
+    {"journal", required_argument, 0, 15},
+    {"resume", no_argument, 0, 16},
+    {"retries", required_argument, 0, 17},
+    {"export", required_argument, 0, 18},
+    {"allocate", required_argument, 0, 19},
+    {"count", required_argument, 0, 20},
+    {"ledger", required_argument, 0, 21},
+    {"check-batch", required_argument, 0, 22},
+    {"vectors", required_argument, 0, 23},
+    {"vector-count", required_argument, 0, 24},
+    {"vector-output", required_argument, 0, 25},
+    {"kasme", required_argument, 0, 26},
+    {"threads", required_argument, 0, 27},
+    {"auc-store", required_argument, 0, 28},
+    {"auc-import", required_argument, 0, 29},
+    {"auc-serve", required_argument, 0, 30},
+    {"auc", required_argument, 0, 31},
+    {"sqn-cache", required_argument, 0, 32},
+    {"milenage-r", required_argument, 0, 33},
+    {"milenage-c", required_argument, 0, 34},
+    {"algo", required_argument, 0, 35},
+    {"5g", required_argument, 0, 36},
+    {"resync", required_argument, 0, 37},
+    {"derive", required_argument, 0, 38},
+    {"master-key", required_argument, 0, 39},
+    {"derive-output", required_argument, 0, 40},
+    {"triplets", no_argument, 0, 41},
+    {"probe", required_argument, 0, 42},
+    {"inventory", required_argument, 0, 43},
     {0,       0,                 0, 0}
   };
   static map<string,string> help_text= {
@@ -438,6 +1137,37 @@ int main(int argc, char **argv) {
     {"spn",   "service provider name: the name that the UE will show as 'network'"},
     {"rusimv",  "Read USIM values: 1 -> yes, 0 -> no"},
     {"authenticate",  "Test the milenage authentication and discover the current sequence number"},
+    {"verify",  "Read back all written files and print a JSON pass/fail line per file"},
+    {"batch",  "Program one card per line of this file: iccid,imsi,key,opc,isdn (empty fields use the command line values)"},
+    {"journal",  "Batch progress journal (default: <batch file>.journal)"},
+    {"resume",  "Continue a batch from its journal: skip completed cards, finish the partially written one"},
+    {"retries",  "Attempts to write a card, with a card reset after reader errors (default 3)"},
+    {"export",  "Add the programmed cards to this HSS file: .sql (OAI), .json (Open5GS) or CSV (can be repeated), created with owner only permissions"},
+    {"allocate",  "Create this batch file with --count consecutive identifiers from --iccid (without Luhn digit), --imsi, --isdn"},
+    {"count",  "Number of cards to allocate"},
+    {"ledger",  "File of the issued identifier ranges (default issued.ledger)"},
+    {"check-batch",  "Check a batch file: ICCID Luhn digits, duplicates, identifiers already in the ledger"},
+    {"vectors",  "Generate authentication vectors for the subscribers of this file: imsi,key,opc,sqn"},
+    {"vector-count",  "Vectors per subscriber (default 1)"},
+    {"vector-output",  "Vectors file: .bin for binary records, else CSV (default: CSV on stdout)"},
+    {"kasme",  "Add KASME to the vectors, for this serving network MCC MNC (5 or 6 digits)"},
+    {"threads",  "Vector generation or AuC threads (default: one per CPU)"},
+    {"auc-store",  "Subscriber store file of the AuC stand-in"},
+    {"auc-import",  "Create the --auc-store from this subscriber file: imsi,key,opc,sqn"},
+    {"auc-serve",  "Run the AuC stand-in on this Unix socket, with the subscribers of --auc-store"},
+    {"auc",  "With --authenticate: get the vectors from the AuC stand-in on this Unix socket"},
+    {"sqn-cache",  "Last SQN accepted by each card, for a single challenge --authenticate (default sqn.cache)"},
+    {"milenage-r",  "Milenage r1..r5 in bits, 10 hexa figures (default 4000204060), written in the card and used by --authenticate"},
+    {"milenage-c",  "Milenage c1..c5, 5 values of 32 hexa figures separated by commas (default TS 35.206 values)"},
+    {"5g",  "5G AKA for this serving network MCC MNC (5 or 6 digits): add XRES*, HXRES*, KAUSF, KSEAF and KAMF to the vectors, --authenticate prints the RES* of the card"},
+    {"resync",  "Recover the SQN of the subscribers from a file of synchronization failures (one \"imsi,rand,auts\" per line), K and OPc from the --auc-store: CSV imsi,sqn_ms,sqn on stdout"},
+    {"derive",  "Fill the empty key and OPc fields of this batch file: Ki from --master-key and the IMSI, OPc from the OP of --xx, to --derive-output and the --export files"},
+    {"master-key",  "Master key of --derive, 32 hexa figures: Ki = AES-128(master key, 0^64 || IMSI)"},
+    {"derive-output",  "Batch file written by --derive, created with owner only permissions (default: stdout)"},
+    {"triplets",  "Add the GSM triplet of the same RAND (SRES, Kc) to the vectors"},
+    {"probe",  "Read the ATR and the ICCID of the cards in these readers (ports separated by commas), all the readers at once"},
+    {"inventory",  "What the cards in these readers (ports separated by commas) hold: IMSI, MSISDN, SPN, PLMN lists, service tables..., one JSON line per card, all the readers at once"},
+    {"algo",  "Authentication algorithm of --authenticate: milenage (default) or tuak (--key of 128 or 256 bits, --opc is TOPc or --xx is TOP)"},
   };
   int c;
   bool correctOpt=true;
@@ -504,56 +1234,301 @@ int main(int argc, char **argv) {
         new_vals.rusimv=optarg;
         break;
 
+      case 13:
+        new_vals.verify=true;
+        break;
+
+      case 14:
+        batchFile=optarg;
+        break;
+
+      case 15:
+        journalFile=optarg;
+        break;
+
+      case 16:
+        resume=true;
+        break;
+
+      case 17:
+        new_vals.retries=atoi(optarg);
+        break;
+
+      case 18:
+        exports.push_back(unique_ptr<SubscriberExport>(new SubscriberExport));
+
+        if (!exports.back()->open(optarg)) {
+          printf("can't open export file %s\n", optarg);
+          correctOpt=false;
+        }
+
+        break;
+
+      case 19:
+        allocateFile=optarg;
+        break;
+
+      case 20:
+        count=strtoull(optarg, NULL, 10);
+        break;
+
+      case 21:
+        ledgerFile=optarg;
+        break;
+
+      case 22:
+        checkFile=optarg;
+        break;
+
+      case 23:
+        vectorsFile=optarg;
+        break;
+
+      case 24:
+        vectorGen.vectorsPerSubscriber=atoi(optarg);
+
+        if (vectorGen.vectorsPerSubscriber < 1) {
+          printf("--vector-count needs at least one vector per subscriber\n");
+          correctOpt=false;
+        }
+
+        break;
+
+      case 25:
+        vectorsOutput=optarg;
+        break;
+
+      case 26:
+        if (!vectorGen.setServingNetwork(optarg)) {
+          printf("--kasme needs the MCC and MNC digits, like 20893\n");
+          correctOpt=false;
+        }
+
+        break;
+
+      case 27:
+        vectorGen.threads=aucServer.workers=atoi(optarg);
+        break;
+
+      case 28:
+        aucStore=optarg;
+        break;
+
+      case 29:
+        aucImport=optarg;
+        break;
+
+      case 30:
+        aucServe=optarg;
+        break;
+
+      case 31:
+        new_vals.auc=optarg;
+        break;
+
+      case 32:
+        new_vals.sqnCache=optarg;
+        break;
+
+      case 33:
+        if (!parseMilenageR(optarg, new_vals.milenage)) {
+          printf("--milenage-r needs r1..r5 as 10 hexa figures\n");
+          correctOpt=false;
+        }
+
+        break;
+
+      case 34:
+        if (!parseMilenageC(optarg, new_vals.milenage)) {
+          printf("--milenage-c needs c1..c5: 5 values of 32 hexa figures, separated by commas\n");
+          correctOpt=false;
+        }
+
+        break;
+
+      case 35:
+        if (strcmp(optarg, "milenage") == 0)
+          new_vals.algo=algoMilenage;
+        else if (strcmp(optarg, "tuak") == 0)
+          new_vals.algo=algoTuak;
+        else {
+          printf("--algo is milenage or tuak\n");
+          correctOpt=false;
+        }
+
+        break;
+
+      case 36:
+        if (!vectorGen.setFiveG(optarg)) {
+          printf("--5g needs the MCC and MNC digits, like 20893\n");
+          correctOpt=false;
+        }
+
+        new_vals.snName=vectorGen.snName;
+        break;
+
+      case 37:
+        autsFile=optarg;
+        break;
+
+      case 38:
+        deriveFile=optarg;
+        break;
+
+      case 39:
+        masterKey=optarg;
+        break;
+
+      case 40:
+        deriveOutput=optarg;
+        break;
+
+      case 41:
+        vectorGen.triplets=true;
+        break;
+
+      case 42:
+        probePorts=optarg;
+        break;
+
+      case 43:
+        inventoryPorts=optarg;
+        break;
+
       default:
         printf("unrecognized option: %d \n", c);
         correctOpt=false;
     };
   }
-  if (new_vals.rusimv=="1")
-  {
-      printf ("Read values in UICC\n");
-      readUSIMvalues(portName);
-  }
+  try {
+    if (new_vals.rusimv=="1")
+    {
+        printf ("Read values in UICC\n");
+        readUSIMvalues(portName);
+    }
 	
-  if (optind < argc ||  correctOpt==false) {
-    printf("non-option ARGV-elements: ");
+    if (optind < argc ||  correctOpt==false) {
+      printf("non-option ARGV-elements: ");
 
-    while (optind < argc)
-      printf("%s ", argv[optind++]);
+      while (optind < argc)
+        printf("%s ", argv[optind++]);
 
-    printf("Possible options are:\n");
+      printf("Possible options are:\n");
 
-    for (int i=0; long_options[i].name!=NULL; i++)
-      printf("  --%-10s %s\n",long_options[i].name, help_text[long_options[i].name].c_str());
+      for (int i=0; long_options[i].name!=NULL; i++)
+        printf("  --%-10s %s\n",long_options[i].name, help_text[long_options[i].name].c_str());
 
-    printf("\n");
-    exit(1);
-  }
+      printf("\n");
+      exit(1);
+    }
 
-  printf ("Existing values in USIM\n");
-  //Assert(readUSIMvalues(portName), "failed to read UICC");
+    if (allocateFile != "")
+      return allocateBatch(new_vals, count, ledgerFile, allocateFile) ? 0 : 1;
 
-  if ( new_vals.op != "") {
-    setOPc(new_vals);
-    printf("Computed OPc from OP and Ki as: %s\n", new_vals.opc.c_str());
-  }
+    if (checkFile != "")
+      return checkBatch(checkFile, ledgerFile) ? 0 : 1;
+
+    if (vectorsFile != "")
+      return generateVectors(vectorsFile, vectorGen, vectorsOutput) ? 0 : 1;
+
+    if (probePorts != "")
+      return probeReaders(probePorts) ? 0 : 1;
+
+    if (inventoryPorts != "")
+      return inventoryReaders(inventoryPorts) ? 0 : 1;
 
-  if (new_vals.setIt) {
-    if ( new_vals.adm.size() ==16 )
-      new_vals.adm=makeBcd(new_vals.adm);
-    if ( new_vals.adm.size() != 8 )
-      printf ("No ADM code of 8 figures, can't program the UICC\n");
-    else {
-      printf("Setting new values\n");
-      writeSIMvalues(portName, new_vals);
-      writeUSIMvalues(portName, new_vals);
-      printf ("Read new values in UICC\n");
-      readUSIMvalues(portName);
+    if (deriveFile != "")
+      return deriveKeys(deriveFile, deriveOutput, masterKey, new_vals.op, exports) ? 0 : 1;
+
+    if (autsFile != "") {
+      Assert(aucStore != "", "--resync needs the --auc-store file");
+      return resyncAuts(autsFile, aucStore, vectorGen.threads) ? 0 : 1;
     }
-  }
 
-  if ( new_vals.authenticate)
-    authenticate(portName, new_vals);
+    if (aucImport != "" || aucServe != "") {
+      Assert(aucStore != "", "the AuC needs a --auc-store file");
+
+      if (aucImport != "") {
+        vector<vectorSubscriber> subs=readVectorSubscribers(aucImport);
+
+        for (auto &sub : subs)
+          Assert(sub.algo == algoMilenage, "IMSI %s: the AuC serves only Milenage subscribers",
+                 sub.imsi.c_str());
+
+        Assert(SubscriberStore::create(aucStore, subs), "can't create %s", aucStore.c_str());
+        printf("%zu subscribers in %s\n", subs.size(), aucStore.c_str());
+      }
+
+      if (aucServe != "") {
+        SubscriberStore store;
+        Assert(store.open(aucStore), "can't open the subscriber store %s", aucStore.c_str());
+        Assert(aucServer.serve(aucServe, store), "can't listen on %s", aucServe.c_str());
+      }
+
+      return 0;
+    }
+
+    printf ("Existing values in USIM\n");
+    //Assert(readUSIMvalues(portName), "failed to read UICC");
+
+    if (batchFile != "") {
+      if ( new_vals.adm.size() ==16 )
+        new_vals.adm=makeBcd(new_vals.adm);
+
+      if ( new_vals.adm.size() != 8 ) {
+        printf ("No ADM code of 8 figures, can't program the UICC\n");
+        return 1;
+      }
 
-  return 0;
+      if (journalFile == "")
+        journalFile=batchFile + ".journal";
+
+      return programBatch(portName, new_vals, batchFile, journalFile, resume, exports) ? 0 : 1;
+    }
+
+    if ( new_vals.op != "") {
+      setOPc(new_vals);
+      printf("Computed OPc from OP and Ki as: %s\n", new_vals.opc.c_str());
+    }
+
+    bool programmed=false;
+
+    if (new_vals.setIt) {
+      if ( new_vals.adm.size() ==16 )
+        new_vals.adm=makeBcd(new_vals.adm);
+      if ( new_vals.adm.size() != 8 )
+        printf ("No ADM code of 8 figures, can't program the UICC\n");
+      else {
+        // The GR files only hold Milenage values
+        Assert(new_vals.algo == algoMilenage, "--algo tuak is only for --authenticate\n");
+        printf("Setting new values\n");
+        bool verified=writeSIMvalues(portName, new_vals);
+        verified=writeUSIMvalues(portName, new_vals) && verified;
+
+        if (new_vals.verify && !verified)
+          printf("WARNING: some files don't hold the written values\n");
+
+        printf ("Read new values in UICC\n");
+        readUSIMvalues(portName);
+        // refused by the card or not read back as written
+        programmed=verified;
+      }
+    }
+
+    int64_t sqn=-1;
+
+    if ( new_vals.authenticate)
+      sqn=authenticate(portName, new_vals);
+
+    if (programmed)
+      for (auto &e : exports)
+        e->add(new_vals.imsi, new_vals.isdn, new_vals.key, new_vals.opc, sqn);
+    else if (new_vals.setIt && exports.size() > 0)
+      fprintf(stderr, "The card is not programmed: not added to the exports\n");
+
+    return 0;
+  } catch (UICCError &e) {
+    fprintf(stderr, "Card error: %s\n", e.what());
+    return 1;
+  }
 }
@@ -0,0 +1,165 @@
+/*
+  Network side SQN recovery: the AUTS of the synchronization failures
+  (collected from the core network logs) decoded for many subscribers,
+  to give the HSS the SQN of each card
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef RESYNC_H
+#define RESYNC_H
+#include <atomic>
+#include <thread>
+#include <uicc.h>
+#include <milenage.h>
+#include <auc.h>
+
+struct autsRecord {
+  uint64_t imsi;
+  u8 rand[16];
+  u8 auts[14];
+  int line;
+};
+
+// AUTS file: one synchronization failure per line "imsi,rand,auts"
+// rand and auts in hexadecimal, # starts a comment line
+static inline vector<autsRecord> readAutsRecords(string name) {
+  vector<autsRecord> records;
+  FILE *f=fopen(name.c_str(), "r");
+  Assert(f != NULL, "can't open AUTS file %s", name.c_str());
+  char line[256];
+  int lineNb=0;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineNb++;
+
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+
+    char imsi[32], rand[80], auts[80];
+    string r, a;
+    bool ok= sscanf(line, " %31[0-9],%79[0-9a-fA-F],%79[0-9a-fA-F]", imsi, rand, auts) == 3 &&
+             makeBin(rand, r) == 16 && makeBin(auts, a) == 14;
+    Assert(ok, "%s line %d: expecting imsi,rand,auts", name.c_str(), lineNb);
+    autsRecord rec;
+    rec.imsi=strtoull(imsi, NULL, 10);
+    memcpy(rec.rand, r.c_str(), 16);
+    memcpy(rec.auts, a.c_str(), 14);
+    rec.line=lineNb;
+    records.push_back(rec);
+  }
+
+  fclose(f);
+  return records;
+}
+
+/*
+  The records are sorted by IMSI, so each worker takes runs of the same
+  subscriber: the K key schedule is computed once per run and shared by
+  its AUTS. A subscriber can have several AUTS (several failures, or
+  several MMEs): the HSS gets the highest SQN_MS with a valid MAC-S.
+  CSV: imsi,sqn_ms,sqn
+  sqn is the SQN for the HSS: SQN_MS + 32, next SEQ of the same IND
+  (TS 33.102 annex C.3.2), as --authenticate gives it
+*/
+class AutsResync {
+ public:
+  int threads=thread::hardware_concurrency();
+
+  // Returns the number of AUTS that don't decode, each reported on stderr
+  size_t run(vector<autsRecord> &records, SubscriberStore &store, FILE *out) {
+    sort(records.begin(), records.end(), [](const autsRecord &a, const autsRecord &b) {
+      return a.imsi < b.imsi;
+    });
+    vector<int64_t> sqns(records.size());
+    atomic<size_t> next(0);
+    vector<thread> pool;
+
+    for (int t=0; t < max(threads, 1); t++)
+      pool.push_back(thread(&AutsResync::worker, this, cref(records), ref(store),
+                            ref(next), ref(sqns)));
+
+    for (auto &t : pool)
+      t.join();
+
+    fprintf(out, "imsi,sqn_ms,sqn\n");
+    size_t failed=0;
+
+    for (size_t i=0; i < records.size();) {
+      int64_t best=-1;
+      size_t j=i;
+
+      for (; j < records.size() && records[j].imsi == records[i].imsi; j++) {
+        if (sqns[j] == unknownImsi || sqns[j] == badMac) {
+          fprintf(stderr, "line %d: IMSI %015" PRIu64 ": %s\n", records[j].line, records[j].imsi,
+                  sqns[j] == unknownImsi ? "not in the subscriber store" : "AUTS check failed");
+          failed++;
+        } else
+          best=max(best, sqns[j]);
+      }
+
+      if (best >= 0)
+        fprintf(out, "%015" PRIu64 ",%" PRId64 ",%" PRId64 "\n", records[i].imsi, best,
+                (int64_t)((best + 32) & 0xFFFFFFFFFFFF));
+
+      i=j;
+    }
+
+    fflush(out);
+    return failed;
+  }
+
+ private:
+  static const size_t groupRecords=256;
+  static const int64_t unknownImsi=-1;
+  static const int64_t badMac=-2;
+
+  void worker(const vector<autsRecord> &records, SubscriberStore &store,
+              atomic<size_t> &next, vector<int64_t> &sqns) {
+    // key schedule cache: the subscriber of the previous record
+    const aucRecord *cached=NULL;
+    aes_128_ctx_t kCtx;
+
+    while (true) {
+      size_t first=next.fetch_add(groupRecords);
+
+      if (first >= records.size())
+        break;
+
+      size_t last=min(first + groupRecords, records.size());
+
+      for (size_t i=first; i < last; i++) {
+        const autsRecord &rec=records[i];
+
+        if (cached == NULL || cached->imsi != rec.imsi) {
+          cached=store.find(rec.imsi);
+
+          if (cached == NULL) {
+            sqns[i]=unknownImsi;
+            continue;
+          }
+
+          aes_128_init(&kCtx, cached->k);
+        }
+
+        u8 sqnMs[6];
+
+        if (!milenage_auts(cached->opc, &kCtx, rec.rand, rec.auts, sqnMs)) {
+          sqns[i]=badMac;
+          continue;
+        }
+
+        int64_t sqn=0;
+
+        for (int b=0; b < 6; b++)
+          sqn=sqn << 8 | sqnMs[b];
+
+        sqns[i]=sqn;
+      }
+    }
+  }
+};
+#endif
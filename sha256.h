@@ -0,0 +1,465 @@
+/*
+  SHA-256 (FIPS 180-4), HMAC-SHA-256 (RFC 2104), the 3GPP key
+  derivation function (TS 33.220 annex B.2) and the EPS and 5G AKA
+  key derivations (TS 33.401 annex A, TS 33.501 annex A)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t h[8];
+  uint8_t buf[64];
+  uint64_t len;
+} sha256_ctx_t;
+
+static const uint32_t Sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t Sha256Rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline void Sha256BlocksPortable(uint32_t h[8], const uint8_t *data, size_t blocks) {
+  for (; blocks > 0; blocks--, data += 64) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+      w[i] = ((uint32_t)data[4 * i] << 24) | ((uint32_t)data[4 * i + 1] << 16) |
+             ((uint32_t)data[4 * i + 2] << 8) | data[4 * i + 3];
+
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = Sha256Rotr(w[i - 15], 7) ^ Sha256Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = Sha256Rotr(w[i - 2], 17) ^ Sha256Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = hh + (Sha256Rotr(e, 6) ^ Sha256Rotr(e, 11) ^ Sha256Rotr(e, 25)) +
+                    ((e & f) ^ (~e & g)) + Sha256K[i] + w[i];
+      uint32_t t2 = (Sha256Rotr(a, 2) ^ Sha256Rotr(a, 13) ^ Sha256Rotr(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+}
+
+/*
+  SHA extensions version (sha256rnds2 does 2 rounds, sha256msg1/2 the
+  message schedule), for the x86 CPUs that have them (checked at run time)
+*/
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA_NI_BUILD
+
+__attribute__((target("sha,sse4.1")))
+static inline void Sha256BlocksShaNi(uint32_t h[8], const uint8_t *data, size_t blocks) {
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  // sha256rnds2 wants the state as ABEF and CDGH
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xB1);
+  __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)), 0x1B);
+  __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+  for (; blocks > 0; blocks--, data += 64) {
+    __m128i abefSave = abef, cdghSave = cdgh;
+    __m128i w[4];
+
+    #pragma GCC unroll 16
+    for (int i = 0; i < 16; i++) {
+      // w[i % 4] holds the message words 4i..4i+3
+      if (i < 4)
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data + i), bswap);
+      else
+        w[i % 4] = _mm_sha256msg2_epu32(
+                     _mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]),
+                                   _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4)),
+                     w[(i + 3) % 4]);
+
+      __m128i wk = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *)(Sha256K + 4 * i)));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+    }
+
+    abef = _mm_add_epi32(abef, abefSave);
+    cdgh = _mm_add_epi32(cdgh, cdghSave);
+  }
+
+  tmp = _mm_shuffle_epi32(abef, 0x1B);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+  _mm_storeu_si128((__m128i *)h, _mm_blend_epi16(tmp, cdgh, 0xF0));
+  _mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+static inline bool sha256_self_test(void);
+
+/*
+  Use the SHA extensions when the CPU has them and they give the known
+  answers, UICC_SHA=portable in the environment forces the portable code
+*/
+static inline bool sha256_use_hw(void) {
+  static const bool hw = [] {
+#ifdef SHA_NI_BUILD
+    const char *forced = getenv("UICC_SHA");
+
+    if (forced != NULL && strcmp(forced, "portable") == 0)
+      return false;
+
+    // CPUID leaf 7: EBX bit 29 is SHA, leaf 1: ECX bit 19 is SSE4.1
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d) || !(b & (1u << 29)) ||
+        !__get_cpuid(1, &a, &b, &c, &d) || !(c & (1u << 19)))
+      return false;
+
+    if (!sha256_self_test()) {
+      fprintf(stderr, "The SHA extensions give wrong results, using the portable SHA-256\n");
+      return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+  }();
+  return hw;
+}
+
+static inline void Sha256Blocks(uint32_t h[8], const uint8_t *data, size_t blocks) {
+#ifdef SHA_NI_BUILD
+
+  if (sha256_use_hw()) {
+    Sha256BlocksShaNi(h, data, blocks);
+    return;
+  }
+
+#endif
+  Sha256BlocksPortable(h, data, blocks);
+}
+
+static inline void sha256_init(sha256_ctx_t *ctx) {
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(ctx->h, h0, sizeof(h0));
+  ctx->len = 0;
+}
+
+static inline void sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t len) {
+  size_t used = ctx->len % 64;
+  ctx->len += len;
+
+  if (used > 0) {
+    size_t n = len < 64 - used ? len : 64 - used;
+    memcpy(ctx->buf + used, data, n);
+    data += n;
+    len -= n;
+
+    if (used + n < 64)
+      return;
+
+    Sha256Blocks(ctx->h, ctx->buf, 1);
+  }
+
+  Sha256Blocks(ctx->h, data, len / 64);
+  memcpy(ctx->buf, data + len / 64 * 64, len % 64);
+}
+
+static inline void sha256_final(sha256_ctx_t *ctx, uint8_t out[32]) {
+  uint64_t bits = ctx->len * 8;
+  uint8_t pad[72] = {0x80};
+  size_t padLen = (ctx->len % 64 < 56 ? 56 : 120) - ctx->len % 64;
+
+  for (int i = 0; i < 8; i++)
+    pad[padLen + i] = bits >> (56 - 8 * i);
+
+  sha256_update(ctx, pad, padLen + 8);
+
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = ctx->h[i] >> 24;
+    out[4 * i + 1] = ctx->h[i] >> 16;
+    out[4 * i + 2] = ctx->h[i] >> 8;
+    out[4 * i + 3] = ctx->h[i];
+  }
+}
+
+static inline void sha256(const uint8_t *data, size_t len, uint8_t out[32]) {
+  sha256_ctx_t ctx;
+  sha256_init(&ctx);
+  sha256_update(&ctx, data, len);
+  sha256_final(&ctx, out);
+}
+
+/*
+  HMAC key: the SHA-256 states after the ipad and opad blocks, so the
+  MACs under the same key cost two compressions less each
+*/
+typedef struct {
+  uint32_t inner[8];
+  uint32_t outer[8];
+} hmac_sha256_key_t;
+
+static inline void hmac_sha256_init(hmac_sha256_key_t *hk, const uint8_t *key, size_t keyLen) {
+  uint8_t k[64] = {0}, pad[64];
+  sha256_ctx_t ctx;
+
+  if (keyLen > 64)
+    sha256(key, keyLen, k);
+  else
+    memcpy(k, key, keyLen);
+
+  for (int i = 0; i < 64; i++)
+    pad[i] = k[i] ^ 0x36;
+
+  sha256_init(&ctx);
+  Sha256Blocks(ctx.h, pad, 1);
+  memcpy(hk->inner, ctx.h, sizeof(hk->inner));
+
+  for (int i = 0; i < 64; i++)
+    pad[i] = k[i] ^ 0x5c;
+
+  sha256_init(&ctx);
+  Sha256Blocks(ctx.h, pad, 1);
+  memcpy(hk->outer, ctx.h, sizeof(hk->outer));
+}
+
+// HMAC in pieces: start, sha256_update() of the data, finish
+static inline void hmac_sha256_start(const hmac_sha256_key_t *hk, sha256_ctx_t *ctx) {
+  memcpy(ctx->h, hk->inner, sizeof(ctx->h));
+  ctx->len = 64;
+}
+
+static inline void hmac_sha256_finish(const hmac_sha256_key_t *hk, sha256_ctx_t *ctx,
+                                      uint8_t out[32]) {
+  sha256_final(ctx, out);
+  memcpy(ctx->h, hk->outer, sizeof(ctx->h));
+  ctx->len = 64;
+  sha256_update(ctx, out, 32);
+  sha256_final(ctx, out);
+}
+
+static inline void hmac_sha256(const hmac_sha256_key_t *hk,
+                               const uint8_t *data, size_t len, uint8_t out[32]) {
+  sha256_ctx_t ctx;
+  hmac_sha256_start(hk, &ctx);
+  sha256_update(&ctx, data, len);
+  hmac_sha256_finish(hk, &ctx, out);
+}
+
+static inline void hmac_sha256(const uint8_t *key, size_t keyLen,
+                               const uint8_t *data, size_t len, uint8_t out[32]) {
+  hmac_sha256_key_t hk;
+  hmac_sha256_init(&hk, key, keyLen);
+  hmac_sha256(&hk, data, len, out);
+}
+
+/**
+   kdf_33220 - 3GPP key derivation: HMAC-SHA-256(key, FC || P0 || L0 || P1 || L1 ...)
+   @key: 256-bit key, or its HMAC key
+   @fc: function code
+   @params, @lens: the nb parameters P0, P1, ... and their lengths
+   @out: 256-bit derived key
+   The parameters go to the HMAC as they are: no limit on their size
+*/
+static inline void kdf_33220(const hmac_sha256_key_t *key, uint8_t fc,
+                             const uint8_t *const params[], const uint16_t lens[], int nb,
+                             uint8_t out[32]) {
+  sha256_ctx_t ctx;
+  hmac_sha256_start(key, &ctx);
+  sha256_update(&ctx, &fc, 1);
+
+  for (int i = 0; i < nb; i++) {
+    const uint8_t len[2] = {(uint8_t)(lens[i] >> 8), (uint8_t)lens[i]};
+    sha256_update(&ctx, params[i], lens[i]);
+    sha256_update(&ctx, len, 2);
+  }
+
+  hmac_sha256_finish(key, &ctx, out);
+}
+
+static inline void kdf_33220(const uint8_t key[32], uint8_t fc, const uint8_t *const params[],
+                             const uint16_t lens[], int nb, uint8_t out[32]) {
+  hmac_sha256_key_t hk;
+  hmac_sha256_init(&hk, key, 32);
+  kdf_33220(&hk, fc, params, lens, nb, out);
+}
+
+/**
+   kasme_derive - KASME of EPS AKA (TS 33.401 annex A.2)
+   @ck, @ik: CK and IK of the vector
+   @snId: serving network id: the PLMN id, 3 bytes as in TS 24.301
+   @sqnXorAk: SQN XOR AK, the first 6 bytes of AUTN
+   @kasme: 256-bit KASME
+*/
+static inline void kasme_derive(const uint8_t ck[16], const uint8_t ik[16], const uint8_t snId[3],
+                                const uint8_t sqnXorAk[6], uint8_t kasme[32]) {
+  uint8_t key[32];
+  memcpy(key, ck, 16);
+  memcpy(key + 16, ik, 16);
+  const uint8_t *params[2] = {snId, sqnXorAk};
+  const uint16_t lens[2] = {3, 6};
+  kdf_33220(key, 0x10, params, lens, 2, kasme);
+}
+
+// CK || IK, the HMAC key of RES* and KAUSF
+static inline void ck_ik_key(hmac_sha256_key_t *hk, const uint8_t ck[16], const uint8_t ik[16]) {
+  uint8_t key[32];
+  memcpy(key, ck, 16);
+  memcpy(key + 16, ik, 16);
+  hmac_sha256_init(hk, key, 32);
+}
+
+/**
+   res_star_derive - RES* or XRES* of 5G AKA (TS 33.501 annex A.4)
+   @ckIk: CK || IK HMAC key
+   @snName, @snNameLen: serving network name (TS 24.501 9.12.1)
+   @rand: RAND of the vector
+   @res, @resLen: RES or XRES
+   @resStar: the 128 least significant bits of the KDF output
+*/
+static inline void res_star_derive(const hmac_sha256_key_t *ckIk, const uint8_t *snName,
+                                   uint16_t snNameLen, const uint8_t rand[16],
+                                   const uint8_t *res, uint16_t resLen, uint8_t resStar[16]) {
+  const uint8_t *params[3] = {snName, rand, res};
+  const uint16_t lens[3] = {snNameLen, 16, resLen};
+  uint8_t out[32];
+  kdf_33220(ckIk, 0x6B, params, lens, 3, out);
+  memcpy(resStar, out + 16, 16);
+}
+
+// HXRES*: the 128 least significant bits of SHA-256(RAND || XRES*) (TS 33.501 annex A.5)
+static inline void hxres_star_derive(const uint8_t rand[16], const uint8_t xresStar[16],
+                                     uint8_t hxresStar[16]) {
+  uint8_t s[32], out[32];
+  memcpy(s, rand, 16);
+  memcpy(s + 16, xresStar, 16);
+  sha256(s, sizeof(s), out);
+  memcpy(hxresStar, out + 16, 16);
+}
+
+// KAUSF from CK || IK, SQN XOR AK is the first 6 bytes of AUTN (TS 33.501 annex A.2)
+static inline void kausf_derive(const hmac_sha256_key_t *ckIk, const uint8_t *snName,
+                                uint16_t snNameLen, const uint8_t sqnXorAk[6], uint8_t kausf[32]) {
+  const uint8_t *params[2] = {snName, sqnXorAk};
+  const uint16_t lens[2] = {snNameLen, 6};
+  kdf_33220(ckIk, 0x6A, params, lens, 2, kausf);
+}
+
+// KSEAF from KAUSF (TS 33.501 annex A.6)
+static inline void kseaf_derive(const uint8_t kausf[32], const uint8_t *snName,
+                                uint16_t snNameLen, uint8_t kseaf[32]) {
+  const uint8_t *params[1] = {snName};
+  const uint16_t lens[1] = {snNameLen};
+  kdf_33220(kausf, 0x6C, params, lens, 1, kseaf);
+}
+
+// KAMF from KSEAF, the SUPI is the IMSI digits (TS 33.501 annex A.7)
+static inline void kamf_derive(const uint8_t kseaf[32], const uint8_t *supi, uint16_t supiLen,
+                               const uint8_t abba[2], uint8_t kamf[32]) {
+  const uint8_t *params[2] = {supi, abba};
+  const uint16_t lens[2] = {supiLen, 2};
+  kdf_33220(kseaf, 0x6D, params, lens, 2, kamf);
+}
+
+/*
+  5G AKA home network vector of TS 33.501 6.1.3.2 from a UMTS vector:
+  the HSS gives XRES*, HXRES* for the SEAF, KAUSF, and the keys the
+  AUSF and SEAF then derive, KSEAF and KAMF (ABBA 0000)
+*/
+typedef struct {
+  uint8_t ck[16];
+  uint8_t ik[16];
+  uint8_t rand[16];
+  uint8_t xres[16];
+  uint8_t xresLen;
+  uint8_t sqnXorAk[6];
+  char supi[16]; // IMSI digits, NUL terminated
+} fiveg_in_t;
+
+typedef struct {
+  uint8_t xresStar[16];
+  uint8_t hxresStar[16];
+  uint8_t kausf[32];
+  uint8_t kseaf[32];
+  uint8_t kamf[32];
+} fiveg_out_t;
+
+// One CK || IK HMAC key per vector for XRES* and KAUSF: 16 SHA-256 blocks per vector
+static inline void fiveg_derive_batch(const fiveg_in_t *in, fiveg_out_t *out, size_t n,
+                                      const uint8_t *snName, uint16_t snNameLen) {
+  static const uint8_t abba[2] = {0, 0};
+
+  for (size_t i = 0; i < n; i++) {
+    hmac_sha256_key_t ckIk;
+    ck_ik_key(&ckIk, in[i].ck, in[i].ik);
+    res_star_derive(&ckIk, snName, snNameLen, in[i].rand, in[i].xres, in[i].xresLen,
+                    out[i].xresStar);
+    hxres_star_derive(in[i].rand, out[i].xresStar, out[i].hxresStar);
+    kausf_derive(&ckIk, snName, snNameLen, in[i].sqnXorAk, out[i].kausf);
+    kseaf_derive(out[i].kausf, snName, snNameLen, out[i].kseaf);
+    kamf_derive(out[i].kseaf, (const uint8_t *)in[i].supi, strlen(in[i].supi), abba,
+                out[i].kamf);
+  }
+}
+
+// Known answer: SHA-256("abc") of FIPS 180-4, through the SHA extensions
+static inline bool sha256_self_test(void) {
+#ifdef SHA_NI_BUILD
+  static const uint8_t expected[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+  };
+  uint8_t block[64] = {'a', 'b', 'c', 0x80};
+  block[63] = 24;
+  sha256_ctx_t ctx;
+  sha256_init(&ctx);
+  Sha256BlocksShaNi(ctx.h, block, 1);
+
+  for (int i = 0; i < 8; i++)
+    if (ctx.h[i] != ((uint32_t)expected[4 * i] << 24 | (uint32_t)expected[4 * i + 1] << 16 |
+                     (uint32_t)expected[4 * i + 2] << 8 | expected[4 * i + 3]))
+      return false;
+
+  return true;
+#else
+  return false;
+#endif
+}
+#endif
@@ -0,0 +1,68 @@
+/*
+  Last SQN each card accepted, so a known card is authenticated with a
+  single fresh challenge instead of an AUTS round trip
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef SQN_CACHE_H
+#define SQN_CACHE_H
+#include <uicc.h>
+
+/*
+  Append-only text file, one line per successful authentication
+  <iccid> <sqn>
+  the last line of an ICCID wins. The cache may be stale (the card was
+  authenticated by a real network since): the card answers with an AUTS
+  and we resynchronize, so a wrong entry costs one more challenge.
+*/
+class SqnCache {
+ public:
+  bool load(string path) {
+    fileName=path;
+    FILE *f=fopen(path.c_str(), "r");
+
+    if (f == NULL)
+      return errno == ENOENT;
+
+    char line[128], iccid[32];
+    unsigned long long sqn;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+      if (sscanf(line, "%31s %llu", iccid, &sqn) == 2)
+        sqns[iccid]=sqn;
+
+    fclose(f);
+    return true;
+  }
+
+  // The last SQN accepted by this card, -1 if unknown
+  int64_t lookup(string iccid) {
+    auto known=sqns.find(iccid);
+    return known == sqns.end() ? -1 : (int64_t)known->second;
+  }
+
+  bool record(string iccid, uint64_t sqn) {
+    sqns[iccid]=sqn;
+
+    if (fileName == "")
+      return true;
+
+    FILE *f=fopen(fileName.c_str(), "a");
+
+    if (f == NULL)
+      return false;
+
+    fprintf(f, "%s %" PRIu64 "\n", iccid.c_str(), sqn);
+    bool ok= fflush(f) == 0 && fsync(fileno(f)) == 0;
+    return fclose(f) == 0 && ok;
+  }
+
+ private:
+  string fileName;
+  map<string, uint64_t> sqns;
+};
+#endif
@@ -0,0 +1,466 @@
+/*
+  3GPP AKA - TUAK algorithm set (3GPP TS 35.231), over Keccak-f[1600]
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef TUAK_H
+#define TUAK_H
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <milenage_batch.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KECCAK_AVX2_BUILD
+#endif
+
+static const uint64_t KeccakRC[24] = {
+  0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+  0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+  0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+  0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+  0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+  0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+/*
+  One round of Keccak-f[1600] on the lanes a[x+5y], with the lane
+  operations XOR, ANDN (~x & y) and ROTL: theta, rho, pi, chi and iota
+  written out, so all the indexes and rotations are constants and the
+  lanes stay in registers
+*/
+#define KeccakRound(a, b, c, d, rc, XOR, ANDN, ROTL)          \
+  c[0] = XOR(XOR(XOR(a[0], a[5]), XOR(a[10], a[15])), a[20]); \
+  c[1] = XOR(XOR(XOR(a[1], a[6]), XOR(a[11], a[16])), a[21]); \
+  c[2] = XOR(XOR(XOR(a[2], a[7]), XOR(a[12], a[17])), a[22]); \
+  c[3] = XOR(XOR(XOR(a[3], a[8]), XOR(a[13], a[18])), a[23]); \
+  c[4] = XOR(XOR(XOR(a[4], a[9]), XOR(a[14], a[19])), a[24]); \
+  d[0] = XOR(c[4], ROTL(c[1], 1));                            \
+  d[1] = XOR(c[0], ROTL(c[2], 1));                            \
+  d[2] = XOR(c[1], ROTL(c[3], 1));                            \
+  d[3] = XOR(c[2], ROTL(c[4], 1));                            \
+  d[4] = XOR(c[3], ROTL(c[0], 1));                            \
+  b[0] = XOR(a[0], d[0]);                                     \
+  b[16] = ROTL(XOR(a[5], d[0]), 36);                          \
+  b[7] = ROTL(XOR(a[10], d[0]), 3);                           \
+  b[23] = ROTL(XOR(a[15], d[0]), 41);                         \
+  b[14] = ROTL(XOR(a[20], d[0]), 18);                         \
+  b[10] = ROTL(XOR(a[1], d[1]), 1);                           \
+  b[1] = ROTL(XOR(a[6], d[1]), 44);                           \
+  b[17] = ROTL(XOR(a[11], d[1]), 10);                         \
+  b[8] = ROTL(XOR(a[16], d[1]), 45);                          \
+  b[24] = ROTL(XOR(a[21], d[1]), 2);                          \
+  b[20] = ROTL(XOR(a[2], d[2]), 62);                          \
+  b[11] = ROTL(XOR(a[7], d[2]), 6);                           \
+  b[2] = ROTL(XOR(a[12], d[2]), 43);                          \
+  b[18] = ROTL(XOR(a[17], d[2]), 15);                         \
+  b[9] = ROTL(XOR(a[22], d[2]), 61);                          \
+  b[5] = ROTL(XOR(a[3], d[3]), 28);                           \
+  b[21] = ROTL(XOR(a[8], d[3]), 55);                          \
+  b[12] = ROTL(XOR(a[13], d[3]), 25);                         \
+  b[3] = ROTL(XOR(a[18], d[3]), 21);                          \
+  b[19] = ROTL(XOR(a[23], d[3]), 56);                         \
+  b[15] = ROTL(XOR(a[4], d[4]), 27);                          \
+  b[6] = ROTL(XOR(a[9], d[4]), 20);                           \
+  b[22] = ROTL(XOR(a[14], d[4]), 39);                         \
+  b[13] = ROTL(XOR(a[19], d[4]), 8);                          \
+  b[4] = ROTL(XOR(a[24], d[4]), 14);                          \
+  a[0] = XOR(b[0], ANDN(b[1], b[2]));                         \
+  a[1] = XOR(b[1], ANDN(b[2], b[3]));                         \
+  a[2] = XOR(b[2], ANDN(b[3], b[4]));                         \
+  a[3] = XOR(b[3], ANDN(b[4], b[0]));                         \
+  a[4] = XOR(b[4], ANDN(b[0], b[1]));                         \
+  a[5] = XOR(b[5], ANDN(b[6], b[7]));                         \
+  a[6] = XOR(b[6], ANDN(b[7], b[8]));                         \
+  a[7] = XOR(b[7], ANDN(b[8], b[9]));                         \
+  a[8] = XOR(b[8], ANDN(b[9], b[5]));                         \
+  a[9] = XOR(b[9], ANDN(b[5], b[6]));                         \
+  a[10] = XOR(b[10], ANDN(b[11], b[12]));                     \
+  a[11] = XOR(b[11], ANDN(b[12], b[13]));                     \
+  a[12] = XOR(b[12], ANDN(b[13], b[14]));                     \
+  a[13] = XOR(b[13], ANDN(b[14], b[10]));                     \
+  a[14] = XOR(b[14], ANDN(b[10], b[11]));                     \
+  a[15] = XOR(b[15], ANDN(b[16], b[17]));                     \
+  a[16] = XOR(b[16], ANDN(b[17], b[18]));                     \
+  a[17] = XOR(b[17], ANDN(b[18], b[19]));                     \
+  a[18] = XOR(b[18], ANDN(b[19], b[15]));                     \
+  a[19] = XOR(b[19], ANDN(b[15], b[16]));                     \
+  a[20] = XOR(b[20], ANDN(b[21], b[22]));                     \
+  a[21] = XOR(b[21], ANDN(b[22], b[23]));                     \
+  a[22] = XOR(b[22], ANDN(b[23], b[24]));                     \
+  a[23] = XOR(b[23], ANDN(b[24], b[20]));                     \
+  a[24] = XOR(b[24], ANDN(b[20], b[21]));                     \
+  a[0] = XOR(a[0], rc)
+
+#define KeccakXor(x, y) ((x) ^ (y))
+#define KeccakAndn(x, y) (~(x) & (y))
+#define KeccakRotl(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/*
+  Keccak-f[1600] on 25 64-bit lanes: lane x+5y is bytes 8(x+5y) to
+  8(x+5y)+7 of the state, little endian (FIPS 202)
+*/
+static inline void KeccakF1600(uint64_t s[25]) {
+  uint64_t a[25], b[25], c[5], d[5];
+  memcpy(a, s, sizeof(a));
+
+  for (int round = 0; round < 24; round++) {
+    KeccakRound(a, b, c, d, KeccakRC[round], KeccakXor, KeccakAndn, KeccakRotl);
+  }
+
+  memcpy(s, a, sizeof(a));
+}
+
+#ifdef KECCAK_AVX2_BUILD
+#define KeccakAndn4(x, y) _mm256_andnot_si256(x, y)
+#define KeccakRotl4(x, n) \
+  _mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - (n)))
+
+// 4 independent Keccak-f[1600]: lane i of each state in the 64-bit words of s[i]
+__attribute__((target("avx2")))
+static inline void KeccakF1600x4(__m256i s[25]) {
+  __m256i a[25], b[25], c[5], d[5];
+  memcpy(a, s, sizeof(a));
+
+  for (int round = 0; round < 24; round++) {
+    KeccakRound(a, b, c, d, _mm256_set1_epi64x(KeccakRC[round]), _mm256_xor_si256,
+                KeccakAndn4, KeccakRotl4);
+  }
+
+  memcpy(s, a, sizeof(a));
+}
+#endif
+
+/*
+  TS 35.231 6.2: the 1600 bits input is
+  TOP(c) || INSTANCE || ALGONAME || RAND || AMF || SQN || KEY || padding
+  each field stored with its bytes in reverse order, as in the
+  specification reference code; the outputs are read back the same way
+*/
+static const uint8_t TuakAlgoName[7] = {'T', 'U', 'A', 'K', '1', '.', '0'};
+
+static inline void TuakReverse(uint8_t *dst, const uint8_t *src, int len) {
+  for (int i = 0; i < len; i++)
+    dst[i] = src[len - 1 - i];
+}
+
+// NULL rand, amf or sqn are zeros (TOPc computation)
+static inline void TuakInput(uint8_t in[200], const uint8_t *top, uint8_t instance,
+                             const uint8_t *_rand, const uint8_t *amf, const uint8_t *sqn,
+                             const uint8_t *k, int kLen) {
+  memset(in, 0, 200);
+  TuakReverse(in, top, 32);
+  in[32] = instance;
+  TuakReverse(in + 33, TuakAlgoName, 7);
+
+  if (_rand)
+    TuakReverse(in + 40, _rand, 16);
+
+  if (amf)
+    TuakReverse(in + 56, amf, 2);
+
+  if (sqn)
+    TuakReverse(in + 58, sqn, 6);
+
+  TuakReverse(in + 64, k, kLen);
+  in[96] = 0x1f;
+  in[135] = 0x80;
+}
+
+// The state bytes are copied to the lanes: no alignment or aliasing assumed
+static inline void TuakKeccak(uint8_t state[200], int iterations) {
+  uint64_t s[25];
+  memcpy(s, state, sizeof(s));
+
+  for (int i = 0; i < 25; i++)
+    s[i] = le64toh(s[i]);
+
+  for (int i = 0; i < iterations; i++)
+    KeccakF1600(s);
+
+  for (int i = 0; i < 25; i++)
+    s[i] = htole64(s[i]);
+
+  memcpy(state, s, sizeof(s));
+}
+
+/*
+  INSTANCE bits (TS 35.231 6.3 to 6.6): 0x80 f1*, 0x40 f2-f5, 0xc0 f5*,
+  MAC or RES length 0x08 (64 bits) 0x10 (128) 0x20 (256), 0x04 256 bits
+  CK, 0x02 256 bits IK, 0x01 256 bits K
+*/
+static inline uint8_t TuakLength(int bytes) {
+  return bytes == 8 ? 0x08 : bytes == 16 ? 0x10 : bytes == 32 ? 0x20 : 0;
+}
+
+/**
+   tuak_topc_gen - TOPc = first 256 bits of Keccak(TOP, K)
+   @k: K = 128 or 256-bit subscriber key, kLen bytes
+   @top: TOP = 256-bit operator variant algorithm configuration field
+   @topc: Buffer for TOPc
+   @iterations: Keccak iterations (1 by default in TS 35.231)
+*/
+static inline void tuak_topc_gen(const uint8_t *k, int kLen, const uint8_t *top, uint8_t *topc,
+                                 int iterations = 1) {
+  uint8_t state[200];
+  TuakInput(state, top, kLen == 32 ? 0x01 : 0x00, NULL, NULL, NULL, k, kLen);
+  TuakKeccak(state, iterations);
+  TuakReverse(topc, state, 32);
+}
+
+/**
+   tuak_f1 - TUAK f1 or f1*
+   @topc: TOPc = 256-bit value derived from TOP and K
+   @k: K, kLen bytes (16 or 32)
+   @star: f1* (resynchronisation) instead of f1
+   @mac: Buffer for MAC-A or MAC-S, macLen bytes (8, 16 or 32)
+*/
+static inline void tuak_f1(const uint8_t *topc, const uint8_t *k, int kLen, const uint8_t *_rand,
+                           const uint8_t *sqn, const uint8_t *amf, bool star,
+                           uint8_t *mac, int macLen, int iterations = 1) {
+  uint8_t state[200];
+  uint8_t instance = (star ? 0x80 : 0x00) | TuakLength(macLen) | (kLen == 32 ? 0x01 : 0x00);
+  TuakInput(state, topc, instance, _rand, amf, sqn, k, kLen);
+  TuakKeccak(state, iterations);
+  TuakReverse(mac, state, macLen);
+}
+
+/**
+   tuak_f2345 - TUAK f2, f3, f4, f5
+   @res: Buffer for RES, resLen bytes (4, 8, 16 or 32)
+   @ck: Buffer for CK, ckLen bytes (16 or 32)
+   @ik: Buffer for IK, ikLen bytes (16 or 32)
+   @ak: Buffer for AK = 48-bit anonymity key, or %NULL
+*/
+static inline void tuak_f2345(const uint8_t *topc, const uint8_t *k, int kLen, const uint8_t *_rand,
+                              uint8_t *res, int resLen, uint8_t *ck, int ckLen,
+                              uint8_t *ik, int ikLen, uint8_t *ak, int iterations = 1) {
+  uint8_t state[200];
+  uint8_t instance = 0x40 | TuakLength(resLen) | (ckLen == 32 ? 0x04 : 0x00) |
+                     (ikLen == 32 ? 0x02 : 0x00) | (kLen == 32 ? 0x01 : 0x00);
+  TuakInput(state, topc, instance, _rand, NULL, NULL, k, kLen);
+  TuakKeccak(state, iterations);
+
+  if (res)
+    TuakReverse(res, state, resLen);
+
+  if (ck)
+    TuakReverse(ck, state + 32, ckLen);
+
+  if (ik)
+    TuakReverse(ik, state + 64, ikLen);
+
+  if (ak)
+    TuakReverse(ak, state + 96, 6);
+}
+
+// f5*: AK for the resynchronisation
+static inline void tuak_f5star(const uint8_t *topc, const uint8_t *k, int kLen,
+                               const uint8_t *_rand, uint8_t *ak, int iterations = 1) {
+  uint8_t state[200];
+  TuakInput(state, topc, 0xc0 | (kLen == 32 ? 0x01 : 0x00), _rand, NULL, NULL, k, kLen);
+  TuakKeccak(state, iterations);
+  TuakReverse(ak, state + 96, 6);
+}
+
+/**
+   tuak_generate - AUTN, IK, CK, RES as milenage_generate(), with 64-bit
+   MAC and RES, 128-bit CK and IK
+*/
+static inline bool tuak_generate(const uint8_t *topc, const uint8_t *amf, const uint8_t *k, int kLen,
+                                 const uint8_t *sqn, const uint8_t *_rand, uint8_t *autn,
+                                 uint8_t *ik, uint8_t *ck, uint8_t *res) {
+  uint8_t ak[6];
+  tuak_f1(topc, k, kLen, _rand, sqn, amf, false, autn + 8, 8);
+  tuak_f2345(topc, k, kLen, _rand, res, 8, ck, 16, ik, 16, ak);
+
+  for (int i = 0; i < 6; i++)
+    autn[i] = sqn[i] ^ ak[i];
+
+  memcpy(autn + 6, amf, 2);
+  return true;
+}
+
+// tuak_auts - AUTS validation as milenage_auts()
+static inline bool tuak_auts(const uint8_t *topc, const uint8_t *k, int kLen, const uint8_t *_rand,
+                             const uint8_t *auts, uint8_t *sqn) {
+  uint8_t amf[2] = {0, 0}, ak[6], mac_s[8];
+  tuak_f5star(topc, k, kLen, _rand, ak);
+
+  for (int i = 0; i < 6; i++)
+    sqn[i] = auts[i] ^ ak[i];
+
+  tuak_f1(topc, k, kLen, _rand, sqn, amf, true, mac_s, 8);
+  return memcmp(mac_s, auts + 6, 8) == 0;
+}
+
+/*
+  Batch generation, for the vector generator: the 2 Keccak of each vector
+  are computed 4 at a time with AVX2 when the CPU has it
+*/
+typedef struct {
+  uint8_t k[32];
+  uint8_t kLen;
+  uint8_t topc[32];
+  uint8_t rand[16];
+  uint8_t sqn[6];
+  uint8_t amf[2];
+} tuak_in_t;
+
+static inline void TuakOutputs(const tuak_in_t &in, const uint8_t f1[200], const uint8_t f2345[200],
+                               milenage_out_t &out) {
+  TuakReverse(out.autn + 8, f1, 8);
+  TuakReverse(out.res, f2345, 8);
+  TuakReverse(out.ck, f2345 + 32, 16);
+  TuakReverse(out.ik, f2345 + 64, 16);
+  TuakReverse(out.ak, f2345 + 96, 6);
+
+  for (int i = 0; i < 6; i++)
+    out.autn[i] = in.sqn[i] ^ out.ak[i];
+
+  memcpy(out.autn + 6, in.amf, 2);
+}
+
+static inline void TuakInputs(const tuak_in_t &in, uint8_t f1[200], uint8_t f2345[200]) {
+  uint8_t kBit = in.kLen == 32 ? 0x01 : 0x00;
+  TuakInput(f1, in.topc, 0x08 | kBit, in.rand, in.amf, in.sqn, in.k, in.kLen);
+  TuakInput(f2345, in.topc, 0x40 | 0x08 | kBit, in.rand, NULL, NULL, in.k, in.kLen);
+}
+
+#ifdef KECCAK_AVX2_BUILD
+// Vectors 2 by 2: f1 and f2345 of 2 vectors in the 4 Keccak lanes
+__attribute__((target("avx2")))
+static inline void tuakBatchAvx2(const tuak_in_t *in, milenage_out_t *out, size_t n) {
+  uint8_t states[4][200];
+  uint64_t lanes[4][25]; // the states as lanes, x86 is little endian
+
+  for (size_t v = 0; v < n; v += 2) {
+    size_t nb = n - v < 2 ? 1 : 2;
+
+    for (size_t i = 0; i < 2; i++)
+      TuakInputs(in[v + (i < nb ? i : 0)], states[2 * i], states[2 * i + 1]);
+
+    memcpy(lanes, states, sizeof(lanes));
+    __m256i s[25];
+
+    for (int l = 0; l < 25; l++)
+      s[l] = _mm256_set_epi64x(lanes[3][l], lanes[2][l], lanes[1][l], lanes[0][l]);
+
+    KeccakF1600x4(s);
+
+    for (int l = 0; l < 25; l++) {
+      alignas(32) uint64_t lane[4];
+      _mm256_store_si256((__m256i *)lane, s[l]);
+
+      for (int b = 0; b < 4; b++)
+        lanes[b][l] = lane[b];
+    }
+
+    memcpy(states, lanes, sizeof(lanes));
+
+    for (size_t i = 0; i < nb; i++)
+      TuakOutputs(in[v + i], states[2 * i], states[2 * i + 1], out[v + i]);
+  }
+}
+#endif
+
+static inline void tuakBatchPortable(const tuak_in_t *in, milenage_out_t *out, size_t n) {
+  uint8_t f1[200], f2345[200];
+
+  for (size_t v = 0; v < n; v++) {
+    TuakInputs(in[v], f1, f2345);
+    TuakKeccak(f1, 1);
+    TuakKeccak(f2345, 1);
+    TuakOutputs(in[v], f1, f2345, out[v]);
+  }
+}
+
+/*
+  Known answers: TOPc and MAC-A of TS 35.232 test set 1, the MAC through
+  the batch code (portable or AVX2)
+*/
+static inline bool tuak_self_test(bool avx2) {
+  static const uint8_t top[32] = {
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+    0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55
+  };
+  static const uint8_t topc[32] = {
+    0xbd, 0x04, 0xd9, 0x53, 0x0e, 0x87, 0x51, 0x3c, 0x5d, 0x83, 0x7a, 0xc2, 0xad, 0x95, 0x46, 0x23,
+    0xa8, 0xe2, 0x33, 0x0c, 0x11, 0x53, 0x05, 0xa7, 0x3e, 0xb4, 0x5d, 0x1f, 0x40, 0xcc, 0xcb, 0xff
+  };
+  static const uint8_t macA[8] = {0xf9, 0xa5, 0x4e, 0x6a, 0xea, 0xa8, 0x61, 0x8d};
+  tuak_in_t in;
+  milenage_out_t out;
+  memset(&in, 0, sizeof(in));
+  memset(in.k, 0xab, 16);
+  in.kLen = 16;
+  memset(in.rand, 0x42, 16);
+  memset(in.sqn, 0x11, 6);
+  memset(in.amf, 0xff, 2);
+  tuak_topc_gen(in.k, in.kLen, top, in.topc);
+
+  if (memcmp(in.topc, topc, 32) != 0)
+    return false;
+
+#ifdef KECCAK_AVX2_BUILD
+
+  if (avx2)
+    tuakBatchAvx2(&in, &out, 1);
+  else
+#endif
+    tuakBatchPortable(&in, &out, 1);
+
+  return memcmp(out.autn + 8, macA, 8) == 0;
+}
+
+/*
+  Use AVX2 when the CPU has it and it gives the known answers,
+  UICC_KECCAK=portable in the environment forces the portable code
+*/
+static inline bool tuak_use_avx2(void) {
+  static const bool avx2 = [] {
+#ifdef KECCAK_AVX2_BUILD
+    const char *forced = getenv("UICC_KECCAK");
+
+    if (forced != NULL && strcmp(forced, "portable") == 0)
+      return false;
+
+    __builtin_cpu_init();
+
+    if (!__builtin_cpu_supports("avx2"))
+      return false;
+
+    if (!tuak_self_test(true)) {
+      fprintf(stderr, "AVX2 Keccak gives wrong results, using the portable one\n");
+      return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+  }();
+  return avx2;
+}
+
+/**
+   tuak_generate_batch - tuak_generate() for n subscribers
+   (the states are little endian: x86 only for the AVX2 path)
+*/
+static inline void tuak_generate_batch(const tuak_in_t *in, milenage_out_t *out, size_t n) {
+#ifdef KECCAK_AVX2_BUILD
+
+  if (tuak_use_avx2()) {
+    tuakBatchAvx2(in, out, n);
+    return;
+  }
+
+#endif
+  tuakBatchPortable(in, out, n);
+}
+#endif
@@ -17,16 +17,20 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#ifndef UICC_H
+#define UICC_H
 #include <inttypes.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <arpa/inet.h>
@@ -36,7 +40,11 @@
 #include <iostream>
 #include <vector>
 #include <map>
-#include <numeric>
+#include <set>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <stdarg.h>
 
 
 using namespace std;
@@ -94,7 +102,88 @@ using namespace std;
     }                 \
   } while(0)
 
-static inline string extractTLV(string in, string TLVname) {
+static inline string stringPrintf(const char *format, ...) {
+  char txt[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(txt, sizeof(txt), format, args);
+  va_end(args);
+  return txt;
+}
+
+/*
+  Errors from the reader or the card: a production line must survive them,
+  so the UICC classes throw these instead of stopping the program
+*/
+class UICCError : public runtime_error {
+ public:
+  enum errorType {
+    timeout,     // the card doesn't answer
+    statusWord,  // the card answers an error status word (in sw)
+    cardRemoved, // the reader or the card is gone
+    protocol,    // unexpected answer from the card
+    openFailure, // can't open or setup the reader
+    badRequest,  // the command can't be done: unknown file, not developped...
+  };
+
+  UICCError(errorType t, string txt, uint16_t s=0):
+    runtime_error(t == statusWord ? stringPrintf("%s (SW %04x)", txt.c_str(), s) : txt),
+    type(t), sw(s) {};
+
+  // A card reset and a new attempt may solve it
+  bool retryable() const {
+    return type == timeout || type == cardRemoved ||
+           type == protocol || type == openFailure;
+  }
+
+  errorType type;
+  uint16_t sw;
+};
+
+// Same as Assert() for card operations: throws a UICCError with the last
+// status word received from the card instead of stopping the program
+#define Require(cARD, cOND, fORMAT, aRGS...)                            \
+  do {                                                                  \
+    if ( !(cOND) )                                                      \
+      throw UICCError(UICCError::statusWord,                            \
+                      stringPrintf(fORMAT, ##aRGS), (cARD).lastSW);     \
+  } while(0)
+
+/*
+  Bytes owned by someone else: a string, a read buffer (see
+  fileSpan), a card answer. The decoders take views, to decode in place
+  what we read. Valid as long as the owner.
+*/
+struct ByteView {
+  const uint8_t *data;
+  size_t size;
+
+  ByteView(): data(NULL), size(0) {}
+  ByteView(const uint8_t *d, size_t s): data(d), size(s) {}
+  ByteView(const string &s): data((const uint8_t *)s.c_str()), size(s.size()) {}
+
+  uint8_t operator[](size_t i) const {
+    return data[i];
+  }
+
+  // As string::substr(), but out of range gives an empty view
+  ByteView sub(size_t pos, size_t n=string::npos) const {
+    if (pos >= size)
+      return ByteView();
+
+    return ByteView(data+pos, min(n, size-pos));
+  }
+
+  string str() const {
+    return string((const char *)data, size);
+  }
+
+  bool equals(ByteView o) const {
+    return size == o.size && (size == 0 || memcmp(data, o.data, size) == 0);
+  }
+};
+
+static inline string extractTLV(ByteView in, string TLVname) {
   static const map<string,char> Tags= {
     {"Application Template", '\x61'},
     {"FCP Template", '\x62'},
@@ -112,12 +201,12 @@ static inline string extractTLV(string in, string TLVname) {
   auto it=Tags.find(TLVname);
 
   if (it != Tags.end()) {
-    char tag=it->second;
+    uint8_t tag=it->second;
     size_t index=0;
 
-    while (index < in.size()) {
+    while (index+1 < in.size) {
       if (in[index]==tag)
-        return in.substr(index+2, (unsigned)in[index+1]);
+        return in.sub(index+2, in[index+1]).str();
 
       index+=in[index+1]+2;
     }
@@ -135,10 +224,67 @@ static inline void dump_hex(string name, string data) {
   printf("\n");
 }
 
-static inline string bcdToAscii(string data) {
-  string ret="";
+static inline string hexString(const string &data) {
+  static const char digits[]="0123456789abcdef";
+  string ret;
 
   for (size_t i=0; i<data.size(); i++) {
+    ret+=digits[(data[i]>>4)&0xF];
+    ret+=digits[data[i]&0xF];
+  }
+
+  return ret;
+}
+
+static inline int makeBin(string in, string &out) {
+  out="";
+
+  if ( in.size() %2 == 1)
+    return -1;
+
+  for (size_t i=0; i<in.size(); i++) {
+    uint8_t tmp=255;
+
+    if (in[i] >= '0' && in[i]<= '9')
+      tmp=in[i]-'0';
+
+    if (in[i] >= 'a' && in[i]<= 'f')
+      tmp=in[i]-'a'+10;
+
+    if (in[i] >= 'A' && in[i]<= 'F')
+      tmp=in[i]-'A'+10;
+
+    if (tmp == 255)
+      return -1;
+
+    i++;
+
+    if (in[i] >= '0' && in[i] <= '9') {
+      out+=(unsigned char) ((in[i]-'0') | tmp <<4);
+      continue;
+    }
+
+    if (in[i] >= 'a' && in[i] <= 'f') {
+      out+=(unsigned char) ((in[i]-'a'+10) | tmp <<4);
+      continue;
+    }
+
+    if (in[i] >= 'A' && in[i] <= 'F') {
+      out+=(unsigned char) ((in[i]-'A'+10) | tmp <<4);
+      continue;
+    }
+
+    return -1;
+  }
+
+  return in.size()/2;
+}
+
+static inline string bcdToAscii(ByteView data) {
+  string ret;
+  ret.reserve(data.size*2);
+
+  for (size_t i=0; i<data.size; i++) {
     char c= (data[i] & 0xF) + '0';
 
     if ( c >= '0' && c <= '9' )
@@ -153,6 +299,29 @@ static inline string bcdToAscii(string data) {
   return ret;
 }
 
+// MCC-MNC of a PLMN in 3 bytes (TS 24.008 10.5.1.13), "" for an empty
+// entry (FFFFFF)
+static inline string decodePlmn(ByteView plmn) {
+  static const char digits[]="0123456789abcdef";
+
+  if (plmn.size < 3 || (plmn[0] == 0xff && plmn[1] == 0xff && plmn[2] == 0xff))
+    return "";
+
+  string ret;
+  ret+=digits[plmn[0]&0xF];
+  ret+=digits[plmn[0]>>4];
+  ret+=digits[plmn[1]&0xF];
+  ret+='-';
+  ret+=digits[plmn[2]&0xF];
+  ret+=digits[plmn[2]>>4];
+
+  // third MNC digit, F for a two digits MNC
+  if ((plmn[1]>>4) != 0xF)
+    ret+=digits[plmn[1]>>4];
+
+  return ret;
+}
+
 static inline unsigned char mkDigit(unsigned char in) {
   unsigned char v=tolower(in);
 
@@ -180,8 +349,8 @@ static inline string makeBcd(string data, bool swap=true, int outputLength=0) {
     for(size_t i=0; i< tmp.size(); i+=2)
       output+=(char)( (mkDigit(tmp[i])<<4) + (mkDigit(tmp[i+1])) );
 
-  for (int i=tmp.size()/2; i<outputLength; i++)
-    output+='\xff';
+  if ((int)output.size() < outputLength)
+    output.append(outputLength - output.size(), '\xff');
 
   return output;
 }
@@ -202,16 +371,260 @@ static inline string printable(string in) {
   return ret;
 }
 
+// Luhn weight of a digit, by position parity counted from the right
+// (the check digit is position 0): odd positions are doubled
+static const uint8_t luhnWeight[2][10]= {
+  {0,1,2,3,4,5,6,7,8,9},
+  {0,2,4,6,8,1,3,5,7,9},
+};
+
 static inline bool luhn( const string &id) {
-  static const int m[10]  = {0,2,4,6,8,1,3,5,7,9}; // mapping for rule 3
-  bool is_odd_dgt = false;
-  auto lambda = [&](int a, char c) {
-    return a + ((is_odd_dgt = !is_odd_dgt) ? c-'0' : m[c-'0']);
-  };
-  int s = std::accumulate(id.rbegin(), id.rend(), 0, lambda);
+  int s=0;
+
+  for (size_t i=0; i < id.size(); i++) {
+    char c=id[id.size()-1-i];
+
+    if (c < '0' || c > '9')
+      return false;
+
+    s+=luhnWeight[i&1][c-'0'];
+  }
+
   return 0 == s%10;
 }
 
+// The check digit to append to id
+static inline char luhnDigit( const string &id) {
+  int s=0;
+
+  for (size_t i=0; i < id.size(); i++)
+    s+=luhnWeight[(i+1)&1][id[id.size()-1-i]-'0'];
+
+  return '0' + (10 - s%10) % 10;
+}
+
+/*
+  Opens and sets up the serial port of a card reader, and resets the card:
+  the ATR follows, after about 100 ms
+  flags: added to the open() flags (O_SYNC, O_NONBLOCK)
+  Returns the file descriptor
+*/
+static inline int openReader(const char *portname, int flags) {
+  int fd;
+
+  if ( (fd=::open(portname, O_RDWR | O_NOCTTY | flags)) < 0 )
+    throw UICCError(UICCError::openFailure,
+                    stringPrintf("Failed to open %s: %s", portname, strerror(errno)));
+
+  struct termios tty;
+
+  if (tcgetattr(fd, &tty) < 0) {
+    ::close(fd);
+    throw UICCError(UICCError::openFailure,
+                    stringPrintf("%s is not a serial port: %s", portname, strerror(errno)));
+  }
+
+  tty.c_cflag &= ~( CSIZE );
+  tty.c_cflag |= CLOCAL | CREAD | CS8 | PARENB | CSTOPB | HUPCL ;
+  /* setup for non-canonical mode */
+  tty.c_iflag &= ~(IGNBRK | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+  tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+  tty.c_oflag &= ~OPOST;
+  /* fetch bytes as they become available */
+  tty.c_cc[VMIN] = 0;
+  tty.c_cc[VTIME] = 1;
+  cfsetispeed(&tty, (speed_t)B9600);
+  cfsetospeed(&tty, (speed_t)B9600);
+
+  if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+    ::close(fd);
+    throw UICCError(UICCError::openFailure,
+                    stringPrintf("Can't setup %s: %s", portname, strerror(errno)));
+  }
+
+  // reset the UICC
+  int iFlags;
+  iFlags = 0 ;
+  // turn off DTR
+  ioctl(fd, TIOCMSET, &iFlags);
+  iFlags = 0xFFFF;
+  // turn on DTR
+  //iFlags = TIOCM_CTS  ;
+  //ioctl(fd, TIOCMSET, &iFlags);
+  return fd;
+}
+
+/*
+  Command APDU in a fixed buffer (on the stack, no allocation):
+  CLA INS P1 P2 P3 then up to 255 bytes of data. On T=0 P3 is Lc
+  when the command has data, else Le (the answer size)
+*/
+class Apdu {
+ public:
+  static const size_t maxData=255;
+
+  Apdu(uint8_t cla, uint8_t ins, uint8_t p1=0, uint8_t p2=0) {
+    buf[0]=cla;
+    buf[1]=ins;
+    buf[2]=p1;
+    buf[3]=p2;
+    buf[4]=0;
+  }
+
+  // A command already encoded: header and data
+  explicit Apdu(const string &raw) {
+    if (raw.size() < 5 || raw.size() > sizeof(buf))
+      throw UICCError(UICCError::badRequest,
+                      stringPrintf("APDU of %zu bytes, not 5 to %zu", raw.size(), sizeof(buf)));
+
+    memcpy(buf, raw.c_str(), raw.size());
+    len=raw.size();
+  }
+
+  Apdu &cla(uint8_t v) {
+    buf[0]=v;
+    return *this;
+  }
+
+  Apdu &ins(uint8_t v) {
+    buf[1]=v;
+    return *this;
+  }
+
+  Apdu &p1(uint8_t v) {
+    buf[2]=v;
+    return *this;
+  }
+
+  Apdu &p2(uint8_t v) {
+    buf[3]=v;
+    return *this;
+  }
+
+  // Answer size of a command without data (256 is coded 0)
+  Apdu &le(size_t v) {
+    buf[4]=v;
+    return *this;
+  }
+
+  // The data and Lc
+  Apdu &append(const void *data, size_t size) {
+    check(size);
+    memcpy(buf+len, data, size);
+    len+=size;
+    buf[4]=len-5;
+    return *this;
+  }
+
+  Apdu &append(const string &data) {
+    return append(data.c_str(), data.size());
+  }
+
+  Apdu &append(uint8_t byte) {
+    return append(&byte, 1);
+  }
+
+  Apdu &fill(uint8_t byte, size_t size) {
+    check(size);
+    memset(buf+len, byte, size);
+    len+=size;
+    buf[4]=len-5;
+    return *this;
+  }
+
+  // Fill the data up to size bytes (records, passwords, fixed size files)
+  Apdu &padTo(size_t size, uint8_t byte=0xff) {
+    return size > dataSize() ? fill(byte, size - dataSize()) : *this;
+  }
+
+  const uint8_t *bytes() const {
+    return buf;
+  }
+
+  size_t size() const {
+    return len;
+  }
+
+  const uint8_t *data() const {
+    return buf+5;
+  }
+
+  size_t dataSize() const {
+    return len-5;
+  }
+
+ private:
+  uint8_t buf[5+maxData];
+  size_t len=5;
+
+  void check(size_t size) {
+    if (len + size > sizeof(buf))
+      throw UICCError(UICCError::badRequest,
+                      stringPrintf("APDU data longer than %zu bytes", maxData));
+  }
+};
+
+// Answer of the card in a fixed buffer: data, then SW1 SW2
+struct ApduResponse {
+  uint8_t buf[256+2];
+  size_t len=0;
+
+  size_t size() const {
+    return len;
+  }
+
+  uint16_t sw() const {
+    return len >= 2 ? buf[len-2]<<8 | buf[len-1] : 0;
+  }
+
+  uint8_t sw1() const {
+    return len >= 2 ? buf[len-2] : 0;
+  }
+
+  uint8_t sw2() const {
+    return len >= 2 ? buf[len-1] : 0;
+  }
+
+  const uint8_t *data() const {
+    return buf;
+  }
+
+  size_t dataSize() const {
+    return len >= 2 ? len-2 : 0;
+  }
+
+  // dataSize bytes of data then 9000
+  bool ok(size_t dataSize) const {
+    return len == dataSize+2 && sw() == 0x9000;
+  }
+
+  string dataString() const {
+    return string((const char *)buf, dataSize());
+  }
+};
+
+/*
+  A file read in the caller buffer by readFile(): the records are stride
+  bytes apart, a transparent file is one record of the file size.
+  No record: the file can't be read.
+*/
+struct fileSpan {
+  uint8_t *data=NULL;
+  size_t stride=0;
+  size_t records=0;
+
+  size_t size() const {
+    return stride*records;
+  }
+
+  ByteView record(size_t i) const {
+    return ByteView(data+i*stride, stride);
+  }
+};
+
+// 255 records of 255 bytes: a buffer of this size holds any file
+static const size_t maxFileBytes=255*255;
+
 class UICC {
  public:
   UICC() {
@@ -221,108 +634,109 @@ class UICC {
         (debug_env[0] == 'Y' || debug_env[0] == 'y'))
       debug=true;
   };
-  ~UICC() {
+  virtual ~UICC() {
     close();
   };
 
-  string read(size_t s = 1024) {
+  // Reads the answer of the card in buf, s bytes at most: less when the
+  // card stops sending (VTIME). Returns the number of bytes
+  size_t read(uint8_t *buf, size_t s) {
     size_t got=0;
-    string data="";
 
     while (got < s) {
       int ret;
-      char buf;
-      Assert( (ret=::read(fd, &buf, 1)) >= 0, "Error from read");
 
-      switch (ret) {
-        case 1:
-          got++;
-          data+=buf;
-          break;
+      if ( (ret=::read(fd, buf+got, s-got)) < 0 ) {
+        if (errno == EINTR)
+          continue;
 
-        case 0: // for time out: no more data
-          if (debug)
-            dump_hex("Received", data);
+        throw UICCError(UICCError::cardRemoved,
+                        stringPrintf("Error from read: %s", strerror(errno)));
+      }
 
-          return data;
-          break;
+      if (ret == 0) // for time out: no more data
+        break;
 
-        default:
-          fprintf(stderr,"Error from read > 1 char\n");
-      }
+      got+=ret;
     }
 
     if (debug)
-      dump_hex("Received", data);
+      dump_hex("Received", string((char *)buf, got));
+
+    // Answers end by the status word
+    if (got >= 2)
+      lastSW=buf[got-2]<<8 | buf[got-1];
 
+    return got;
+  }
+
+  void read(ApduResponse &answer, size_t s) {
+    answer.len=read(answer.buf, min(s, sizeof(answer.buf)));
+  }
+
+  string read(size_t s = 1024) {
+    string data(s, '\0');
+    data.resize(read((uint8_t *)&data[0], s));
     return data;
   }
 
+  int write(const Apdu &apdu) {
+    return write(apdu.bytes(), apdu.size());
+  }
+
   int write(string buf) {
+    return write((const uint8_t *)buf.c_str(), buf.size());
+  }
+
+  int write(const uint8_t *buf, size_t size) {
     if (debug)
-      dump_hex("Sending", buf);
-
-    size_t size=buf.size();
-    Assert( size >= 5, "");
-
-    for (int i=0; i<5; i++ ) {
-      ::write(fd, &buf[i], 1);
-      // UICC have only one wire for Tx and Rx,
-      // so over a RS232 we always receive back what we send
-      char c;
-      Assert(::read(fd, &c, 1)==1,
-             "All data sent must echo back" );
-    }
+      dump_hex("Sending", string((const char *)buf, size));
+
+    if ( size < 5 )
+      throw UICCError(UICCError::badRequest, "APDU shorter than 5 bytes");
+
+    for (int i=0; i<5; i++ )
+      sendByte(buf[i]);
 
     // Read UICC acknowledge the order
-    if (buf[0] == (int8_t)'\xa0'|| buf[0] == (int8_t)'\x00' ) {
-      char c;
-      int ret=::read(fd, &c, 1);
-      Assert( ret ==1 && c == buf[1],
-              "UICC answer is %02hhx instead of %02hhx",c, buf[1]);
+    if (buf[0] == 0xa0 || buf[0] == 0x00 ) {
+      uint8_t c=readByte();
+
+      while (c == 0x60) // NULL procedure byte: the card needs more time
+        c=readByte();
+
+      if (c != buf[1]) {
+        // The card refuses the command: we received SW1, SW2 follows
+        if ((c & 0xf0) == 0x60 || (c & 0xf0) == 0x90) {
+          lastSW=c<<8 | (uint8_t)readByte();
+          throw UICCError(UICCError::statusWord,
+                          stringPrintf("UICC refused command %02hhx", buf[1]), lastSW);
+        }
+
+        throw UICCError(UICCError::protocol,
+                        stringPrintf("UICC answer is %02hhx instead of %02hhx",c, buf[1]));
+      }
     } else
       printf("WARNING: Non standard packet sent\n");
 
-    for (size_t i=5; i<size; i++ ) {
-      ::write(fd, &buf[i], 1);
-      char c;
-      Assert(::read(fd, &c, 1)==1,
-             "All data sent must echo back" );
-    }
+    for (size_t i=5; i<size; i++ )
+      sendByte(buf[i]);
 
     return size;
   }
 
   // Returns the ATR (answer to reset) string
-  string open(char *portname) {
-    Assert( (fd=::open(portname, O_RDWR | O_NOCTTY | O_SYNC)) >=0,
-            "Failed to open %s", portname);
-    struct termios tty;
-    Assert (tcgetattr(fd, &tty) >= 0, "");
-    tty.c_cflag &= ~( CSIZE );
-    tty.c_cflag |= CLOCAL | CREAD | CS8 | PARENB | CSTOPB | HUPCL ;
-    /* setup for non-canonical mode */
-    tty.c_iflag &= ~(IGNBRK | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
-    tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-    tty.c_oflag &= ~OPOST;
-    /* fetch bytes as they become available */
-    tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 1;
-    cfsetispeed(&tty, (speed_t)B9600);
-    cfsetospeed(&tty, (speed_t)B9600);
-    Assert (tcsetattr(fd, TCSANOW, &tty) == 0,"");
-    // reset the UICC
-    int iFlags;
-    iFlags = 0 ;
-    // turn off DTR
-    ioctl(fd, TIOCMSET, &iFlags);
+  string open(const char *portname) {
+    port=portname;
+    fd=openReader(portname, O_SYNC);
     struct timespec t= {0,1000*1000*100};
     nanosleep(&t,NULL);
-    iFlags = 0xFFFF;
-    // turn on DTR
-    //iFlags = TIOCM_CTS  ;
-    //ioctl(fd, TIOCMSET, &iFlags);
-    return this->read();
+    string ATR=this->read();
+
+    if (ATR == "")
+      throw UICCError(UICCError::timeout, stringPrintf("No card answer on %s", portname));
+
+    return ATR;
   }
 
   void close() {
@@ -332,8 +746,15 @@ class UICC {
     fd=-1;
   }
 
+  // Power cycle the card: it comes back to the MF, with no PIN verified
+  string reset() {
+    close();
+    sessionReset();
+    return open(port.c_str());
+  }
+
   bool send_check( string in, string out) {
-    Assert( write(in) == (int)in.size(), "");
+    write(in);
     string answer=read(out.size());
 
     if (answer.size() != out.size()) {
@@ -354,72 +775,80 @@ class UICC {
     return true;
   }
 
-  bool verifyChv(char cla, char chv, string pwd) {
-    string order;
-    order+=cla;
-    order+=string(u8"\x20\x00",2);
-    order+=chv;
-    order+=(char)8;
-    order+=pwd;
+  // Same, the card answers only the status word sw
+  bool send_check(const Apdu &in, uint16_t sw) {
+    write(in);
+    ApduResponse answer;
+    read(answer, 2);
 
-    for (int i=pwd.size(); i<8 ; i++)
-      order+='\xff';
+    if (answer.size() == 2 && answer.sw() == sw)
+      return true;
 
-    string answer (u8"\x90\x00",2);
-    return send_check(order, answer);
-  }
+    char expected[2]= {(char)(sw>>8), (char)sw};
 
-  bool updateChv(char cla, char chv, string oldpwd, string newpwd) {
-    string order;
-    order+=cla;
-    order+=string(u8"\x24\x00",2);
-    order+=chv;
-    order+=(char)16;
-    order+=oldpwd;
+    if (answer.size() != 2)
+      printf("ret is not right size\n");
+    else {
+      printf("BAD return code\n");
+      answer.len+=read(answer.buf+2, sizeof(answer.buf)-2);
+    }
 
-    for (int i=oldpwd.size(); i<8 ; i++)
-      order+='\xff';
+    dump_hex("Expected: ", string(expected, 2));
+    dump_hex("got answer: ", string((char *)answer.buf, answer.size()));
+    return false;
+  }
 
-    order+=newpwd;
+  // A command without answer data: true if the card answers 9000
+  bool sendOk(const Apdu &in) {
+    write(in);
+    ApduResponse answer;
+    read(answer, 2);
+    return answer.ok(0);
+  }
 
-    for (int i=newpwd.size(); i<8 ; i++)
-      order+='\xff' ;
+  bool verifyChv(char cla, char chv, string pwd) {
+    Apdu order(cla, 0x20, 0x00, chv);
+    order.append(pwd).padTo(8);
+    return send_check(order, 0x9000);
+  }
 
-    string answer (u8"\x90\x00",2);
-    return send_check(order, answer);
+  bool updateChv(char cla, char chv, string oldpwd, string newpwd) {
+    Apdu order(cla, 0x24, 0x00, chv);
+    order.append(oldpwd).padTo(8).append(newpwd).padTo(16);
+    return send_check(order, 0x9000);
   }
 
-  string decodeISDN(string raw) {
+  string decodeISDN(ByteView raw) {
+    if (raw.size < 14)
+      return "";
+
     // ISDN is in last 14 bytes
-    string isdn=raw.substr(raw.size()-14);
-    char isdnLength=isdn[0];
+    ByteView isdn=raw.sub(raw.size-14);
+    uint8_t isdnLength=isdn[0];
     //char TON=isdn[1]; // should be 0x81
     // two last bytes should be FF (capability , extensions)
-    return bcdToAscii(isdn.substr(2,isdnLength));
+    return bcdToAscii(isdn.sub(2,isdnLength));
   }
 
   vector<string> encodeISDN(string isdn, int recordLenght) {
-    vector<string> encoded;
-    encoded.push_back("");
-
-    for (int i=0; i < recordLenght-14 ; i++)
-      encoded[0]+='\xff';
-
-    encoded[0]+=makeBcd(isdn).size();
+    vector<string> encoded(1, string(max(recordLenght-14, 0), '\xff'));
+    string bcd=makeBcd(isdn);
+    encoded[0]+=bcd.size();
     encoded[0]+='\x81'; //add TON field
-    encoded[0]+=makeBcd(isdn);
+    encoded[0]+=bcd;
 
-    for (int i=encoded.size(); i<recordLenght; i++)
-      encoded[0]+='\xff';
+    // capability and extension identifiers: none
+    if ((int)encoded[0].size() < recordLenght)
+      encoded[0].append(recordLenght - encoded[0].size(), '\xff');
 
     return encoded;
   }
 
-  string decodeIMSI(string raw) {
+  string decodeIMSI(ByteView raw) {
     //int l=raw.c_str()[0];
-    string imsi=bcdToAscii(raw.substr(1)); // First byte is length
+    string imsi=bcdToAscii(raw.sub(1)); // First byte is length
     //IMSI length bytes, then parity is second byte
-    return imsi.substr(1);
+    return imsi.size() > 0 ? imsi.substr(1) : "";
   }
 
   string encodeMccMnc(string Mcc, string Mnc, int len=0) {
@@ -459,12 +888,174 @@ class UICC {
   }
 
   bool debug=false;
+  // Status word that ended the last card answer
+  uint16_t lastSW=0;
+
+  // Payloads of the UPDATE BINARY/UPDATE RECORD commands accepted by the card
+  // in this session, in write order, so they can be read back and compared
+  struct fileUpdate {
+    string name;
+    bool records;
+    vector<string> content;
+  };
+  vector<fileUpdate> updates;
+  // Files written in a previous session (see journal.h), writeFile() skips them
+  set<string> alreadyUpdated;
+  // Called when all the content of a file is accepted by the card
+  function<void(const string &)> onUpdate;
+
+  // Before a new attempt after a card reset: writeFile() skips the files
+  // completed so far, a file interrupted between two records is written
+  // again from its first record
+  void keepCompletedUpdates() {
+    alreadyUpdated.insert(completed.begin(), completed.end());
+    updates.erase(remove_if(updates.begin(), updates.end(), [this](const fileUpdate &u) {
+      return completed.count(u.name) == 0;
+    }), updates.end());
+  }
+
+ protected:
+  // Drop what we know about the card state, as a reset occured
+  virtual void sessionReset() {}
+
+  void recordUpdate(string name, bool records, string payload) {
+    if (updates.size() == 0 || updates.back().name != name) {
+      fileUpdate u;
+      u.name=name;
+      u.records=records;
+      updates.push_back(u);
+    }
+
+    updates.back().content.push_back(payload);
+  }
+
+  void updateDone(string name) {
+    completed.insert(name);
+
+    if (onUpdate)
+      onUpdate(name);
+  }
+
+  void checkCapacity(const string &filename, size_t need, size_t capacity) {
+    if (need > capacity)
+      throw UICCError(UICCError::badRequest,
+                      stringPrintf("%s is %zu bytes, the buffer %zu", filename.c_str(), need, capacity));
+  }
+
+  // For the readFile() that return strings: one buffer for the session
+  uint8_t *fileBuffer() {
+    if (fileBuf.size() == 0)
+      fileBuf.resize(maxFileBytes);
+
+    return fileBuf.data();
+  }
+
+  static vector<string> splitRecords(const fileSpan &f) {
+    vector<string> content;
+    content.reserve(f.records);
+
+    for (size_t i=0; i < f.records; i++)
+      content.push_back(f.record(i).str());
+
+    return content;
+  }
+
+  // Wait until the card sends something, false after timeoutMs
+  bool waitAnswer(int timeoutMs) {
+    struct pollfd p= {fd, POLLIN, 0};
+    int ret;
+
+    while ((ret=poll(&p, 1, timeoutMs)) < 0 && errno == EINTR);
+
+    return ret > 0;
+  }
 
  private:
+  // Files all the content of which was accepted in this session
+  set<string> completed;
+  vector<uint8_t> fileBuf;
+
+  // UICC have only one wire for Tx and Rx,
+  // so over a RS232 we always receive back what we send
+  void sendByte(char c) {
+    if (::write(fd, &c, 1) != 1)
+      throw UICCError(UICCError::cardRemoved,
+                      stringPrintf("Error from write: %s", strerror(errno)));
+
+    readByte();
+  }
+
+  uint8_t readByte() {
+    uint8_t c;
+    int ret;
+
+    while ((ret=::read(fd, &c, 1)) < 0 && errno == EINTR);
+
+    if (ret < 0)
+      throw UICCError(UICCError::cardRemoved,
+                      stringPrintf("Error from read: %s", strerror(errno)));
 
+    if (ret == 0)
+      throw UICCError(UICCError::timeout, "No answer from the UICC");
+
+    return c;
+  }
+
+  string port;
   int fd=-1;
 };
 
+// Path from the MF of the files of the SIM class, by name
+// reverse: the name of a file identifier (two last bytes of the path)
+static inline string simFilePath(string name, bool reverse=false) {
+  static const map<string,string> UICCFiles = {
+    {"EFDIR", string(u8"\x2f\x00",2)},
+    {"ICCID", string(u8"\x2f\xe2",2)},
+    {"GR type",   string(u8"\xa0\x00",2)},
+    {"Extended language preference", string(u8"\x2f\x05",2)},
+    {"language preference", string(u8"\x7f\x20\x6f\x05",4)},
+    {"IMSI", string(u8"\x7f\x20\x6f\x07",4)},
+    {"Access control class", string(u8"\x7f\x20\x6f\x78",4)},
+    {"Location information", string(u8"\x7f\x20\x6f\x7e",4)},
+    {"Administrative data", string(u8"\x7f\x20\x6f\xad",4)},
+    {"Service Provider Name", string(u8"\x7f\x20\x6f\x46",4)},
+    {"PLMN selector", string(u8"\x7f\x20\x6f\x30",4)},
+    {"Higher Priority PLMN search period", string(u8"\x7f\x20\x6f\x31",4)},
+    {"Forbidden PLMN", string(u8"\x7f\x20\x6f\x7b",4)},
+    {"Equivalent home PLMN", string(u8"\x7f\x20\x6f\xd9",4)},
+    {"Group Identifier Level 1", string(u8"\x7f\x20\x6f\x3e",4)},
+    {"Group Identifier Level 2", string(u8"\x7f\x20\x6f\x3f",4)},
+    {"emergency call codes",  string(u8"\x7f\x20\x6f\xb7",4)},
+    {"SIM service table", string(u8"\x7f\x20\x6f\x38",4)},
+    {"ACM maximum value", string(u8"\x7f\x20\x6f\x37",4)},
+    {"Accumulated call meter", string(u8"\x7f\x20\x6f\x39",4)},
+    {"Phase identification", string(u8"\x7f\x20\x6f\xae",4)},
+    {"HPLMN Selector with Access Technology", string(u8"\x7f\x20\x6f\x62",4)},
+    {"MSISDN", string(u8"\x7f\x10\x6f\x40",4)},
+    {"SMSC", string(u8"\x7f\x10\x6f\x42",4)},
+    {"GR OPc", string(u8"\x7f\xf0\xff\x01",4)},
+    {"GR Ki",  string(u8"\x7f\xf0\xff\x02",4)},
+    {"GR R",   string(u8"\x7f\xf0\xff\x03",4)},
+    {"GR C",   string(u8"\x7f\xf0\xff\x04",4)},
+    {"GR secret",   string(u8"\x7f\x20\x00\x01",4)},
+  };
+
+  if (!reverse ) {
+    auto it=UICCFiles.find(name);
+    if ( it == UICCFiles.end() )
+      throw UICCError(UICCError::badRequest,
+                      stringPrintf("try to access not defined file: %s", name.c_str()));
+
+    return(it->second);
+  } else {
+    for (auto it = UICCFiles.begin(); it != UICCFiles.end(); ++it )
+      if (it->second.substr(it->second.size()-2) == name)
+        return it->first;
+
+    return "Not existing";
+  }
+}
+
 class SIM: public UICC {
  private:
 
@@ -481,61 +1072,25 @@ class SIM: public UICC {
     uint8_t record_length;   // provided only for linear and cyclic files
   } __attribute__ ((packed)) GSMfileChar_t;
   GSMfileChar_t curFile;
+  // GET RESPONSE answers already received, by file name
+  map<string, GSMfileChar_t> fileInfoCache;
 
-  string UICCFile(string name, bool reverse=false) {
-    static const map<string,string> UICCFiles = {
-      {"EFDIR", string(u8"\x2f\x00",2)},
-      {"ICCID", string(u8"\x2f\xe2",2)},
-      {"GR type",   string(u8"\xa0\x00",2)},
-      {"Extended language preference", string(u8"\x2f\x05",2)},
-      {"language preference", string(u8"\x7f\x20\x6f\x05",4)},
-      {"IMSI", string(u8"\x7f\x20\x6f\x07",4)},
-      {"Access control class", string(u8"\x7f\x20\x6f\x78",4)},
-      {"Location information", string(u8"\x7f\x20\x6f\x7e",4)},
-      {"Administrative data", string(u8"\x7f\x20\x6f\xad",4)},
-      {"Service Provider Name", string(u8"\x7f\x20\x6f\x46",4)},
-      {"PLMN selector", string(u8"\x7f\x20\x6f\x30",4)},
-      {"Higher Priority PLMN search period", string(u8"\x7f\x20\x6f\x31",4)},
-      {"Forbidden PLMN", string(u8"\x7f\x20\x6f\x7b",4)},
-      {"Equivalent home PLMN", string(u8"\x7f\x20\x6f\xd9",4)},
-      {"Group Identifier Level 1", string(u8"\x7f\x20\x6f\x3e",4)},
-      {"Group Identifier Level 2", string(u8"\x7f\x20\x6f\x3f",4)},
-      {"emergency call codes",  string(u8"\x7f\x20\x6f\xb7",4)},
-      {"SIM service table", string(u8"\x7f\x20\x6f\x38",4)},
-      {"ACM maximum value", string(u8"\x7f\x20\x6f\x37",4)},
-      {"Accumulated call meter", string(u8"\x7f\x20\x6f\x39",4)},
-      {"Phase identification", string(u8"\x7f\x20\x6f\xae",4)},
-      {"HPLMN Selector with Access Technology", string(u8"\x7f\x20\x6f\x62",4)},
-      {"MSISDN", string(u8"\x7f\x10\x6f\x40",4)},
-      {"SMSC", string(u8"\x7f\x10\x6f\x42",4)},
-      {"GR OPc", string(u8"\x7f\xf0\xff\x01",4)},
-      {"GR Ki",  string(u8"\x7f\xf0\xff\x02",4)},
-      {"GR R",   string(u8"\x7f\xf0\xff\x03",4)},
-      {"GR C",   string(u8"\x7f\xf0\xff\x04",4)},
-      {"GR secret",   string(u8"\x7f\x20\x00\x01",4)},
-    };
-
-    if (!reverse ) {
-      auto it=UICCFiles.find(name);
-      Assert( it != UICCFiles.end(),   "try to access not defined file: %s", name.c_str());
-      return(it->second);
-    } else {
-      for (auto it = UICCFiles.begin(); it != UICCFiles.end(); ++it )
-        if (it->second.substr(it->second.size()-2) == name)
-          return it->first;
+  void sessionReset() {
+    fileInfoCache.clear();
+  }
 
-      return "Not existing";
-    }
+  string UICCFile(string name, bool reverse=false) {
+    return simFilePath(name, reverse);
   }
 
  public:
   bool readFileInfo() {
-    string order(u8"\xa0\xc0\x00\x00\x0f",5);
-    string good(u8"\x90\x00",2);
+    Apdu order(0xa0, 0xc0);
+    order.le(sizeof(curFile));
     write(order);
-    string values=read();
-    memcpy(&curFile,values.c_str(),
-           min(values.size(),sizeof(curFile)) );
+    ApduResponse values;
+    read(values, sizeof(curFile)+2);
+    memcpy(&curFile, values.data(), min(values.dataSize(), sizeof(curFile)));
 
     if (debug) {
       static map<char, string> FileType= {{'\x01',"Master dir"}, {'\x02',"Sub dir"},{'\x04',"Element File"},};
@@ -559,71 +1114,112 @@ class SIM: public UICC {
         printf("\n");
     }
 
-    return values.substr(values.size()-2) == good;
+    return values.sw() == 0x9000;
   }
 
   bool openFile(string filename) {
-    string order(u8"\xa0\xa4\x00\x00\x02",5);
     // go to root directory (MF)
-    string goToRoot (u8"\x3f\x00",2);
-    string answerChangeDir(u8"\x9f\x17",2);
+    static const uint8_t goToRoot[2]= {0x3f, 0x00};
+    const uint16_t answerChangeDir=0x9f17;
 
-    if (!send_check(order+goToRoot, answerChangeDir))
+    if (!send_check(Apdu(0xa0, 0xa4).append(goToRoot, 2), answerChangeDir))
       return false;
 
-    string answer(u8"\x9f\x0f",2);
     string filenameBin=UICCFile(filename);
 
     for (size_t i=0; i<filenameBin.size()-2; i+=2)
-      if (!send_check(order+filenameBin.substr(i,2), answerChangeDir))
+      if (!send_check(Apdu(0xa0, 0xa4).append(filenameBin.c_str()+i, 2), answerChangeDir))
         return false;
 
-    if (! send_check(order+filenameBin.substr(filenameBin.size()-2), answer))
+    if (! send_check(Apdu(0xa0, 0xa4).append(filenameBin.c_str()+filenameBin.size()-2, 2),
+                     0x9f0f))
+      return false;
+
+    auto cached=fileInfoCache.find(filename);
+
+    if (cached != fileInfoCache.end()) {
+      // The card answer will not change in this session: skip GET RESPONSE
+      // 9f0f means 15 bytes are waiting, drop them with the next command
+      curFile=cached->second;
+      return true;
+    }
+
+    if (!readFileInfo())
       return false;
 
-    return readFileInfo();
+    fileInfoCache[filename]=curFile;
+    return true;
   }
 
   vector<string> readFile(string filename) {
-    vector<string> content;
+    return splitRecords(readFile(filename, fileBuffer(), maxFileBytes));
+  }
+
+  // The file in buf, capacity bytes at most: a transparent file, or the
+  // records first to first+count-1 (count < 0: to the last one).
+  // Records stop at the first the card refuses
+  fileSpan readFile(string filename, uint8_t *buf, size_t capacity, int first=1, int count=-1) {
+    fileSpan f;
+    f.data=buf;
 
     if (!openFile(filename))
-      return content;
+      return f;
 
     uint16_t size=ntohs(curFile.size);
 
-    if (ntohs(curFile.structure)==0) { // binary (flat)
-      Assert(size <= 256, "Not developped: read binary files > 256 bytes (%hu)", size);
-      string command(u8"\xa0\xb0\x00\x00",4);
-      string good(u8"\x90\x00",2);
-      char s=size&0xFF;
-      command+=string(&s,1);
-      write(command);
-      string answ=read(size+good.size());
+    if (curFile.structure==0) { // binary (flat)
+      if (size > 256)
+        throw UICCError(UICCError::badRequest,
+                        stringPrintf("Not developped: read binary files > 256 bytes (%hu)", size));
 
-      if ( answ.size()==(size_t)size+2 &&
-           answ.substr(answ.size()-2) == good )
-        content.push_back(answ.substr(0,answ.size()-2));
+      checkCapacity(filename, size, capacity);
+      Apdu command(0xa0, 0xb0);
+      command.le(size);
+      write(command);
+      ApduResponse answ;
+      read(answ, size+2);
 
-      return content;
-    } else { // records
-      for (int i=0; i < size/curFile.record_length; i++ ) {
-        string command(u8"\xa0\xb2\x00\x02",4);
-        string good(u8"\x90\x00",2);
-        command+=string((char *)&curFile.record_length,1);
-        write(command);
-        string answ=read(size+good.size());
-
-        if ( answ.size()==(size_t)curFile.record_length+good.size() &&
-             answ.substr(answ.size()-2) == good )
-          content.push_back(answ.substr(0,answ.size()-good.size()));
+      if (answ.ok(size)) {
+        memcpy(buf, answ.data(), size);
+        f.stride=size;
+        f.records=1;
       }
 
-      return content;
+      return f;
+    }
+
+    // records
+    if (curFile.record_length == 0)
+      return f;
+
+    int last=size/curFile.record_length;
+
+    if (count >= 0)
+      last=min(last, first+count-1);
+
+    f.stride=curFile.record_length;
+    checkCapacity(filename, max(last-first+1, 0)*f.stride, capacity);
+    ApduResponse answ;
+
+    for (int i=first; i <= last; i++ ) {
+      // record i, absolute mode (P2=04)
+      write(Apdu(0xa0, 0xb2, i, 0x04).le(f.stride));
+      read(answ, f.stride+2);
+
+      if (!answ.ok(f.stride))
+        break;
+
+      memcpy(buf+f.size(), answ.data(), f.stride);
+      f.records++;
     }
+
+    return f;
   }
 
   bool writeFile(string filename, vector<string> content, bool fillIt=false,  bool records=false) {
+    if (alreadyUpdated.count(filename))
+      return true;
+
     if (!openFile(filename))
       return false;
 
@@ -631,48 +1227,35 @@ class SIM: public UICC {
     uint16_t fileSize=ntohs(curFile.size);
 
     if (curFile.structure==0 && records==false) { // binary (flat)
-      Assert(size <= 256, "Not developped: write binary files > 256 bytes");
-      string command(u8"\xa0\xd6\x00\x00",4);
-      string good(u8"\x90\x00",2);
-
-      if (fillIt)
-        command+=( unsigned char)fileSize;
-      else
-        command+=size;
+      if (size > 256)
+        throw UICCError(UICCError::badRequest, "Not developped: write binary files > 256 bytes");
 
-      command+=content[0];
+      Apdu command(0xa0, 0xd6);
+      command.append(content[0]);
 
       if (fillIt)
-        for (int j=size; j < fileSize; j++)
-          command+=u8"\xff";
-
-      write(command);
-      string answ=read(good.size());
+        command.padTo(fileSize);
 
-      if (answ == good)
-        return true;
-      else
+      if (!sendOk(command))
         return false;
+
+      recordUpdate(filename, false, string((const char *)command.data(), command.dataSize()));
+      updateDone(filename);
+      return true;
     } else { // records
       for (size_t i=0; i < content.size(); i++ ) {
-        string command(u8"\xa0\xdc",2);
-        string good(u8"\x90\x00",2);
-        command+=(unsigned char) i+1;
-        command+='\x04';
-        command+=curFile.record_length; //record lenght;
-        command+=content[i];
-
-        for (int j=content[i].size(); j< curFile.record_length ; j++)
-          command+=u8"\xff";
-
-        write(command);
-        string answ=read(good.size());
+        // record i+1, absolute mode (P2=04)
+        Apdu command(0xa0, 0xdc, i+1, 0x04);
+        command.append(content[i]).padTo(curFile.record_length);
 
-        if ( answ != good )
+        if (!sendOk(command))
           return false;
+
+        recordUpdate(filename, true, string((const char *)command.data(), command.dataSize()));
       }
     }
 
+    updateDone(filename);
     return true;
   }
 
@@ -691,206 +1274,323 @@ class SIM: public UICC {
 
 };
 
-class USIM: public UICC {
- private:
-  string UICCFile(string name) {
-    static const map<string,string> UICCFiles = {
-      {"EFDIR", string(u8"\x2f\x00",2)},
-      {"ICCID", string(u8"\x2f\xe2",2)},
-      {"Extended language preference", string(u8"\x2f\x05",2)},
-      {"language preference", string(u8"\x7f\x20\x6f\x05",4)},
-      {"SMSC", string(u8"\x7f\x10\x6f\x42",4)},
-      {"IMSI", string(u8"\x7f\xf0\x6f\x07",4)},
-      {"Access control class", string(u8"\x7f\xf0\x6f\x78",4)},
-      {"PS Location information", string(u8"\x7f\xf0\x6f\x73",4)},
-      {"CS Location information", string(u8"\x7f\xf0\x6f\x7e",4)},
-      {"Administrative data", string(u8"\x7f\xf0\x6f\xad",4)},
-      {"PLMN selector with Access Technology", string(u8"\x7f\xf0\x6f\x60",4)},
-      {"Operator controlled PLMN selector with Access Technology", string(u8"\x7f\xf0\x6f\x61",4)},
-      {"Home PLMN selector with Access Technology", string(u8"\x7f\xf0\x6f\x62",4)},
-      {"Forbidden PLMNs", string(u8"\x7f\xf0\x6f\x7b",4)},
-      {"Higher Priority PLMN search period", string(u8"\x7f\xf0\x6f\x31",4)},
-      {"Equivalent Home PLMN", string(u8"\x7f\xf0\x6f\xd9",4)},
-      {"Group Identifier Level 1", string(u8"\x7f\xf0\x6f\x3e",4)},
-      {"Group Identifier Level 2", string(u8"\x7f\xf0\x6f\x3f",4)},
-      {"emergency call codes",  string(u8"\x7f\xf0\x6f\xb7",4)},
-      {"Short Message Service Parameters", string(u8"\x7f\xf0\x6f\x42",4)},
-      {"Service Provider Name", string(u8"\x7f\xf0\x6f\x46",4)},
-      {"EPS LOCation Information", string(u8"\x7f\xf0\x6f\xe3",4)},
-      {"EPS NAS Security Contex", string(u8"\x7f\xf0\x6f\xe4",4)},
-      {"MSISDN", string(u8"\x7f\xf0\x6f\x40",4)},
-      {"USIM service table", string(u8"\x7f\xf0\x6f\x38",4)},
-      {"GR OPc", string(u8"\x7f\xf0\xff\x01",4)},
-      {"GR Ki",  string(u8"\x7f\xf0\xff\x02",4)},
-      {"GR R",   string(u8"\x7f\xf0\xff\x03",4)},
-      {"GR C",   string(u8"\x7f\xf0\xff\x04",4)},
-      {"GR secret",   string(u8"\x7f\x20\x00\x01",4)},
-    };
-    auto it=UICCFiles.find(name);
-    Assert( it != UICCFiles.end(),   "try to access not defined file: %s", name.c_str());
-    return(it->second);
-  }
-  string fileInfo;
-  string fileDesc;
-  int fileSize;
+// Path from the MF of the USIM files, by name
+static inline string usimFilePath(string name) {
+  static const map<string,string> UICCFiles = {
+    {"EFDIR", string(u8"\x2f\x00",2)},
+    {"ICCID", string(u8"\x2f\xe2",2)},
+    {"Extended language preference", string(u8"\x2f\x05",2)},
+    {"language preference", string(u8"\x7f\x20\x6f\x05",4)},
+    {"SMSC", string(u8"\x7f\x10\x6f\x42",4)},
+    {"IMSI", string(u8"\x7f\xf0\x6f\x07",4)},
+    {"Access control class", string(u8"\x7f\xf0\x6f\x78",4)},
+    {"PS Location information", string(u8"\x7f\xf0\x6f\x73",4)},
+    {"CS Location information", string(u8"\x7f\xf0\x6f\x7e",4)},
+    {"Administrative data", string(u8"\x7f\xf0\x6f\xad",4)},
+    {"PLMN selector with Access Technology", string(u8"\x7f\xf0\x6f\x60",4)},
+    {"Operator controlled PLMN selector with Access Technology", string(u8"\x7f\xf0\x6f\x61",4)},
+    {"Home PLMN selector with Access Technology", string(u8"\x7f\xf0\x6f\x62",4)},
+    {"Forbidden PLMNs", string(u8"\x7f\xf0\x6f\x7b",4)},
+    {"Higher Priority PLMN search period", string(u8"\x7f\xf0\x6f\x31",4)},
+    {"Equivalent Home PLMN", string(u8"\x7f\xf0\x6f\xd9",4)},
+    {"Group Identifier Level 1", string(u8"\x7f\xf0\x6f\x3e",4)},
+    {"Group Identifier Level 2", string(u8"\x7f\xf0\x6f\x3f",4)},
+    {"emergency call codes",  string(u8"\x7f\xf0\x6f\xb7",4)},
+    {"Short Message Service Parameters", string(u8"\x7f\xf0\x6f\x42",4)},
+    {"Service Provider Name", string(u8"\x7f\xf0\x6f\x46",4)},
+    {"EPS LOCation Information", string(u8"\x7f\xf0\x6f\xe3",4)},
+    {"EPS NAS Security Contex", string(u8"\x7f\xf0\x6f\xe4",4)},
+    {"MSISDN", string(u8"\x7f\xf0\x6f\x40",4)},
+    {"USIM service table", string(u8"\x7f\xf0\x6f\x38",4)},
+    {"GR OPc", string(u8"\x7f\xf0\xff\x01",4)},
+    {"GR Ki",  string(u8"\x7f\xf0\xff\x02",4)},
+    {"GR R",   string(u8"\x7f\xf0\xff\x03",4)},
+    {"GR C",   string(u8"\x7f\xf0\xff\x04",4)},
+    {"GR secret",   string(u8"\x7f\x20\x00\x01",4)},
+  };
+  auto it=UICCFiles.find(name);
+  if ( it == UICCFiles.end() )
+    throw UICCError(UICCError::badRequest,
+                    stringPrintf("try to access not defined file: %s", name.c_str()));
+
+  return(it->second);
+}
 
+/*
+  The USIM file handling of USIM and of the awaitable UsimSession, that
+  only differ by the way they send the commands: the FCP of the files
+  selected in the session (select cache), the current DF to know when a
+  file can be read by its SFI without SELECT, and the commands on the
+  selected file.
+*/
+class UsimFiles {
  public:
-  bool readFileInfo(string size) {
-    string order(u8"\x00\xc0\x00\x00",4);
-    order+=size;
-    string good(u8"\x90\x00",2);
-    write(order);
-    string values=read(size[0] +good.size());
+  struct fileControl {
+    string fileDesc;
+    int fileSize=0;
+    string dir; // parent DF path, as in usimFilePath()
+    int sfi=-1; // short file identifier, -1 if the card didn't give one
+  };
+  // The file last selected or read by its SFI
+  fileControl current;
+  // Path of the current DF, "ADF" in the USIM application
+  string currentDir;
+
+  void clear() {
+    cache.clear();
+    current=fileControl();
+    currentDir="";
+  }
 
-    if ( values[0] != '\x62' || values.substr(values.size()-2) != good)
+  bool cached(const string &filename) const {
+    return cache.count(filename) > 0;
+  }
+
+  // SELECT by path: the card answers 61xx, xx bytes of FCP wait for GET
+  // RESPONSE, or only 9000 when we already have the FCP (P2=0C)
+  static Apdu select(const string &path, bool fcp) {
+    return Apdu(0x00, 0xa4, 0x08, fcp ? 0x04 : 0x0c).append(path);
+  }
+
+  static Apdu getResponse(uint8_t size) {
+    return Apdu(0x00, 0xc0).le(size);
+  }
+
+  // The cached file was selected again
+  void useCached(const string &filename) {
+    current=cache.at(filename);
+    currentDir=current.dir;
+  }
+
+  // The GET RESPONSE answer after the SELECT of filename: the file is
+  // the current one, cached for the next selects
+  bool addFcp(const string &filename, const string &path, ByteView answer, uint16_t sw) {
+    if (answer.size == 0 || answer[0] != 0x62 || sw != 0x9000)
       return false;
 
-    fileInfo=extractTLV(values, "FCP Template");
-    fileDesc=extractTLV(fileInfo, "File Descriptor");
+    fileControl fc;
+    string fileInfo=extractTLV(answer, "FCP Template");
+    fc.fileDesc=extractTLV(fileInfo, "File Descriptor");
     string fileSizeString=extractTLV(fileInfo, "File Size - Data");
-    fileSize=0;
 
     for (size_t i=0; i<fileSizeString.size(); i++)
-      fileSize=fileSize*256+(unsigned char)fileSizeString[i];
-
+      fc.fileSize=fc.fileSize*256+(unsigned char)fileSizeString[i];
+
+    fc.dir=path.substr(0, path.size()-2);
+    // ETSI TS 102 221, 11.1.1.4.8: SFI is in the 5 most significant bits
+    string sfi=extractTLV(fileInfo, "SFI");
+    fc.sfi= sfi.size()==1 && sfi[0] != 0 ? (unsigned char)sfi[0]>>3 : -1;
+    cache[filename]=fc;
+    current=fc;
+    currentDir=fc.dir;
     return true;
   }
 
+  // The SFI when the file is cached, has one and is in the current DF:
+  // the READ command selects it, no SELECT needed. -1 otherwise
+  int useSfi(const string &filename) {
+    auto cached=cache.find(filename);
+
+    if (cached == cache.end() || cached->second.sfi < 0 || cached->second.dir != currentDir)
+      return -1;
+
+    current=cached->second;
+    return current.sfi;
+  }
+
+  bool transparent() const {
+    return current.fileDesc.size() <= 2;
+  }
+
+  long transparentSize() const {
+    if (current.fileSize >= 32767)
+      throw UICCError(UICCError::badRequest, "Not developped: read files >= 32767 bytes");
+
+    return current.fileSize;
+  }
+
+  // File descriptor of a records set file, 5 bytes:
+  // file type is byte 0
+  // byte 1 is useless: always 0x21
+  // bytes 3 and 4: record length
+  // (byte 3 should be 00 according to ETSI 102 221)
+  // byte 5: number of records
+  int recordLength() const {
+    return current.fileDesc.size() >= 4 ? (unsigned char)current.fileDesc[3] : 0;
+  }
+
+  // The last record to read from first, count records (count < 0: to the
+  // last one). None when the descriptor doesn't give the number of records
+  int lastRecord(int first, int count) const {
+    if (current.fileDesc.size() < 5)
+      return first-1;
+
+    int last=(unsigned char)current.fileDesc[4];
+
+    if (count >= 0)
+      last=min(last, first+count-1);
+
+    return last;
+  }
+
+  // Reads of the current file, or of the file sfi (in P1 at offset 0)
+  static Apdu readBinary(long offset, uint8_t size, int sfi) {
+    return Apdu(0x00, 0xb0, sfi >= 0 && offset == 0 ? 0x80 | sfi : offset>>8, offset&0xFF).le(size);
+  }
+
+  static Apdu readRecord(int record, uint8_t size, int sfi) {
+    // absolute mode (P2=04)
+    return Apdu(0x00, 0xb2, record, sfi >= 0 ? sfi<<3 | 4 : 4).le(size);
+  }
+
+  // fillIt pads the data with FF to the file size
+  Apdu updateBinary(const string &data, bool fillIt) const {
+    if (data.size() > 256)
+      throw UICCError(UICCError::badRequest, "Not developped: write binary files > 256 bytes");
+
+    Apdu command(0x00, 0xd6);
+    command.append(data);
+
+    if (fillIt)
+      command.padTo((unsigned char)current.fileSize);
+
+    return command;
+  }
+
+  // Always padded with FF to the record length
+  Apdu updateRecord(int record, const string &data) const {
+    Apdu command(0x00, 0xdc, record, 0x04);
+    command.append(data).padTo(recordLength());
+    return command;
+  }
+
+ private:
+  map<string, fileControl> cache;
+};
+
+class USIM: public UICC {
+ private:
+  string UICCFile(string name) {
+    return usimFilePath(name);
+  }
+  // Select cache, current file and DF
+  UsimFiles files;
+
+  void sessionReset() {
+    files.clear();
+  }
+
+ public:
   bool openFile(string filename) {
-    string order(u8"\x00\xa4\x08\x04",4);
-    string answer(u8"\x61",1);
     string filenameBin=UICCFile(filename);
 
-    if (! send_check(order+(char)(filenameBin.size())+filenameBin, answer))
-      return false;
+    if (files.cached(filename)) {
+      // We already have the FCP: save the GET RESPONSE round trip
+      if (! send_check(UsimFiles::select(filenameBin, false), 0x9000))
+        return false;
+
+      files.useCached(filename);
+      return true;
+    }
 
-    string size=read(1);
+    write(UsimFiles::select(filenameBin, true));
+    uint8_t answer[2];
 
-    if (size.size() !=1)
+    if (read(answer, 2) != 2 || answer[0] != 0x61) {
+      printf("BAD return code\n");
+      dump_hex("Expected: ", "\x61");
+      dump_hex("got answer: ", string((char *)answer, 2));
       return false;
+    }
 
-    return readFileInfo(size);
+    uint8_t size=answer[1];
+    write(UsimFiles::getResponse(size));
+    ApduResponse answ;
+    read(answ, size+2);
+    return files.addFcp(filename, filenameBin, ByteView(answ.data(), answ.dataSize()), answ.sw());
   }
 
   vector<string> readFile(string filename) {
-    vector<string> content;
+    return splitRecords(readFile(filename, fileBuffer(), maxFileBytes));
+  }
 
-    if (!openFile(filename))
-      return content;
-
-    if (fileDesc.size() <= 2 ) { // this is a plain file
-      long size=fileSize;
-      string fullanswr="";
-      Assert( size < 32767, "Not developped");
-      long alreadyRead=0;
-
-      while (size > 0 ) {
-        string command(u8"\x00\xb0",2);
-        string good(u8"\x90\x00",2);
-        unsigned char s;
-
-        if (size > 255)
-          s=255;
-        else
-          s=size;
-
-        unsigned char P1=alreadyRead>>8;
-        unsigned char P2=alreadyRead&0xFF;
-        command+=string((char *)&P1,1);
-        command+=string((char *)&P2,1);
-        command+=string((char *)&s,1);
-        write(command);
-        string answ=read(s+2);
-
-        if ( answ.size()==(size_t)s+good.size() &&
-             answ.substr(answ.size()-good.size()) == good )
-          fullanswr+=answ.substr(0,answ.size()-good.size());
-
-        size-=s;
-        alreadyRead+=s;
-      }
+  // The file in buf, capacity bytes at most: a transparent file, or the
+  // records first to first+count-1 (count < 0: to the last one).
+  // Records stop at the first the card refuses
+  fileSpan readFile(string filename, uint8_t *buf, size_t capacity, int first=1, int count=-1) {
+    fileSpan f;
+    f.data=buf;
+    int sfi=files.useSfi(filename);
 
-      content.push_back(fullanswr);
-      return content;
-    } else {
-      // This is a records set file
-      // records
-      // string len must be 5 bytes
-      // file type is byte 0
-      // byte 1 is useless: always 0x21
-      // bytes 3 and 4: record length
-      // (byte 3 should be 00 according to ETSI 102 221)
-      // byte 5: number of records
-      for (int i=0; i < (unsigned char)fileDesc[4] ; i++ ) {
-        string command(u8"\x00\xb2\x01\x04",4);
-        string good(u8"\x90\x00",2);
-        command+=fileDesc.substr(3,1);
-        write(command);
-        string answ=read( (unsigned char)fileDesc[3]+2);
-
-        if ( answ.size()== ((unsigned char)fileDesc[3]+good.size()) &&
-             answ.substr(answ.size()-good.size()) == good )
-          content.push_back(answ.substr(0,answ.size()-good.size()));
+    if (sfi < 0 && !openFile(filename))
+      return f;
+
+    ApduResponse answ;
+
+    if (files.transparent()) {
+      long size=files.transparentSize();
+      checkCapacity(filename, size, capacity);
+
+      for (long alreadyRead=0; alreadyRead < size; ) {
+        unsigned char s=min(size - alreadyRead, 255L);
+        write(UsimFiles::readBinary(alreadyRead, s, sfi));
+        read(answ, s+2);
+
+        if (!answ.ok(s))
+          return f;
+
+        memcpy(buf+alreadyRead, answ.data(), s);
+        alreadyRead+=s;
       }
 
-      return content;
+      f.stride=size;
+      f.records=1;
+      return f;
     }
-  }
 
-  bool writeFile(string filename, vector<string> content, bool fillIt=false, bool records=false) {
-    if (!openFile(filename))
-      return false;
+    int last=files.lastRecord(first, count);
+    f.stride=files.recordLength();
+    checkCapacity(filename, max(last-first+1, 0)*f.stride, capacity);
 
-    int size=content[0].size();
+    for (int i=first; i <= last; i++ ) {
+      write(UsimFiles::readRecord(i, f.stride, sfi));
+      read(answ, f.stride+2);
 
-    if (fileDesc.size() <= 2) { // binary (flat)
-      Assert(size <= 256, "Not developped: write binary files > 256 bytes");
-      string command(u8"\x00\xd6\x00\x00",4);
-      string good(u8"\x90\x00",2);
-      unsigned char x=(char) size;
+      if (!answ.ok(f.stride))
+        break;
 
-      if (fillIt)
-        command+=(unsigned char)fileSize;
-      else
-        command+=x;
+      memcpy(buf+f.size(), answ.data(), f.stride);
+      f.records++;
+    }
 
-      command+=content[0];
+    return f;
+  }
 
-      if (fillIt)
-        for (int j=content[0].size();
-             j< (unsigned char) fileSize ;
-             j++)
-          command+=u8"\xff";
+  bool writeFile(string filename, vector<string> content, bool fillIt=false, bool records=false) {
+    if (alreadyUpdated.count(filename))
+      return true;
 
-      write(command);
-      string answ=read(good.size());
+    if (!openFile(filename))
+      return false;
+
+    if (files.transparent()) {
+      Apdu command=files.updateBinary(content[0], fillIt);
 
-      if (answ == good)
-        return true;
-      else
+      if (!sendOk(command))
         return false;
-    } else { // records
+
+      recordUpdate(filename, false, string((const char *)command.data(), command.dataSize()));
+    } else
       for (size_t i=0; i < content.size(); i++ ) {
-        string command(u8"\x00\xdc",2);
-        string good(u8"\x90\x00",2);
-        command+=(unsigned char) i+1;
-        command+='\x04';
-        command+=fileDesc.substr(3,1); //record lenght;
-        command+=content[i];
-
-        for (int j=content[i].size();
-             j< (unsigned char) fileDesc[3] ;
-             j++)
-          command+=u8"\xff";
-
-        write(command);
-        string answ=read(good.size());
-
-        if ( answ != good )
+        Apdu command=files.updateRecord(i+1, content[i]);
+
+        if (!sendOk(command))
           return false;
+
+        recordUpdate(filename, true, string((const char *)command.data(), command.dataSize()));
       }
-    }
 
+    updateDone(filename);
     return true;
   }
 
@@ -911,68 +1611,67 @@ class USIM: public UICC {
     //Instead of first AID, we should look for AID starting by: a000000087 (3GPP) 1002 (USIM)
     //dump_hex("AID", AID);
     //printf("card supplier id: %s\n", extractTLV(Appli, "Card").c_str());
-    string order(u8"\x00\xa4\x04\x0c",4);
-    order+=(char)AID.size();
-    order+=AID;
-    string answer (u8"\x90\x00",2);
-    return send_check(order, answer);
+    // The ADF is now the current DF, we don't know its path
+    files.currentDir="ADF";
+    return send_check(Apdu(0x00, 0xa4, 0x04, 0x0c).append(AID), 0x9000);
   }
 
   int fileRecordSize(string filename) {
     openFile(filename);
 
-    if (fileDesc.size() <= 2)
+    if (files.transparent())
       return -1;
 
-    return fileDesc[3];
+    return files.recordLength();
   }
 
   vector<string> authenticate(string rand, string autn) {
     vector<string> ret;
-    string order(u8"\x00\x88\x00\x81",4);
-    order+=(unsigned char) (rand.size()+autn.size()+2);
-    order+=(unsigned char) rand.size();
-    order+=rand;
-    order+=(unsigned char) autn.size();
-    order+=autn;
-    string answerKeys(u8"\x61",1);
-    string answerAUTS(u8"\x9f",1);
-    Assert(write(order)==(int)order.size(),"");
-    // Cards need CPU procesing, so delay to check Milenage
-    sleep(1);
-    string answer=read(1);
-
-    if ( answer != answerKeys && answer != answerAUTS) {
-      printf("Not possible answer to milenage challenge: %x\n", answer[0]);
+    Apdu order(0x00, 0x88, 0x00, 0x81);
+    order.append((uint8_t)rand.size()).append(rand);
+    order.append((uint8_t)autn.size()).append(autn);
+    write(order);
+    // Cards need CPU procesing to check Milenage: wait for the procedure
+    // byte, skipping the NULL ones the card sends to ask for more time
+    const int milenageTimeoutMs=2000;
+    uint8_t answer=0;
+
+    while (waitAnswer(milenageTimeoutMs) && read(&answer, 1) == 1 && answer == 0x60);
+
+    // 61xx: keys, 9fxx: AUTS (GSM class cards)
+    if ( answer != 0x61 && answer != 0x9f) {
+      printf("Not possible answer to milenage challenge: %x\n", answer);
       return ret;
     }
 
-    string size=read(1);
+    uint8_t size;
 
-    if (size.size() !=1) {
+    if (read(&size, 1) !=1) {
       printf("No answer to mileange challenge\n");
       return ret;
     }
 
-    string getData(u8"\x00\xc0\x00\x00",4);
-    getData+=size;
-    string good(u8"\x90\x00",2);
-    write(getData);
-    string values=read(size[0] + good.size());
+    write(Apdu(0x00, 0xc0).le(size));
+    ApduResponse answ;
+    read(answ, size+2);
 
-    if ( values.substr(values.size()-2) != good) {
+    if (answ.sw() != 0x9000 || answ.dataSize() == 0) {
       printf("Can't get APDU in return of millenage challenge\n");
       return ret;
     }
 
-    if (values[0] == '\xDC' ) // we have a AUTS answer encoded as len+val
-      ret.push_back(values.substr(2,values[1]));
+    const uint8_t *values=answ.data();
+    size_t end=answ.dataSize();
+
+    if (values[0] == 0xDC && end >= 2) // we have a AUTS answer encoded as len+val
+      ret.push_back(string((const char *)values+2, min((size_t)values[1], end-2)));
 
-    if (values[0] == '\xDB' ) { //we have the keys
+    if (values[0] == 0xDB ) { //we have the keys
       size_t pos=1;
 
-      while (pos < values.size()-2 ) {
-        ret.push_back(values.substr(pos+1,values[pos]));
+      while (pos < end ) {
+        size_t l=min((size_t)values[pos], end-pos-1);
+        ret.push_back(string((const char *)values+pos+1, l));
         pos+=values[pos]+1;
       }
     }
@@ -980,3 +1679,99 @@ class USIM: public UICC {
     return ret;
   }
 };
+
+// Compares a file read back with what we wrote in it ("got" is empty if
+// the file can't be read), one JSON line on "out"
+// Returns true if the file holds what we wrote
+static inline bool reportUpdate(const UICC::fileUpdate &u, const fileSpan &got,
+                                string app, uint16_t sw, FILE *out) {
+  string result="pass";
+  string expected, read;
+
+  if (got.records == 0)
+    result="unreadable";
+  else if (u.records) {
+    for (size_t i=0; i<u.content.size(); i++) {
+      ByteView r= i < got.records ? got.record(i) : ByteView();
+
+      if (!r.equals(u.content[i]) && result == "pass") {
+        result="fail";
+        expected=u.content[i];
+        read=r.str();
+      }
+    }
+  } else {
+    ByteView r=got.record(0).sub(0, u.content.back().size());
+
+    if (!r.equals(u.content.back())) {
+      result="fail";
+      expected=u.content.back();
+      read=r.str();
+    }
+  }
+
+  fprintf(out, "{\"app\":\"%s\",\"file\":\"%s\",\"result\":\"%s\"",
+          app.c_str(), u.name.c_str(), result.c_str());
+
+  if (result == "fail")
+    fprintf(out, ",\"expected\":\"%s\",\"read\":\"%s\"",
+            hexString(expected).c_str(), hexString(read).c_str());
+
+  if (result == "unreadable")
+    fprintf(out, ",\"sw\":\"%04x\"", sw);
+
+  fprintf(out, "}\n");
+  return result == "pass";
+}
+
+// Read back every file updated in this card session and compare it with
+// the bytes we sent, one JSON line per file on "out"
+// Returns true if all files hold what we wrote
+template <class CARD> bool verifyUpdates(CARD &card, string app, FILE *out=stdout) {
+  bool allGood=true;
+  // readFile() doesn't update anything, but let's not iterate on a moving vector
+  vector<UICC::fileUpdate> updates=card.updates;
+  vector<uint8_t> buf(maxFileBytes);
+
+  for (auto &u : updates) {
+    fileSpan got;
+
+    try {
+      got=card.readFile(u.name, buf.data(), buf.size());
+    } catch (UICCError &e) {
+      // Typically secret files, that can be written but never read
+      if (e.type != UICCError::statusWord)
+        throw;
+    }
+
+    if (!reportUpdate(u, got, app, card.lastSW, out))
+      allGood=false;
+  }
+
+  fflush(out);
+  return allGood;
+}
+
+// Run step() on the card. On errors the card may recover from, reset the
+// card and run step() again, at most "attempts" times in total.
+// The files already accepted by the card are not written again:
+// step() goes on from the last completed file.
+template <class F> auto withRetry(UICC &card, int attempts, F step) -> decltype(step()) {
+  for (int attempt=1; ; attempt++) {
+    try {
+      if (attempt > 1)
+        card.reset();
+
+      return step();
+    } catch (UICCError &e) {
+      if (!e.retryable() || attempt >= attempts)
+        throw;
+
+      fprintf(stderr, "%s: resetting the card (attempt %d of %d)\n",
+              e.what(), attempt+1, attempts);
+
+      card.keepCompletedUpdates();
+    }
+  }
+}
+#endif
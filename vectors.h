@@ -0,0 +1,361 @@
+/*
+  Bulk EPS/UMTS authentication vector generation, to preload core
+  network test rigs (and to measure the Milenage speed)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+*/
+
+#ifndef VECTORS_H
+#define VECTORS_H
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <uicc.h>
+#include <milenage_batch.h>
+#include <tuak.h>
+#include <sha256.h>
+#include <drbg.h>
+
+enum authAlgo { algoMilenage, algoTuak };
+
+struct vectorSubscriber {
+  string imsi;
+  authAlgo algo;
+  u8 k[32];
+  int kLen;
+  u8 opc[32]; // OPc, or TOPc for TUAK
+  uint64_t sqn;
+};
+
+// Subscriber file: one subscriber per line "imsi,key,opc,sqn[,algo]"
+// sqn is the first SQN to use, decimal, # starts a comment line
+// algo is milenage (default) or tuak: then key has 128 or 256 bits and
+// opc is the 256-bit TOPc
+static inline vector<vectorSubscriber> readVectorSubscribers(string name) {
+  vector<vectorSubscriber> subs;
+  FILE *f=fopen(name.c_str(), "r");
+  Assert(f != NULL, "can't open subscriber file %s", name.c_str());
+  char line[256];
+  int lineNb=0;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineNb++;
+
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+
+    char imsi[32], key[80], opc[80], algo[16]="milenage";
+    unsigned long long sqn;
+    string k, o;
+    int fields=sscanf(line, " %31[^,],%79[^,],%79[^,],%llu,%15[a-z]", imsi, key, opc, &sqn, algo);
+    // sscanf leaves the fields after the first mismatch unset
+    Assert(fields >= 4, "%s line %d: expecting imsi,key,opc,sqn[,milenage|tuak]",
+           name.c_str(), lineNb);
+    vectorSubscriber s;
+    s.imsi=imsi;
+    s.algo= strcmp(algo, "tuak") == 0 ? algoTuak : algoMilenage;
+    int kLen=makeBin(key, k), opcLen=makeBin(opc, o);
+    Assert((strcmp(algo, "milenage") == 0 || s.algo == algoTuak) &&
+           (s.algo == algoMilenage ? kLen == 16 && opcLen == 16 :
+            (kLen == 16 || kLen == 32) && opcLen == 32),
+           "%s line %d: expecting imsi,key,opc,sqn[,milenage|tuak]", name.c_str(), lineNb);
+    s.kLen=kLen;
+    memcpy(s.k, k.c_str(), kLen);
+    memcpy(s.opc, o.c_str(), opcLen);
+    s.sqn=sqn & 0xFFFFFFFFFFFFULL;
+    subs.push_back(s);
+  }
+
+  fclose(f);
+  return subs;
+}
+
+/*
+  Serving network name of 5G AKA (TS 24.501 9.12.1):
+  5G:mnc<MNC on 3 digits>.mcc<MCC>.3gppnetwork.org
+  mccMnc: 5 or 6 digits
+*/
+static inline bool fivegServingNetworkName(string mccMnc, string &name) {
+  if ((mccMnc.size() != 5 && mccMnc.size() != 6) ||
+      mccMnc.find_first_not_of("0123456789") != string::npos)
+    return false;
+
+  string mnc=mccMnc.substr(3);
+  name="5G:mnc" + (mnc.size() == 2 ? "0" + mnc : mnc) + ".mcc" + mccMnc.substr(0, 3) +
+       ".3gppnetwork.org";
+  return true;
+}
+
+/*
+  vectorsPerSubscriber vectors for each subscriber, SQN, SQN+32, ...
+  (next SEQ, same IND: TS 33.102 annex C.3.2)
+  Workers take groups of subscribers and compute them with
+  milenage_generate_batch() or tuak_generate_batch(); each group is written at once, so the
+  output is grouped by subscriber but the groups are in any order.
+  CSV: imsi,sqn,rand,xres,autn,ck,ik[,kasme][,xres_star,hxres_star,kausf,kseaf,kamf]
+  [,sres,kc] in hexadecimal
+  binary: fixed size records, all fields big endian
+    imsi (8, as a number) sqn (6) rand (16) xres (8) autn (16) ck (16) ik (16) [kasme (32)]
+    [xres* (16) hxres* (16) kausf (32) kseaf (32) kamf (32)] [sres (4) kc (8)]
+  The GSM triplet (RAND, SRES, Kc) is the conversion of the quintuplet of
+  the same RAND (TS 33.102 6.8.1.2), as the USIM computes it in a GSM
+  security context
+*/
+class VectorGenerator {
+ public:
+  int vectorsPerSubscriber=1;
+  bool binary=false;
+  bool kasme=false;
+  u8 snId[3]; // PLMN of the serving network, for KASME
+  bool fiveG=false;
+  string snName; // serving network name, for the 5G keys
+  bool triplets=false;
+  int threads=thread::hardware_concurrency();
+
+  // mccMnc: 5 or 6 digits
+  bool setServingNetwork(string mccMnc) {
+    if ((mccMnc.size() != 5 && mccMnc.size() != 6) ||
+        mccMnc.find_first_not_of("0123456789") != string::npos)
+      return false;
+
+    u8 d[6];
+
+    for (size_t i=0; i<mccMnc.size(); i++)
+      d[i]=mccMnc[i]-'0';
+
+    // TS 24.301 PLMN encoding, 'F' filler for a 2 digits MNC
+    snId[0]=d[1] << 4 | d[0];
+    snId[1]=(mccMnc.size() == 6 ? d[5] : 0xF) << 4 | d[2];
+    snId[2]=d[4] << 4 | d[3];
+    kasme=true;
+    return true;
+  }
+
+  bool setFiveG(string mccMnc) {
+    return fiveG=fivegServingNetworkName(mccMnc, snName);
+  }
+
+  uint64_t run(const vector<vectorSubscriber> &subs, FILE *out) {
+    if (!binary)
+      fprintf(out, "imsi,sqn,rand,xres,autn,ck,ik%s%s%s\n", kasme ? ",kasme" : "",
+              fiveG ? ",xres_star,hxres_star,kausf,kseaf,kamf" : "", triplets ? ",sres,kc" : "");
+
+    atomic<size_t> next(0);
+    mutex outLock;
+    vector<thread> pool;
+
+    for (int t=0; t < max(threads, 1); t++)
+      pool.push_back(thread(&VectorGenerator::worker, this, cref(subs),
+                            ref(next), out, ref(outLock)));
+
+    for (auto &t : pool)
+      t.join();
+
+    fflush(out);
+    return (uint64_t)subs.size() * vectorsPerSubscriber;
+  }
+
+ private:
+  static const size_t groupVectors=1024;
+
+  // A computed vector, in the subscriber order
+  struct vectorRef {
+    const vectorSubscriber *sub;
+    const u8 *sqn;
+    const u8 *rand;
+    const milenage_out_t *res;
+    const gsm_triplet_t *triplet;
+  };
+
+  void worker(const vector<vectorSubscriber> &subs, atomic<size_t> &next,
+              FILE *out, mutex &outLock) {
+    size_t groupSubs=max(groupVectors / max(vectorsPerSubscriber, 1), (size_t)1);
+    vector<milenage_in_t> in;
+    vector<tuak_in_t> tuakIn;
+    vector<milenage_out_t> res, tuakRes;
+    vector<gsm_triplet_t> trip, tuakTrip;
+    vector<vectorRef> done;
+    vector<fiveg_in_t> fiveIn;
+    vector<fiveg_out_t> fiveOut;
+    string buf;
+
+    while (true) {
+      size_t first=next.fetch_add(groupSubs);
+
+      if (first >= subs.size())
+        break;
+
+      size_t last=min(first + groupSubs, subs.size());
+      in.clear();
+      tuakIn.clear();
+
+      for (size_t s=first; s < last; s++)
+        for (int i=0; i < vectorsPerSubscriber; i++) {
+          const vectorSubscriber &sub=subs[s];
+          u8 rand[16], sqnBytes[6];
+          randomBytes(rand, 16);
+          uint64_t sqn=htobe64((sub.sqn + 32*(uint64_t)i) & 0xFFFFFFFFFFFFULL);
+          memcpy(sqnBytes, (u8 *)&sqn + 2, 6);
+          // separation bit for EPS (TS 33.401 annex H)
+          u8 amf[2]= {0x80, 0};
+
+          if (sub.algo == algoTuak) {
+            tuakIn.push_back(tuak_in_t());
+            tuak_in_t &t=tuakIn.back();
+            memcpy(t.k, sub.k, sub.kLen);
+            t.kLen=sub.kLen;
+            memcpy(t.topc, sub.opc, 32);
+            memcpy(t.rand, rand, 16);
+            memcpy(t.sqn, sqnBytes, 6);
+            memcpy(t.amf, amf, 2);
+          } else {
+            in.push_back(milenage_in_t());
+            milenage_in_t &m=in.back();
+            memcpy(m.k, sub.k, 16);
+            memcpy(m.opc, sub.opc, 16);
+            memcpy(m.rand, rand, 16);
+            memcpy(m.sqn, sqnBytes, 6);
+            memcpy(m.amf, amf, 2);
+          }
+        }
+
+      res.resize(in.size());
+      tuakRes.resize(tuakIn.size());
+      trip.resize(in.size());
+      tuakTrip.resize(tuakIn.size());
+      tuak_generate_batch(tuakIn.data(), tuakRes.data(), tuakIn.size());
+
+      if (triplets) {
+        milenage_generate_batch(in.data(), res.data(), trip.data(), in.size());
+
+        for (size_t t=0; t < tuakIn.size(); t++)
+          gsm_from_umts(tuakRes[t].res, tuakRes[t].ck, tuakRes[t].ik, tuakTrip[t].sres,
+                        tuakTrip[t].kc);
+      } else
+        milenage_generate_batch(in.data(), res.data(), in.size());
+
+      done.clear();
+
+      for (size_t s=first, m=0, t=0; s < last; s++)
+        for (int i=0; i < vectorsPerSubscriber; i++)
+          if (subs[s].algo == algoTuak) {
+            done.push_back({&subs[s], tuakIn[t].sqn, tuakIn[t].rand, &tuakRes[t],
+                            &tuakTrip[t]});
+            t++;
+          } else {
+            done.push_back({&subs[s], in[m].sqn, in[m].rand, &res[m], &trip[m]});
+            m++;
+          }
+
+      if (fiveG) {
+        fiveIn.resize(done.size());
+        fiveOut.resize(done.size());
+
+        for (size_t v=0; v < done.size(); v++) {
+          fiveg_in_t &f=fiveIn[v];
+          memcpy(f.ck, done[v].res->ck, 16);
+          memcpy(f.ik, done[v].res->ik, 16);
+          memcpy(f.rand, done[v].rand, 16);
+          memcpy(f.xres, done[v].res->res, 8);
+          f.xresLen=8;
+          memcpy(f.sqnXorAk, done[v].res->autn, 6);
+          snprintf(f.supi, sizeof(f.supi), "%s", done[v].sub->imsi.c_str());
+        }
+
+        fiveg_derive_batch(fiveIn.data(), fiveOut.data(), done.size(),
+                           (const u8 *)snName.c_str(), snName.size());
+      }
+
+      buf.clear();
+
+      for (size_t v=0; v < done.size(); v++)
+        format(done[v], fiveG ? &fiveOut[v] : NULL, buf);
+
+      lock_guard<mutex> l(outLock);
+      fwrite(buf.data(), 1, buf.size(), out);
+    }
+  }
+
+  static void hex(string &buf, const u8 *data, int len) {
+    static const char digits[]="0123456789abcdef";
+    buf+=',';
+
+    for (int i=0; i < len; i++) {
+      buf+=digits[data[i] >> 4];
+      buf+=digits[data[i] & 0xF];
+    }
+  }
+
+  void format(const vectorRef &v, const fiveg_out_t *five, string &buf) {
+    const vectorSubscriber &sub=*v.sub;
+    const u8 *sqnBytes=v.sqn, *rand=v.rand;
+    const milenage_out_t &res=*v.res;
+    u8 k[32];
+
+    if (kasme)
+      kasme_derive(res.ck, res.ik, snId, res.autn, k);
+
+    if (binary) {
+      uint64_t imsi=htobe64(strtoull(sub.imsi.c_str(), NULL, 10));
+      buf.append((const char *)&imsi, 8);
+      buf.append((const char *)sqnBytes, 6);
+      buf.append((const char *)rand, 16);
+      buf.append((const char *)res.res, 8);
+      buf.append((const char *)res.autn, 16);
+      buf.append((const char *)res.ck, 16);
+      buf.append((const char *)res.ik, 16);
+
+      if (kasme)
+        buf.append((const char *)k, 32);
+
+      if (five != NULL) {
+        buf.append((const char *)five->xresStar, 16);
+        buf.append((const char *)five->hxresStar, 16);
+        buf.append((const char *)five->kausf, 32);
+        buf.append((const char *)five->kseaf, 32);
+        buf.append((const char *)five->kamf, 32);
+      }
+
+      if (triplets) {
+        buf.append((const char *)v.triplet->sres, 4);
+        buf.append((const char *)v.triplet->kc, 8);
+      }
+
+      return;
+    }
+
+    uint64_t sqn=0;
+
+    for (int i=0; i < 6; i++)
+      sqn=sqn << 8 | sqnBytes[i];
+
+    buf+=sub.imsi + ',' + to_string(sqn);
+    hex(buf, rand, 16);
+    hex(buf, res.res, 8);
+    hex(buf, res.autn, 16);
+    hex(buf, res.ck, 16);
+    hex(buf, res.ik, 16);
+
+    if (kasme)
+      hex(buf, k, 32);
+
+    if (five != NULL) {
+      hex(buf, five->xresStar, 16);
+      hex(buf, five->hxresStar, 16);
+      hex(buf, five->kausf, 32);
+      hex(buf, five->kseaf, 32);
+      hex(buf, five->kamf, 32);
+    }
+
+    if (triplets) {
+      hex(buf, v.triplet->sres, 4);
+      hex(buf, v.triplet->kc, 8);
+    }
+
+    buf+='\n';
+  }
+};
+#endif